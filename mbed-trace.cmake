@@ -69,6 +69,117 @@ if (test_all OR ${CMAKE_PROJECT_NAME} STREQUAL "mbedTrace")
     include(GoogleTest)
     gtest_discover_tests(trace_test)
 
+    # Same test suite, with the optional features compiled in
+    add_executable(trace_test_features
+        source/mbed_trace.c
+        test/stubs/ip6tos_stub.c
+        test/Test.cpp
+    )
+
+    target_compile_definitions(trace_test_features PRIVATE
+        MBED_CONF_MBED_TRACE_FEA_ASYNC=1
+        MBED_CONF_MBED_TRACE_FEA_TOKEN=1
+        MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL=1
+        MBED_CONF_MBED_TRACE_FEA_BATCH=1
+        MBED_CONF_MBED_TRACE_FEA_RECORDER=1
+        MBED_CONF_MBED_TRACE_FEA_HISTORY=1
+        MBED_CONF_MBED_TRACE_FEA_STATS=1
+        MBED_CONF_MBED_TRACE_FEA_LATENCY=1
+        MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS=1
+        MBED_CONF_MBED_TRACE_FEA_TIMESTAMP=1
+        MBED_CONF_MBED_TRACE_FEA_STRUCTURED=1
+        MBED_CONF_MBED_TRACE_FEA_SINKS=1
+        MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT=1
+        MBED_TRACE_FILTER_LIST_LENGTH=1024
+        MBED_TRACE_ASYNC_RECORD_COUNT=16
+        MBED_TRACE_HISTORY_DEPTH=16
+    )
+
+    # exercise the vectorized code paths where the compiler can build them
+    include(CheckCCompilerFlag)
+    check_c_compiler_flag(-mssse3 MBED_TRACE_HAVE_SSSE3)
+    if (MBED_TRACE_HAVE_SSSE3)
+        target_compile_options(trace_test_features PRIVATE -mssse3)
+    endif ()
+
+    target_include_directories(trace_test_features PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/mbed-trace)
+    target_include_directories(trace_test_features PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/)
+    target_include_directories(trace_test_features PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/test/stubs)
+
+    target_link_libraries(
+        trace_test_features
+        gtest_main
+        nanostack-libservice
+    )
+
+    set_target_properties(trace_test_features
+    PROPERTIES
+        CXX_STANDARD 11
+    )
+
+    gtest_discover_tests(trace_test_features TEST_PREFIX features.)
+
+    # Microbenchmarks, prints JSON results: trace_bench [--iterations N] [--out file]
+    add_executable(trace_bench
+        source/mbed_trace.c
+        test/stubs/ip6tos_stub.c
+        test/Bench.cpp
+    )
+
+    target_include_directories(trace_bench PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/mbed-trace)
+    target_include_directories(trace_bench PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/)
+    target_include_directories(trace_bench PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/test/stubs)
+
+    target_link_libraries(
+        trace_bench
+        nanostack-libservice
+    )
+
+    set_target_properties(trace_bench
+    PROPERTIES
+        CXX_STANDARD 11
+    )
+
+    # short run to keep the benchmarks working
+    add_test(NAME trace_bench COMMAND trace_bench --iterations 1000)
+
+    # Multithreaded stress test and scalability benchmark, one binary per locking mode:
+    # trace_stress[_tls|_async] [--threads N] [--lines M] [--out file]
+    find_package(Threads REQUIRED)
+    set(TRACE_STRESS_DEFINITIONS_ "")
+    set(TRACE_STRESS_DEFINITIONS__tls MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL=1)
+    set(TRACE_STRESS_DEFINITIONS__async MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL=1 MBED_CONF_MBED_TRACE_FEA_ASYNC=1)
+    foreach (mode "" _tls _async)
+        add_executable(trace_stress${mode}
+            source/mbed_trace.c
+            test/stubs/ip6tos_stub.c
+            test/Stress.cpp
+        )
+
+        target_compile_definitions(trace_stress${mode} PRIVATE ${TRACE_STRESS_DEFINITIONS_${mode}})
+
+        target_include_directories(trace_stress${mode} PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/mbed-trace)
+        target_include_directories(trace_stress${mode} PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/)
+        target_include_directories(trace_stress${mode} PUBLIC ${CMAKE_CURRENT_SOURCE_DIR}/test/stubs)
+
+        target_link_libraries(
+            trace_stress${mode}
+            nanostack-libservice
+            Threads::Threads
+        )
+
+        set_target_properties(trace_stress${mode}
+        PROPERTIES
+            CXX_STANDARD 11
+        )
+
+        add_test(NAME trace_stress${mode} COMMAND trace_stress${mode} --threads 8 --lines 2000)
+    endforeach ()
+
+    # the thread-local mode must scale with the CPUs, skipped on a single CPU host
+    add_test(NAME trace_stress_tls_scaling COMMAND trace_stress_tls --threads 4 --lines 20000 --no-check --min-speedup 1.3)
+    set_tests_properties(trace_stress_tls_scaling PROPERTIES SKIP_RETURN_CODE 77 RUN_SERIAL TRUE)
+
     if (enable_coverage_data AND ${CMAKE_PROJECT_NAME} STREQUAL "mbedTrace")
         file(MAKE_DIRECTORY "${CMAKE_CURRENT_BINARY_DIR}/html")
 
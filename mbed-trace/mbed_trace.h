@@ -110,6 +110,9 @@ extern "C" {
 /** trace nothing  */
 #define TRACE_ACTIVE_LEVEL_NONE   0x00
 
+/** trace group follows the global trace level, see mbed_trace_group_level_set() */
+#define TRACE_GROUP_LEVEL_DEFAULT 0xFF
+
 /** this print is some deep information for debug purpose */
 #define TRACE_LEVEL_DEBUG         0x10
 /** Info print, for general purpose prints */
@@ -125,36 +128,97 @@ extern "C" {
 #define MBED_TRACE_MAX_LEVEL TRACE_LEVEL_DEBUG
 #endif
 
+/** async mode: wait until the queue has room (default), see mbed_trace_async_wait_function_set() */
+#define TRACE_ASYNC_POLICY_BLOCK        0
+/** async mode: discard the new record when the queue is full */
+#define TRACE_ASYNC_POLICY_DROP_NEWEST  1
+/** async mode: discard the oldest queued record when the queue is full */
+#define TRACE_ASYNC_POLICY_DROP_OLDEST  2
+
+/** no built-in timestamp (default) */
+#define TRACE_TIMESTAMP_NONE            0
+/** built-in timestamp in seconds since boot, "[1234.567] " */
+#define TRACE_TIMESTAMP_MONOTONIC       1
+/** built-in UTC wall clock timestamp, "[2021-06-01T12:34:56.789Z] " */
+#define TRACE_TIMESTAMP_REALTIME        2
+
+/** "[INFO][grp ]: text" lines (default) */
+#define TRACE_FORMAT_TEXT               0
+/** one JSON object per line, {"seq":1,"time":123,"level":"info","group":"grp","msg":"text"} */
+#define TRACE_FORMAT_JSON               1
+/** logfmt lines, seq=1 time=123 level=info group=grp msg="text" */
+#define TRACE_FORMAT_LOGFMT             2
+
+/**
+ * Check of the usage macros, made before evaluating the trace arguments.
+ * The first check is a single load of mbed_trace_active_levels, the group
+ * filters and group levels are checked only when some group has the level active.
+ * With MBED_CONF_MBED_TRACE_FEA_STATS mbed_trace_check() is called for every trace,
+ * so that the traces left out are counted.
+ */
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+#define MBED_TRACE_CALL_CHECK(dlevel, grp) mbed_trace_check(dlevel, grp)
+#else
+#define MBED_TRACE_CALL_CHECK(dlevel, grp) (mbed_trace_level_active(dlevel) && mbed_trace_check(dlevel, grp))
+#endif
+
+/**
+ * Trace call which is skipped before evaluating the arguments when the level is not active.
+ */
+#define MBED_TRACE_CALL(dlevel, grp, ...) \
+    (MBED_TRACE_CALL_CHECK(dlevel, grp) ? mbed_tracef(dlevel, grp, __VA_ARGS__) : (void) 0)
+
+/**
+ * Rate limited trace call, each call site has its own token bucket, see mbed_trace_ratelimit_set().
+ * Suppressed traces are counted before evaluating any arguments.
+ */
+#define MBED_TRACE_CALL_RATELIMITED(dlevel, grp, ...) \
+    do { \
+        static mbed_trace_ratelimit_t mbed_trace_ratelimit_site; \
+        if (MBED_TRACE_CALL_CHECK(dlevel, grp) && \
+                mbed_trace_ratelimit(&mbed_trace_ratelimit_site, dlevel, grp)) { \
+            mbed_tracef(dlevel, grp, __VA_ARGS__); \
+        } \
+    } while (0)
+
 //usage macros:
 #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_DEBUG
-#define tr_debug(...)           mbed_tracef(TRACE_LEVEL_DEBUG,   TRACE_GROUP, __VA_ARGS__)   //!< Print debug message
+#define tr_debug(...)           MBED_TRACE_CALL(TRACE_LEVEL_DEBUG,   TRACE_GROUP, __VA_ARGS__)   //!< Print debug message
+#define tr_debug_ratelimited(...) MBED_TRACE_CALL_RATELIMITED(TRACE_LEVEL_DEBUG, TRACE_GROUP, __VA_ARGS__) //!< Print rate limited debug message
 #else
 #define tr_debug(...)
+#define tr_debug_ratelimited(...)
 #endif
 
 #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_INFO
-#define tr_info(...)            mbed_tracef(TRACE_LEVEL_INFO,    TRACE_GROUP, __VA_ARGS__)   //!< Print info message
+#define tr_info(...)            MBED_TRACE_CALL(TRACE_LEVEL_INFO,    TRACE_GROUP, __VA_ARGS__)   //!< Print info message
+#define tr_info_ratelimited(...)  MBED_TRACE_CALL_RATELIMITED(TRACE_LEVEL_INFO,  TRACE_GROUP, __VA_ARGS__) //!< Print rate limited info message
 #else
 #define tr_info(...)
+#define tr_info_ratelimited(...)
 #endif
 
 #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_WARN
-#define tr_warning(...)         mbed_tracef(TRACE_LEVEL_WARN,    TRACE_GROUP, __VA_ARGS__)   //!< Print warning message
-#define tr_warn(...)            mbed_tracef(TRACE_LEVEL_WARN,    TRACE_GROUP, __VA_ARGS__)   //!< Alternative warning message
+#define tr_warning(...)         MBED_TRACE_CALL(TRACE_LEVEL_WARN,    TRACE_GROUP, __VA_ARGS__)   //!< Print warning message
+#define tr_warn(...)            MBED_TRACE_CALL(TRACE_LEVEL_WARN,    TRACE_GROUP, __VA_ARGS__)   //!< Alternative warning message
+#define tr_warn_ratelimited(...)  MBED_TRACE_CALL_RATELIMITED(TRACE_LEVEL_WARN,  TRACE_GROUP, __VA_ARGS__) //!< Print rate limited warning message
 #else
 #define tr_warning(...)
 #define tr_warn(...)
+#define tr_warn_ratelimited(...)
 #endif
 
 #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_ERROR
-#define tr_error(...)           mbed_tracef(TRACE_LEVEL_ERROR,   TRACE_GROUP, __VA_ARGS__)   //!< Print Error Message
-#define tr_err(...)             mbed_tracef(TRACE_LEVEL_ERROR,   TRACE_GROUP, __VA_ARGS__)   //!< Alternative error message
+#define tr_error(...)           MBED_TRACE_CALL(TRACE_LEVEL_ERROR,   TRACE_GROUP, __VA_ARGS__)   //!< Print Error Message
+#define tr_err(...)             MBED_TRACE_CALL(TRACE_LEVEL_ERROR,   TRACE_GROUP, __VA_ARGS__)   //!< Alternative error message
+#define tr_error_ratelimited(...) MBED_TRACE_CALL_RATELIMITED(TRACE_LEVEL_ERROR, TRACE_GROUP, __VA_ARGS__) //!< Print rate limited error message
 #else
 #define tr_error(...)
 #define tr_err(...)
+#define tr_error_ratelimited(...)
 #endif
 
-#define tr_cmdline(...)         mbed_tracef(TRACE_LEVEL_CMD,     TRACE_GROUP, __VA_ARGS__)   //!< Special print for cmdline. See more from TRACE_LEVEL_CMD -level
+#define tr_cmdline(...)         MBED_TRACE_CALL(TRACE_LEVEL_CMD,     TRACE_GROUP, __VA_ARGS__)   //!< Special print for cmdline. See more from TRACE_LEVEL_CMD -level
 
 //aliases for the most commonly used functions and the helper functions
 #define tracef(dlevel, grp, ...)                mbed_tracef(dlevel, grp, __VA_ARGS__)       //!< Alias for mbed_tracef()
@@ -250,6 +314,38 @@ void mbed_trace_print_function_set(void (*print_f)(const char *));
  * Set trace print function for tr_cmdline()
  */
 void mbed_trace_cmdprint_function_set(void (*printf)(const char *));
+/**
+ * Set trace print function with length
+ * The line is given with a line feed and its length, so the print function
+ * needs neither strlen() nor a separate call for the line feed, e.g.
+ *   void trace_write(const char *str, size_t len) { write(fd, str, len); }
+ * The line is null terminated after the line feed. This replaces the
+ * function set with mbed_trace_print_function_set() and vice versa.
+ * The default print function writes to stdout with fwrite().
+ */
+void mbed_trace_printn_function_set(void (*printn)(const char *str, size_t len));
+/**
+ * Set trace print function with length for tr_cmdline()
+ * Replaces the function set with mbed_trace_cmdprint_function_set() and vice versa.
+ */
+void mbed_trace_cmdprintn_function_set(void (*printn)(const char *str, size_t len));
+/** One output segment for the scatter-gather print function, same layout as POSIX struct iovec */
+typedef struct mbed_trace_iovec_s {
+    const void *iov_base;
+    size_t iov_len;
+} mbed_trace_iovec_t;
+/**
+ * Set scatter-gather print function
+ * The trace line is given as segments which point directly to the format
+ * string, string arguments and tag strings, ending with a "\n" segment.
+ * Other conversions are formatted to the line buffer. A file descriptor
+ * sink can e.g. writev() the line without assembling it first:
+ *   void trace_writev(const mbed_trace_iovec_t *iov, int count) { writev(fd, (const struct iovec *)iov, count); }
+ *   mbed_trace_printv_function_set(trace_writev);
+ * When set, this is used instead of the print function and string
+ * arguments are not limited by the line buffer length.
+ */
+void mbed_trace_printv_function_set(void (*printv)(const mbed_trace_iovec_t *iov, int count));
 /**
  * Set trace mutex wait function
  * By default, trace calls are not thread safe.
@@ -266,6 +362,314 @@ void mbed_trace_mutex_wait_function_set(void (*mutex_wait_f)(void));
  * be acquired from a single thread repeatedly.
  */
 void mbed_trace_mutex_release_function_set(void (*mutex_release_f)(void));
+/**
+ * Set trace time function
+ * Returns current time in application specific units (e.g. milliseconds or RTOS ticks).
+ * Used to timestamp tokenized records.
+ */
+void mbed_trace_time_function_set(uint32_t (*time_f)(void));
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+/**
+ * Set built-in timestamp of the trace lines
+ * The timestamp is printed after the prefix of the decorated lines, plain and
+ * cmd lines are not stamped. It is read from the coarse POSIX clocks with
+ * millisecond resolution, and the seconds part is formatted only once a second.
+ * Requires MBED_CONF_MBED_TRACE_FEA_TIMESTAMP and clock_gettime().
+ * @param mode  TRACE_TIMESTAMP_NONE, TRACE_TIMESTAMP_MONOTONIC or TRACE_TIMESTAMP_REALTIME
+ * @return 0 on success, -1 if the mode is unknown
+ */
+int mbed_trace_timestamp_set(uint8_t mode);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+/**
+ * Set line format of the decorated trace lines
+ * The JSON and logfmt formats carry the sequence number of the line, the time,
+ * level, group and message as fields, and the message is escaped as a quoted
+ * string. The time is the built-in timestamp when set, see mbed_trace_timestamp_set(),
+ * otherwise the value of the time function, and left out without either. The
+ * prefix, suffix and color are not used. Plain and cmd lines are not affected.
+ * Requires MBED_CONF_MBED_TRACE_FEA_STRUCTURED.
+ * @param format  TRACE_FORMAT_TEXT, TRACE_FORMAT_JSON or TRACE_FORMAT_LOGFMT
+ * @return 0 on success, -1 if the format is unknown
+ */
+int mbed_trace_format_set(uint8_t format);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+/**
+ * Set output function for tokenized traces
+ * When set, trace calls are not formatted. Instead a compact binary record containing
+ * the addresses of the format string and the trace group, trace level, timestamp and
+ * the raw argument values is passed to token_f. String arguments are copied to the record.
+ * tools/mbed_trace_decode.py turns the records back into trace lines using the ELF file
+ * of the application, so the format strings and trace groups must be string literals.
+ * A stream header record is passed to token_f when the function is set.
+ * tr_cmdline() output is not affected.
+ * Requires MBED_CONF_MBED_TRACE_FEA_TOKEN.
+ *
+ * @param token_f  record output function, NULL disables tokenized mode
+ */
+void mbed_trace_token_function_set(void (*token_f)(const uint8_t *data, size_t len));
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+/**
+ * Enable asynchronous trace output
+ * Formatted trace lines are copied to a lock-free queue instead of calling
+ * the print function directly. The application drains the queue with
+ * mbed_trace_async_drain(), typically from a low priority thread which is
+ * woken up by the notify function.
+ * Calling this again resizes the queue; pending records are printed first.
+ * With MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL, tracing threads queue records without the
+ * mutex, so this must be called only while no other thread is tracing.
+ * Requires MBED_CONF_MBED_TRACE_FEA_ASYNC.
+ *
+ * @param record_count  number of queued records, rounded up to a power of two. 0 disables async mode.
+ * @return 0 when success, otherwise non zero (queue allocation failed, or
+ *         mbed_trace_async_drain() is running in another thread)
+ */
+int mbed_trace_async_enable(uint16_t record_count);
+/**
+ * Set policy for a full async queue
+ * TRACE_ASYNC_POLICY_BLOCK (default) makes the tracing thread call the notify function
+ * and then the wait function until the drain thread has made room. Without a wait
+ * function the new record is dropped. TRACE_ASYNC_POLICY_DROP_NEWEST and
+ * TRACE_ASYNC_POLICY_DROP_OLDEST discard records.
+ */
+void mbed_trace_async_policy_set(uint8_t policy);
+/**
+ * Set function which is called every time a record is queued.
+ * Can be used e.g. to signal the drain thread.
+ */
+void mbed_trace_async_notify_function_set(void (*notify_f)(void));
+/**
+ * Set function which a tracing thread calls while the queue is full, with
+ * TRACE_ASYNC_POLICY_BLOCK. It should let the drain thread run, e.g. sleep
+ * for a tick or wait for a signal given after mbed_trace_async_drain().
+ * With the buffers shared between threads, it is called with the mutex held.
+ */
+void mbed_trace_async_wait_function_set(void (*wait_f)(void));
+/**
+ * Print out all queued records using the print functions
+ * The print functions are called without the mutex, so tracing threads can
+ * queue records meanwhile. One thread prints at a time: when another thread
+ * is already draining, this returns 0 and that thread prints the records.
+ * With MBED_CONF_MBED_TRACE_FEA_BATCH the print functions and the batch buffer
+ * belong to the draining thread, change them only while no drain is running.
+ * @return number of printed records
+ */
+int mbed_trace_async_drain(void);
+/** get number of records dropped because the async queue was full
+ */
+uint32_t mbed_trace_async_dropped_get(void);
+/**
+ * Get sequence number of the record currently printed by mbed_trace_async_drain().
+ * Valid inside the print function. Every trace line gets a sequence number,
+ * so gaps tell that records were dropped.
+ */
+uint32_t mbed_trace_async_sequence_get(void);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+/**
+ * Enable batched output
+ * Trace lines, each ending with a line feed, are collected to a buffer which is
+ * given to write_f when a flush threshold is reached or mbed_trace_flush() is called.
+ * There are two buffers, so a batch given to write_f is left untouched until the next
+ * call of write_f returns: write_f can e.g. start a DMA transfer and return, as long as
+ * it waits for the previous transfer before starting a new one.
+ * When enabled, this is used instead of the print functions; tr_cmdline() output
+ * still goes to the cmdprint functions when they are set.
+ * Requires MBED_CONF_MBED_TRACE_FEA_BATCH.
+ *
+ * @param write_f  batch output function
+ * @param size     size of one buffer, 0 writes out pending lines and disables batching
+ * @return 0 when success, otherwise non zero (buffer allocation failed)
+ */
+int mbed_trace_batch_enable(void (*write_f)(const char *data, size_t len), size_t size);
+/**
+ * Set batch flush thresholds
+ * The age is checked when a line is added, so an application which may go idle
+ * with lines pending should also call mbed_trace_flush() periodically.
+ *
+ * @param bytes         flush when this many bytes are buffered, 0 or more than the buffer size flushes only full buffers
+ * @param lines         flush when this many lines are buffered, 0 disables
+ * @param max_age       flush when the oldest buffered line is this old, in units of the
+ *                      mbed_trace_time_function_set() function; 0 disables
+ * @param flush_levels  TRACE_LEVEL_* bitmask of levels flushed right away, TRACE_LEVEL_ERROR by default
+ */
+void mbed_trace_batch_thresholds_set(size_t bytes, uint16_t lines, uint32_t max_age, uint8_t flush_levels);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+/**
+ * Set flight recorder region
+ * The recorder keeps the latest trace lines in a circular buffer in a memory region,
+ * e.g. a MAP_SHARED mmap() of a file or RAM which is retained over a reset, so
+ * the lines survive a crash without ever being written out.
+ * The region starts with a header holding the write cursor and a wrap counter,
+ * tools/mbed_trace_recorder.py prints the lines of a region in order.
+ * When the region already holds a recorder of the same size, new lines are
+ * appended to it, otherwise it is initialized.
+ * Lines are written with mbed_trace_recorder_printn():
+ *   mbed_trace_recorder_init(region, size);
+ *   mbed_trace_printn_function_set(mbed_trace_recorder_printn);
+ * Requires MBED_CONF_MBED_TRACE_FEA_RECORDER.
+ *
+ * @param region  4 byte aligned memory region, NULL to detach the recorder
+ * @param size    size of the region, at least 96 bytes
+ * @return 0 when success, -1 for an unaligned or too small region
+ */
+int mbed_trace_recorder_init(void *region, size_t size);
+/**
+ * Print function which writes to the flight recorder region
+ */
+void mbed_trace_recorder_printn(const char *str, size_t len);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+/**
+ * Enable trace history
+ * Traces of the history levels are not printed but stored unformatted to a ring of
+ * the latest depth records. When a trace of a trigger level is printed, the stored
+ * records are printed out first, so e.g. the debug traces leading to an error are
+ * seen without the cost of printing all debug traces.
+ * Format strings and trace groups are stored as pointers and must stay valid,
+ * string arguments are copied. A record holds MBED_TRACE_HISTORY_RECORD_LENGTH
+ * bytes (default 128), arguments not fitting to it are left out.
+ * Requires MBED_CONF_MBED_TRACE_FEA_HISTORY.
+ *
+ * @param depth  number of records to keep, 0 disables the history and drops the records
+ * @return 0 when success, otherwise non zero (buffer allocation failed)
+ */
+int mbed_trace_history_enable(uint16_t depth);
+/**
+ * Set history levels
+ * The history levels are stored also when they are not in the active trace levels.
+ *
+ * @param history_levels  TRACE_LEVEL_* bitmask of levels stored to the history, TRACE_LEVEL_DEBUG by default
+ * @param trigger_levels  TRACE_LEVEL_* bitmask of levels printing out the history, TRACE_LEVEL_ERROR by default
+ */
+void mbed_trace_history_levels_set(uint8_t history_levels, uint8_t trigger_levels);
+/**
+ * Print out and clear the stored history, e.g. from an assert handler
+ */
+void mbed_trace_history_dump(void);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+/** trace statistics, see mbed_trace_stats_get() */
+typedef struct mbed_trace_stats_s {
+    /** traces handed to the output, once also when several sinks print them */
+    uint32_t emitted;
+    /** traces left out by the group filters */
+    uint32_t filtered;
+    /** traces left out by the active level of the trace group */
+    uint32_t masked;
+    /** traces cut to the line length in some output */
+    uint32_t truncated;
+    /** mbed_trace_array() results cut to the helper buffer, only in the totals */
+    uint32_t array_overflows;
+    /** bytes handed to the output, summed over the sinks */
+    uint32_t bytes;
+    /** time spent in the output and in the sinks, in units of the mbed_trace_clock_function_set() function */
+    uint32_t output_time;
+} mbed_trace_stats_t;
+/**
+ * Get trace statistics
+ * The counters are kept per trace level and per trace group with its own settings,
+ * see mbed_trace_group_level_set(). Traces which the usage macros skip before
+ * calling mbed_tracef() are counted by mbed_trace_check().
+ * Requires MBED_CONF_MBED_TRACE_FEA_STATS.
+ *
+ * @param levels  TRACE_LEVEL_* bitmask of the levels to sum up, e.g. TRACE_ACTIVE_LEVEL_ALL
+ * @param stats   statistics to fill in
+ */
+void mbed_trace_stats_get(uint8_t levels, mbed_trace_stats_t *stats);
+/**
+ * Get trace statistics of one trace group, summed over all levels
+ * @param grp    trace group name
+ * @param stats  statistics to fill in
+ * @return 0 when success, -1 when the group has no settings
+ */
+int mbed_trace_group_stats_get(const char *grp, mbed_trace_stats_t *stats);
+/**
+ * Clear all trace statistics
+ */
+void mbed_trace_stats_reset(void);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+/** trace phases with a latency histogram */
+/** waiting for the trace mutex */
+#define TRACE_LATENCY_LOCK      0
+/** formatting the line, including the prefix and suffix functions */
+#define TRACE_LATENCY_FORMAT    1
+/** each call of the prefix and suffix functions */
+#define TRACE_LATENCY_PREFIX    2
+/** print functions, or the async queue */
+#define TRACE_LATENCY_OUTPUT    3
+#define TRACE_LATENCY_PHASES    4
+/** number of histogram buckets, four buckets for each power of two */
+#define TRACE_LATENCY_BUCKETS   124
+/** latency histogram of one trace phase, see mbed_trace_latency_get() */
+typedef struct mbed_trace_latency_s {
+    /** number of measurements */
+    uint32_t count;
+    /** longest measurement */
+    uint32_t max;
+    /** measurements in log buckets, the values of a bucket differ by at most 25% */
+    uint32_t buckets[TRACE_LATENCY_BUCKETS];
+} mbed_trace_latency_t;
+/**
+ * Get a snapshot of the latency histogram of one trace phase
+ * The time is measured with the mbed_trace_clock_function_set() function.
+ * Requires MBED_CONF_MBED_TRACE_FEA_LATENCY.
+ * @param phase    TRACE_LATENCY_* phase
+ * @param latency  histogram to fill in
+ */
+void mbed_trace_latency_get(uint8_t phase, mbed_trace_latency_t *latency);
+/**
+ * Get a quantile of a latency histogram, e.g. 990 for p99
+ * @param latency  histogram from mbed_trace_latency_get()
+ * @param permille quantile in 1/1000
+ * @return upper bound of the bucket holding the quantile, at most the max
+ */
+uint32_t mbed_trace_latency_quantile(const mbed_trace_latency_t *latency, uint16_t permille);
+/**
+ * Write a text summary of all latency histograms, one line per phase:
+ *   "output: count 12 p50 3 p90 5 p99 40 p999 40 max 38"
+ * @param buf   buffer to write to
+ * @param size  size of the buffer
+ * @return length of the text, cut to the buffer
+ */
+int mbed_trace_latency_dump(char *buf, size_t size);
+/**
+ * Clear all latency histograms
+ */
+void mbed_trace_latency_reset(void);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+/**
+ * Set clock function used to measure the time spent in the trace functions
+ * This should be a cheap and fine grained clock, e.g. a cycle counter or a
+ * microsecond timer. Without it no time is measured.
+ * Requires MBED_CONF_MBED_TRACE_FEA_STATS or MBED_CONF_MBED_TRACE_FEA_LATENCY.
+ * @param clock_f  function returning the current clock value
+ */
+void mbed_trace_clock_function_set(uint32_t (*clock_f)(void));
+#endif
+/**
+ * Coalesce repeated trace lines
+ * When enabled, a trace line with the same level, group and text as the previous
+ * line is not printed but counted. The count is printed as one
+ * "last message repeated N times" line when a different line is traced,
+ * when mbed_trace_flush() is called, or when the repeats have continued for
+ * the timeout. Decorations such as the prefix are not compared.
+ *
+ * @param enable   true to coalesce repeated lines
+ * @param timeout  print the count at least this often, in units of the
+ *                 mbed_trace_time_function_set() function; 0 disables
+ */
+void mbed_trace_coalesce_set(bool enable, uint32_t timeout);
+/**
+ * Write out buffered trace output, e.g. before a reset or from a periodic timer
+ * This also prints the count of pending repeated lines, see mbed_trace_coalesce_set().
+ */
+void mbed_trace_flush(void);
 /**
  * When trace group contains text in filters,
  * trace print will be ignored.
@@ -289,6 +693,141 @@ void mbed_trace_include_filters_set(char *filters);
 /** get trace include filters
  */
 const char *mbed_trace_include_filters_get(void);
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+/**
+ * Register an output sink
+ * Each sink has its own trace levels, groups and line style. A trace line is
+ * formatted once for each line style wanted by the sinks, and the same text is
+ * given to all sinks of that style; no formatting is done when no sink wants
+ * the line. Sinks get the lines in addition to the print function, which can be
+ * left out with mbed_trace_printn_function_set(NULL). The levels of a sink do not
+ * depend on the trace configuration or the group levels; the include and exclude
+ * filters apply.
+ * Batching, coalescing and the history are used only with the print function.
+ * Requires MBED_CONF_MBED_TRACE_FEA_SINKS.
+ * e.g.:
+ *  mbed_trace_sink_add(console_printn, TRACE_ACTIVE_LEVEL_INFO | TRACE_MODE_COLOR, NULL);
+ *  mbed_trace_sink_add(file_printn, TRACE_ACTIVE_LEVEL_ALL, "mac,net*");
+ *
+ * @param printn  print function, gets the line with a line feed
+ * @param config  active levels and TRACE_MODE_* bits as with mbed_trace_config_set()
+ * @param groups  comma separated groups as with mbed_trace_include_filters_set(),
+ *                NULL for all groups
+ * @return sink id, or -1 if MBED_TRACE_SINK_COUNT (default 4) sinks are registered
+ *         or the groups do not fit to memory
+ */
+int mbed_trace_sink_add(void (*printn)(const char *str, size_t len), uint8_t config, const char *groups);
+/**
+ * Unregister an output sink
+ * @param sink  sink id from mbed_trace_sink_add()
+ * @return 0 on success, -1 if the sink is not registered
+ */
+int mbed_trace_sink_remove(int sink);
+#endif
+/**
+ * Set active trace level of one trace group
+ * Overrides the level given with mbed_trace_config_set() for the group,
+ * in both directions. Trace groups are interned to a table of MBED_TRACE_GROUP_COUNT
+ * entries (default 8), so the level lookup does not depend on the number of groups.
+ * e.g.:
+ *  mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+ *  mbed_trace_group_level_set("mac", TRACE_ACTIVE_LEVEL_DEBUG);
+ *  mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "This is printed");
+ *  mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "This is not printed");
+ *
+ * @param grp    trace group name, max 7 characters
+ * @param level  TRACE_ACTIVE_LEVEL_* bitmask, or TRACE_GROUP_LEVEL_DEFAULT to follow the global level again
+ * @return 0 when success, -1 when the group table is full or the name is too long
+ */
+int mbed_trace_group_level_set(const char *grp, uint8_t level);
+/** get active trace level of one trace group
+ * @return TRACE_ACTIVE_LEVEL_* bitmask, or TRACE_GROUP_LEVEL_DEFAULT when the group follows the global level
+ */
+uint8_t mbed_trace_group_level_get(const char *grp);
+/**
+ * Sample traces of one trace group
+ * Only every rate:th trace of the given levels is printed, e.g. to keep some
+ * visibility to high volume debug traces at a fraction of the cost. The decision
+ * is made before formatting. The group is interned like with mbed_trace_group_level_set().
+ * e.g.:
+ *  mbed_trace_group_sample_set("mac", TRACE_LEVEL_DEBUG, 100); // 1 in 100 debug traces
+ *
+ * @param grp     trace group name, max 7 characters
+ * @param levels  TRACE_LEVEL_* bitmask of sampled levels
+ * @param rate    print 1 in rate traces, 0 or 1 prints all; also resets the statistics
+ * @return 0 when success, -1 when the group table is full or the name is too long
+ */
+int mbed_trace_group_sample_set(const char *grp, uint8_t levels, uint16_t rate);
+/**
+ * Get sampling statistics of one trace group
+ * A printed sampled trace stands for seen / printed traces.
+ * @param grp      trace group name
+ * @param seen     number of traces of the sampled levels, may be NULL
+ * @param printed  number of them printed, may be NULL
+ * @return 0 when success, -1 when the group has no settings
+ */
+int mbed_trace_group_sample_stats_get(const char *grp, uint32_t *seen, uint32_t *printed);
+/**
+ * Union of all active trace levels: the global level and the levels of all trace groups.
+ * Updated by mbed_trace_config_set() and mbed_trace_group_level_set(), read by the usage macros.
+ */
+extern volatile uint8_t mbed_trace_active_levels;
+/**
+ * Check if a trace level may be active for some trace group
+ * This is a single load, usage macros use it to skip disabled traces
+ * before evaluating any arguments.
+ */
+static inline bool mbed_trace_level_active(uint8_t dlevel)
+{
+    return (mbed_trace_active_levels & dlevel) != 0;
+}
+/**
+ * Check if a trace would be printed
+ * Checks trace level, group level and group filters without formatting anything.
+ * @param dlevel debug level
+ * @param grp    trace group
+ * @return true when mbed_tracef() with the same level and group would print
+ */
+bool mbed_trace_enabled(uint8_t dlevel, const char *grp);
+/**
+ * Check if a trace would be printed, used by the usage macros
+ * As mbed_trace_enabled(), and a trace left out is counted in the statistics
+ * as filtered or masked, as mbed_tracef() would count it.
+ * @param dlevel debug level
+ * @param grp    trace group
+ * @return true when the trace should be passed to mbed_tracef()
+ */
+bool mbed_trace_check(uint8_t dlevel, const char *grp);
+/** rate limit state of one call site, zero initialized, see MBED_TRACE_CALL_RATELIMITED() */
+typedef struct mbed_trace_ratelimit_s {
+    /** time when the next trace is allowed without using the burst */
+    uint32_t next;
+    /** traces suppressed since the last printed one */
+    uint32_t suppressed;
+} mbed_trace_ratelimit_t;
+/**
+ * Set rate limit of the rate limited usage macros, e.g. tr_warn_ratelimited()
+ * Each call site may print burst traces, after which one more trace is allowed
+ * every interval. When a trace is printed after suppressed ones, it is preceded
+ * by a "N messages suppressed" line. Rate limiting needs a time function,
+ * see mbed_trace_time_function_set(), without it all traces are printed.
+ * e.g.:
+ *  mbed_trace_time_function_set(uptime_ms);
+ *  mbed_trace_ratelimit_set(10, 1000); // 10 traces, then one per second
+ *
+ * @param burst     number of traces printed in a row, 0 disables rate limiting
+ * @param interval  time for one more trace, in units of the time function
+ */
+void mbed_trace_ratelimit_set(uint16_t burst, uint32_t interval);
+/**
+ * Check the rate limit of a call site, used by the rate limited usage macros
+ * Prints the count of suppressed traces when the trace is allowed again.
+ * @param rl      call site state
+ * @param dlevel  debug level
+ * @param grp     trace group
+ * @return true when the trace is printed, false when it is suppressed
+ */
+bool mbed_trace_ratelimit(mbed_trace_ratelimit_t *rl, uint8_t dlevel, const char *grp);
 /**
  * General trace function
  * This should be used every time when user want to print out something important thing
@@ -368,6 +907,27 @@ char *mbed_trace_ipv6_prefix(const uint8_t *prefix, uint8_t prefix_len);
  * which indicate that buffer is too small for array.
  */
 char *mbed_trace_array(const uint8_t *buf, uint16_t len);
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+/*
+ * Helper conversions of the format strings
+ * These print the same as the helper functions, but they are expanded only when
+ * the trace is printed, so a trace left out by its level or group costs nothing for them.
+ *  %*pH  bytes in hex as with mbed_trace_array(), takes the length (int) and the buffer
+ *  %pI6  IPv6 address as with mbed_trace_ipv6(), takes the 16 byte address
+ *  %*pP  IPv6 prefix as with mbed_trace_ipv6_prefix(), takes the prefix length (int) and the prefix
+ * usage e.g.
+ *  tr_debug("arr: %*pH from %pI6", (int)sizeof(myarr), myarr, addr);
+ *
+ * The output is limited by the line buffer only. Requires MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT
+ * with MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT, and MBED_CONF_MBED_TRACE_FEA_IPV6 for the IPv6
+ * conversions. A format which also has conversions that only the C library formats,
+ * like %n or %lc, is printed as it is, without the arguments.
+ *
+ * Note that this changes the meaning of existing formats where %p is directly followed
+ * by H, I6 or P: "ptr=%pHandle" is taken as %pH followed by "andle". Other letters after
+ * %p are printed as before; separate the text from the conversion, e.g. "ptr=%p Handle".
+ */
+#endif
 
 #ifdef __cplusplus
 }
@@ -395,12 +955,54 @@ char *mbed_trace_array(const uint8_t *buf, uint16_t len);
 #undef mbed_trace_suffix_function_set
 #undef mbed_trace_print_function_set
 #undef mbed_trace_cmdprint_function_set
+#undef mbed_trace_printn_function_set
+#undef mbed_trace_cmdprintn_function_set
+#undef mbed_trace_printv_function_set
 #undef mbed_trace_mutex_wait_function_set
 #undef mbed_trace_mutex_release_function_set
+#undef mbed_trace_time_function_set
+#undef mbed_trace_timestamp_set
+#undef mbed_trace_format_set
+#undef mbed_trace_token_function_set
+#undef mbed_trace_batch_enable
+#undef mbed_trace_batch_thresholds_set
+#undef mbed_trace_coalesce_set
+#undef mbed_trace_flush
+#undef mbed_trace_recorder_init
+#undef mbed_trace_recorder_printn
+#undef mbed_trace_history_enable
+#undef mbed_trace_history_levels_set
+#undef mbed_trace_history_dump
+#undef mbed_trace_clock_function_set
+#undef mbed_trace_stats_get
+#undef mbed_trace_group_stats_get
+#undef mbed_trace_stats_reset
+#undef mbed_trace_latency_get
+#undef mbed_trace_latency_quantile
+#undef mbed_trace_latency_dump
+#undef mbed_trace_latency_reset
+#undef mbed_trace_async_enable
+#undef mbed_trace_async_policy_set
+#undef mbed_trace_async_notify_function_set
+#undef mbed_trace_async_wait_function_set
+#undef mbed_trace_async_drain
+#undef mbed_trace_async_dropped_get
+#undef mbed_trace_async_sequence_get
 #undef mbed_trace_exclude_filters_set
 #undef mbed_trace_exclude_filters_get
 #undef mbed_trace_include_filters_set
 #undef mbed_trace_include_filters_get
+#undef mbed_trace_sink_add
+#undef mbed_trace_sink_remove
+#undef mbed_trace_group_level_set
+#undef mbed_trace_group_level_get
+#undef mbed_trace_group_sample_set
+#undef mbed_trace_group_sample_stats_get
+#undef mbed_trace_level_active
+#undef mbed_trace_enabled
+#undef mbed_trace_check
+#undef mbed_trace_ratelimit_set
+#undef mbed_trace_ratelimit
 #undef mbed_tracef
 #undef mbed_vtracef
 #undef mbed_trace_last
@@ -420,13 +1022,55 @@ char *mbed_trace_array(const uint8_t *buf, uint16_t len);
 #define mbed_trace_suffix_function_set(...)         ((void) 0)
 #define mbed_trace_print_function_set(...)          ((void) 0)
 #define mbed_trace_cmdprint_function_set(...)       ((void) 0)
+#define mbed_trace_printn_function_set(...)         ((void) 0)
+#define mbed_trace_cmdprintn_function_set(...)      ((void) 0)
+#define mbed_trace_printv_function_set(...)         ((void) 0)
 #define mbed_trace_mutex_wait_function_set(...)     ((void) __VA_ARGS__)
 #define mbed_trace_mutex_release_function_set(...)  ((void) __VA_ARGS__)
+#define mbed_trace_time_function_set(...)           ((void) __VA_ARGS__)
+#define mbed_trace_timestamp_set(...)               ((int) 0)
+#define mbed_trace_format_set(...)                  ((int) 0)
+#define mbed_trace_token_function_set(...)          ((void) __VA_ARGS__)
+#define mbed_trace_batch_enable(...)                ((int) 0)
+#define mbed_trace_batch_thresholds_set(...)        ((void) 0)
+#define mbed_trace_coalesce_set(...)                ((void) 0)
+#define mbed_trace_flush(...)                       ((void) 0)
+#define mbed_trace_recorder_init(...)               ((int) 0)
+#define mbed_trace_recorder_printn(...)             ((void) 0)
+#define mbed_trace_history_enable(...)              ((int) 0)
+#define mbed_trace_history_levels_set(...)          ((void) 0)
+#define mbed_trace_history_dump(...)                ((void) 0)
+#define mbed_trace_clock_function_set(...)          ((void) __VA_ARGS__)
+#define mbed_trace_stats_get(...)                   ((void) 0)
+#define mbed_trace_group_stats_get(...)             ((int) -1)
+#define mbed_trace_stats_reset(...)                 ((void) 0)
+#define mbed_trace_latency_get(...)                 ((void) 0)
+#define mbed_trace_latency_quantile(...)            ((uint32_t) 0)
+#define mbed_trace_latency_dump(...)                ((int) 0)
+#define mbed_trace_latency_reset(...)               ((void) 0)
+#define mbed_trace_async_enable(...)                ((int) 0)
+#define mbed_trace_async_policy_set(...)            ((void) 0)
+#define mbed_trace_async_notify_function_set(...)   ((void) __VA_ARGS__)
+#define mbed_trace_async_wait_function_set(...)     ((void) __VA_ARGS__)
+#define mbed_trace_async_drain(...)                 ((int) 0)
+#define mbed_trace_async_dropped_get(...)           ((uint32_t) 0)
+#define mbed_trace_async_sequence_get(...)          ((uint32_t) 0)
 #define mbed_trace_exclude_filters_set(...)         ((void) 0)
 #define mbed_trace_exclude_filters_get(...)         ((const char *) 0)
 #define mbed_trace_include_filters_set(...)         ((void) 0)
 #define mbed_trace_include_filters_get(...)         ((const char *) 0)
+#define mbed_trace_sink_add(...)                    ((int) 0)
+#define mbed_trace_sink_remove(...)                 ((int) 0)
+#define mbed_trace_group_level_set(...)             ((int) 0)
+#define mbed_trace_group_level_get(...)             ((uint8_t) 0)
+#define mbed_trace_group_sample_set(...)            ((int) 0)
+#define mbed_trace_group_sample_stats_get(...)      ((int) -1)
 #define mbed_trace_last(...)                        ((const char *) 0)
+#define mbed_trace_level_active(...)                ((bool) 0)
+#define mbed_trace_enabled(...)                     ((bool) 0)
+#define mbed_trace_check(...)                       ((bool) 0)
+#define mbed_trace_ratelimit_set(...)               ((void) 0)
+#define mbed_trace_ratelimit(rl, ...)               ((void) (rl), (bool) 0)
 #define mbed_tracef(...)                            ((void) 0)
 #define mbed_vtracef(...)                           ((void) 0)
 /**
@@ -16,8 +16,15 @@
 // limitations under the License.
 // ----------------------------------------------------------------------------
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdarg.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+#include <time.h>
+#endif
 
 #ifdef MBED_CONF_MBED_TRACE_ENABLE
 #undef MBED_CONF_MBED_TRACE_ENABLE
@@ -26,6 +33,12 @@
 #if !defined(MBED_CONF_MBED_TRACE_FEA_IPV6) && MBED_CONF_NANOSTACK_LIBSERVICE_PRESENT
 #define MBED_CONF_MBED_TRACE_FEA_IPV6 1
 #endif
+#ifndef MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT
+#define MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT 1
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1 && MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT != 1
+#error "MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT requires MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT"
+#endif
 
 #include "mbed-trace/mbed_trace.h"
 #if MBED_CONF_MBED_TRACE_FEA_IPV6 == 1
@@ -87,34 +100,363 @@
 #define DEFAULT_TRACE_TMP_LINE_LEN        128
 #endif
 
-/** default max filters (include/exclude) length in bytes */
-#ifdef MBED_TRACE_FILTER_LENGTH
-#define DEFAULT_TRACE_FILTER_LENGTH       MBED_TRACE_FILTER_LENGTH
+/** default max async record length in bytes, including the terminating null */
+#ifdef MBED_TRACE_ASYNC_RECORD_LENGTH
+#define DEFAULT_TRACE_ASYNC_RECORD_LEN    MBED_TRACE_ASYNC_RECORD_LENGTH
+#else
+#define DEFAULT_TRACE_ASYNC_RECORD_LEN    DEFAULT_TRACE_LINE_LENGTH
+#endif
+
+/** default max number of trace groups with their own settings */
+#ifdef MBED_TRACE_GROUP_COUNT
+#define DEFAULT_TRACE_GROUP_COUNT         MBED_TRACE_GROUP_COUNT
+#else
+#define DEFAULT_TRACE_GROUP_COUNT         8
+#endif
+#if DEFAULT_TRACE_GROUP_COUNT > 127
+#error "MBED_TRACE_GROUP_COUNT must be less than 128"
+#endif
+/** default max number of segments given to the scatter-gather print function */
+#ifdef MBED_TRACE_IOV_COUNT
+#define DEFAULT_TRACE_IOV_COUNT           MBED_TRACE_IOV_COUNT
+#else
+#define DEFAULT_TRACE_IOV_COUNT           32
+#endif
+#if DEFAULT_TRACE_IOV_COUNT < 16
+#error "MBED_TRACE_IOV_COUNT must be at least 16"
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+/** default max number of registered sinks */
+#ifdef MBED_TRACE_SINK_COUNT
+#define DEFAULT_TRACE_SINK_COUNT          MBED_TRACE_SINK_COUNT
+#else
+#define DEFAULT_TRACE_SINK_COUNT          4
+#endif
+#if DEFAULT_TRACE_SINK_COUNT < 1 || DEFAULT_TRACE_SINK_COUNT > 8
+#error "MBED_TRACE_SINK_COUNT must be 1...8"
+#endif
+#define trace_has_sinks()                 (m_trace.sinks_used != 0)
+#else
+#define trace_has_sinks()                 0
+#endif
+/** default number of traces a rate limited call site prints in a row */
+#ifdef MBED_TRACE_RATELIMIT_BURST
+#define DEFAULT_TRACE_RATELIMIT_BURST     MBED_TRACE_RATELIMIT_BURST
+#else
+#define DEFAULT_TRACE_RATELIMIT_BURST     10
+#endif
+/** default time for one more rate limited trace, in time function units */
+#ifdef MBED_TRACE_RATELIMIT_INTERVAL
+#define DEFAULT_TRACE_RATELIMIT_INTERVAL  MBED_TRACE_RATELIMIT_INTERVAL
+#else
+#define DEFAULT_TRACE_RATELIMIT_INTERVAL  1000
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+/** max length of a group filter list in static buffer mode, including the terminating null */
+#ifdef MBED_TRACE_FILTER_LIST_LENGTH
+#define DEFAULT_TRACE_FILTER_LIST_LEN     MBED_TRACE_FILTER_LIST_LENGTH
+#else
+#define DEFAULT_TRACE_FILTER_LIST_LEN     64
+#endif
+/** max number of async records in static buffer mode */
+#ifdef MBED_TRACE_ASYNC_RECORD_COUNT
+#define DEFAULT_TRACE_ASYNC_RECORD_COUNT  MBED_TRACE_ASYNC_RECORD_COUNT
+#else
+#define DEFAULT_TRACE_ASYNC_RECORD_COUNT  16
+#endif
+/** max batch buffer size in static buffer mode */
+#ifdef MBED_TRACE_BATCH_SIZE
+#define DEFAULT_TRACE_BATCH_SIZE          MBED_TRACE_BATCH_SIZE
+#else
+#define DEFAULT_TRACE_BATCH_SIZE          1024
+#endif
+/** max history depth in static buffer mode */
+#ifdef MBED_TRACE_HISTORY_DEPTH
+#define DEFAULT_TRACE_HISTORY_DEPTH       MBED_TRACE_HISTORY_DEPTH
+#else
+#define DEFAULT_TRACE_HISTORY_DEPTH       16
+#endif
+#endif
+/** default max length of one history record in bytes */
+#ifdef MBED_TRACE_HISTORY_RECORD_LENGTH
+#define DEFAULT_TRACE_HISTORY_RECORD_LEN  MBED_TRACE_HISTORY_RECORD_LENGTH
+#else
+#define DEFAULT_TRACE_HISTORY_RECORD_LEN  128
+#endif
+#if DEFAULT_TRACE_HISTORY_RECORD_LEN < 32 || DEFAULT_TRACE_HISTORY_RECORD_LEN > 65535
+#error "MBED_TRACE_HISTORY_RECORD_LENGTH must be between 32 and 65535"
+#endif
+
+/** max trace group name length for groups with their own settings, including the terminating null */
+#define TRACE_GROUP_NAME_LEN              8
+/** group hash index size */
+#define TRACE_GROUP_INDEX_SIZE            (2 * DEFAULT_TRACE_GROUP_COUNT)
+
+/** tokenized record layout */
+#define TRACE_TOKEN_VERSION               1
+#define TRACE_TOKEN_TYPE_HEADER           0x01
+#define TRACE_TOKEN_TYPE_TRACE            0x02
+#define TRACE_TOKEN_TRUNCATED             0x80
+/** header flag: %*pH, %pI6 and %*pP take their data to the record */
+#define TRACE_TOKEN_FLAG_FORMAT_EXT       0x01
+#define TRACE_TOKEN_HEADER_LEN            (16 + sizeof(uintptr_t))
+
+/** max length of the "last message repeated" line */
+#define TRACE_COALESCE_LINE_LEN           128
+/** max length of the group of the previous line, including the terminating zero */
+#define TRACE_COALESCE_GROUP_LEN          32
+
+/** max length of a built-in timestamp, "[YYYY-MM-DDTHH:MM:SS.mmmZ] " */
+#define TRACE_TIMESTAMP_LEN               40
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+/** clocks of the built-in timestamps, the coarse ones are read without a system call */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define TRACE_CLOCK_MONOTONIC             CLOCK_MONOTONIC_COARSE
+#else
+#define TRACE_CLOCK_MONOTONIC             CLOCK_MONOTONIC
+#endif
+#if defined(CLOCK_REALTIME_COARSE)
+#define TRACE_CLOCK_REALTIME              CLOCK_REALTIME_COARSE
+#else
+#define TRACE_CLOCK_REALTIME              CLOCK_REALTIME
+#endif
+#endif
+
+/** number of trace levels with their own statistics, TRACE_LEVEL_CMD to TRACE_LEVEL_DEBUG */
+#define TRACE_STATS_LEVELS                5
+
+/** flight recorder region header, see tools/mbed_trace_recorder.py */
+#define TRACE_RECORDER_MAGIC              0x5246544du /* "MTFR" in little endian */
+#define TRACE_RECORDER_VERSION            1
+/** smallest accepted data area */
+#define TRACE_RECORDER_MIN_SIZE           64
+
+/** storage class for per thread buffers */
+#ifndef MBED_TRACE_THREAD_LOCAL
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define MBED_TRACE_THREAD_LOCAL           _Thread_local
 #else
-#define DEFAULT_TRACE_FILTER_LENGTH       24
+#define MBED_TRACE_THREAD_LOCAL           __thread
+#endif
 #endif
 
 /** default trace configuration bitmask */
 #ifdef MBED_TRACE_CONFIG
-#define DEFAULT_TRACE_CONFIG              MBED_TRACE_CONFIG
+#define DEFAULT_TRACE_CONFIG              (MBED_TRACE_CONFIG)
+#else
+#define DEFAULT_TRACE_CONFIG              (TRACE_ACTIVE_LEVEL_ALL | TRACE_CARRIAGE_RETURN)
+#endif
+
+/* Atomic helpers. GCC-compatible toolchains (GCC, Clang, Arm Compiler 6) provide the
+ * __atomic builtins; others fall back to plain accesses which are only safe when
+ * trace calls are serialized by the mutex callbacks. */
+#if defined(__GNUC__) || defined(__clang__)
+#define trace_atomic_load(ptr)              __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define trace_atomic_store(ptr, val)        __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define trace_atomic_add(ptr, val)          __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define trace_atomic_cas(ptr, exp_ptr, val) __atomic_compare_exchange_n((ptr), (exp_ptr), (val), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#define trace_atomic_load_sync(ptr)         __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define trace_atomic_store_sync(ptr, val)   __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+#define trace_atomic_add_sync(ptr, val)     __atomic_fetch_add((ptr), (val), __ATOMIC_SEQ_CST)
+#define TRACE_HAVE_ATOMICS                  1
 #else
-#define DEFAULT_TRACE_CONFIG              TRACE_ACTIVE_LEVEL_ALL | TRACE_CARRIAGE_RETURN
+#define trace_atomic_load(ptr)              (*(ptr))
+#define trace_atomic_store(ptr, val)        (*(ptr) = (val))
+#define trace_atomic_add(ptr, val)          ((*(ptr) += (val)) - (val))
+#define trace_atomic_load_sync(ptr)         (*(ptr))
+#define trace_atomic_store_sync(ptr, val)   (*(ptr) = (val))
+#define trace_atomic_add_sync(ptr, val)     ((*(ptr) += (val)) - (val))
+#define TRACE_HAVE_ATOMICS                  0
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+/** flight recorder region header, followed by the circular data area */
+typedef struct trace_recorder_header_s {
+    /** TRACE_RECORDER_MAGIC */
+    uint32_t magic;
+    /** TRACE_RECORDER_VERSION */
+    uint16_t version;
+    /** size of this header */
+    uint16_t header_size;
+    /** size of the data area */
+    uint32_t size;
+    /** data area offset where the next line is written */
+    uint32_t cursor;
+    /** number of times the cursor has wrapped to the beginning */
+    uint32_t wraps;
+    uint32_t reserved[3];
+} trace_recorder_header_t;
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+#if !TRACE_HAVE_ATOMICS
+#error "MBED_CONF_MBED_TRACE_FEA_ASYNC requires a toolchain with __atomic builtins"
+#endif
+/** async queue record header, followed by record_length bytes of line data */
+typedef struct trace_async_slot_s {
+    /** slot sequence, used to hand the slot over between producers and consumer */
+    uint32_t turn;
+    /** record sequence number */
+    uint32_t seq;
+    /** trace level of the record */
+    uint8_t dlevel;
+    /** line length */
+    uint32_t length;
+} trace_async_slot_t;
+
+/** size of one slot in the async queue, header + data + line feed rounded up to the header alignment */
+#define trace_async_slot_size() \
+    ((sizeof(trace_async_slot_t) + m_trace.async_record_length + 1 + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1))
+#define trace_async_slot(pos) \
+    ((trace_async_slot_t *)(m_trace.async_queue + ((pos) & m_trace.async_mask) * trace_async_slot_size()))
 #endif
 
 /** default print function, just redirect str to printf */
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL != 1 && MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS != 1
 static void mbed_trace_realloc(char **buffer, int *length_ptr, int new_length);
-static void mbed_trace_default_print(const char *str);
+#endif
+static void mbed_trace_default_printn(const char *str, size_t len);
 static void mbed_trace_reset_tmp(void);
+static char *mbed_trace_hex_encode(char *dst, const uint8_t *src, int count);
+static void mbed_trace_output(uint8_t dlevel, char *line, size_t len);
+static void mbed_trace_print_line(uint8_t dlevel, char *line, size_t len);
+static void mbed_trace_vprintv(uint8_t dlevel, const char *grp, const char *fmt, va_list ap);
+static size_t mbed_trace_vformat(char *line, int size, uint8_t dlevel, const char *grp, const char *fmt, va_list ap, uint32_t *hash, bool *cut);
+static size_t mbed_trace_vformat_config(char *line, int size, uint8_t config, uint8_t dlevel, const char *grp, const char *fmt, va_list ap, uint32_t *hash, bool *cut);
+static size_t mbed_trace_format(char *line, int size, uint8_t dlevel, const char *grp, const char *fmt, ...);
+static void mbed_trace_emit(uint8_t dlevel, char *line, size_t len);
+static void mbed_trace_coalesce_end(void);
+static void mbed_trace_mutex_wait(void);
+static void mbed_trace_mutex_release(void);
+static void mbed_trace_active_levels_update(void);
+static int8_t mbed_trace_skip(int8_t dlevel, const char *grp);
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+static void mbed_trace_output_measure(uint8_t dlevel, const char *grp, size_t bytes, uint32_t start);
+#define trace_clock()                                   (m_trace.clock_f ? m_trace.clock_f() : 0)
+#define trace_output_measure(dlevel, grp, bytes, start) mbed_trace_output_measure((dlevel), (grp), (bytes), (start))
+#else
+#define trace_clock()                                   0
+#define trace_output_measure(dlevel, grp, bytes, start) ((void)(start))
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+static void mbed_trace_stats_add(uint8_t dlevel, const char *grp, size_t offset, uint32_t n);
+#define trace_stats_add(dlevel, grp, counter)           mbed_trace_stats_add((dlevel), (grp), offsetof(mbed_trace_stats_t, counter), 1)
+#define trace_stats_array_overflow()                    trace_atomic_add(&m_trace.array_overflows, 1)
+#else
+#define trace_stats_add(dlevel, grp, counter)
+#define trace_stats_array_overflow()
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+static void mbed_trace_latency_add(uint8_t phase, uint32_t start);
+#define trace_latency_clock()                           trace_clock()
+#define trace_latency_add(phase, start)                 mbed_trace_latency_add((phase), (start))
+#else
+#define trace_latency_clock()                           0
+#define trace_latency_add(phase, start)                 ((void)(start))
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT == 1
+static int mbed_trace_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
+static int mbed_trace_snprintf(char *buf, size_t size, const char *fmt, ...);
+#else
+#define mbed_trace_vsnprintf vsnprintf
+#define mbed_trace_snprintf  snprintf
+#endif
+
+/** group name entry in a filter hash table */
+typedef struct trace_filter_entry_s {
+    /** group name, or wildcard prefix without the '*', NULL for a free entry */
+    const char *name;
+    /** FNV-1a hash of the name */
+    uint32_t hash;
+    /** name length */
+    uint8_t length;
+    /** name is a prefix ("net*") */
+    bool prefix;
+} trace_filter_entry_t;
+
+/** trace group with its own settings, interned to a small integer id */
+typedef struct trace_group_s {
+    /** group name */
+    char name[TRACE_GROUP_NAME_LEN];
+    /** FNV-1a hash of the name */
+    uint32_t hash;
+    /** active level bitmask of the group, TRACE_GROUP_LEVEL_DEFAULT to use the global one */
+    uint8_t level;
+    /** levels printed 1 in sample_rate times */
+    uint8_t sample_levels;
+    /** sampling rate, 0 or 1 when not sampled */
+    uint16_t sample_rate;
+    /** traces of the sampled levels */
+    uint32_t sample_seen;
+    /** sampled traces printed */
+    uint32_t sample_printed;
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    /** statistics of the group */
+    mbed_trace_stats_t stats;
+#endif
+} trace_group_t;
+
+/** group filter compiled from a comma separated list, allocated as one block.
+ * A published filter is never changed, a new list replaces the whole filter. */
+typedef struct trace_filter_s {
+    /** filter list as given by the application */
+    const char *list;
+    /** hash table size - 1 */
+    uint32_t mask;
+    /** number of names in the table */
+    uint16_t count;
+    /** bit n is set when the table contains a prefix of n characters */
+    uint32_t prefix_lengths;
+    /** next replaced filter waiting to be freed */
+    struct trace_filter_s *retired_next;
+    /** reader generation when the filter was replaced */
+    uint32_t retired_generation;
+    /** open addressing hash table of the names in the list, followed by the names and the list */
+    trace_filter_entry_t table[];
+} trace_filter_t;
+static void mbed_trace_filter_free_list(trace_filter_t *list);
+
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+/** registered output with its own levels, groups and line style */
+typedef struct trace_sink_s {
+    /** print function, NULL for a free slot */
+    void (*printn)(const char *, size_t);
+    /** active levels and TRACE_MODE_* bits, as in trace_config */
+    uint8_t config;
+    /** groups printed, NULL for all groups */
+    trace_filter_t *groups;
+} trace_sink_t;
+#endif
 
 typedef struct trace_s {
     /** trace configuration bits */
     uint8_t trace_config;
-    /** exclude filters list, related group name */
-    char *filters_exclude;
-    /** include filters list, related group name */
-    char *filters_include;
-    /** Filters length */
-    int filters_length;
+    /** exclude filters, related group name */
+    trace_filter_t *filters_exclude;
+    /** include filters, related group name */
+    trace_filter_t *filters_include;
+    /** trace calls matching groups without the mutex, counted by the generation they started in, odd or even */
+    uint32_t filter_readers[2];
+    /** generation of new filter readers, advanced by the filter changes */
+    uint32_t filter_generation;
+    /** replaced filters which other threads may still be matching */
+    trace_filter_t *filters_retired;
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    /** registered sinks */
+    trace_sink_t sinks[DEFAULT_TRACE_SINK_COUNT];
+    /** bit n is set when sink n is registered */
+    uint8_t sinks_used;
+    /** active levels of all registered sinks */
+    uint8_t sink_levels;
+#endif
+    /** interned trace groups, group id is the index */
+    trace_group_t groups[DEFAULT_TRACE_GROUP_COUNT];
+    /** hash index of the groups, group id + 1, 0 for a free slot */
+    uint8_t group_index[TRACE_GROUP_INDEX_SIZE];
+    /** number of interned groups */
+    uint8_t group_count;
+    /** some group is sampled */
+    bool sampling;
     /** trace line */
     char *line;
     /** trace line length */
@@ -134,19 +476,164 @@ typedef struct trace_s {
     void (*printf)(const char *);
     /** print out function for TRACE_LEVEL_CMD */
     void (*cmd_printf)(const char *);
+    /** print out function with length, the line ends with a line feed */
+    void (*printn)(const char *, size_t);
+    /** print out function with length for TRACE_LEVEL_CMD */
+    void (*cmd_printn)(const char *, size_t);
+    /** scatter-gather print out function, used instead of printf when set */
+    void (*printv)(const mbed_trace_iovec_t *, int);
     /** mutex wait function which can be called to lock against a mutex. */
     void (*mutex_wait_f)(void);
     /** mutex release function which must be used to release the mutex locked by mutex_wait_f. */
     void (*mutex_release_f)(void);
     /** number of times the mutex has been locked */
     int mutex_lock_count;
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+    /** mbed_trace_init() called, line buffers are not allocated in thread local mode */
+    bool initialized;
+#endif
+    /** time function, used to timestamp trace records */
+    uint32_t (*time_f)(void);
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    /** built-in timestamp of the decorated lines, TRACE_TIMESTAMP_* */
+    uint8_t timestamp;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+    /** line format of the decorated lines, TRACE_FORMAT_* */
+    uint8_t format;
+    /** sequence number of the next structured line */
+    uint32_t sequence;
+#endif
+    /** coalesce repeated lines */
+    bool coalesce;
+    /** print the count of repeated lines at least this often, in time function units, 0 to disable */
+    uint32_t coalesce_timeout;
+    /** level of the previous line, 0 when there is none */
+    uint8_t coalesce_level;
+    /** group of the previous line, copied as the caller's string may be gone when the repeats are printed */
+    char coalesce_grp[TRACE_COALESCE_GROUP_LEN];
+    /** hash of the group and text of the previous line */
+    uint32_t coalesce_hash;
+    /** number of repeats not printed */
+    uint32_t coalesce_count;
+    /** time of the first repeat not printed */
+    uint32_t coalesce_time;
+    /** traces a rate limited call site prints in a row, 0 when rate limiting is disabled */
+    uint16_t ratelimit_burst;
+    /** time for one more rate limited trace */
+    uint32_t ratelimit_interval;
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+    /** output function for tokenized binary records, NULL when tokenized mode is disabled */
+    void (*token_f)(const uint8_t *, size_t);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    /** async record queue, NULL when async mode is disabled */
+    uint8_t *async_queue;
+    /** async queue index mask (number of slots - 1) */
+    uint32_t async_mask;
+    /** max length of one async record */
+    uint32_t async_record_length;
+    /** next position to be reserved by a producer */
+    uint32_t async_enqueue_pos;
+    /** next position to be consumed */
+    uint32_t async_dequeue_pos;
+    /** next record sequence number */
+    uint32_t async_seq;
+    /** sequence number of the record being printed by mbed_trace_async_drain */
+    uint32_t async_current_seq;
+    /** number of records dropped because the queue was full */
+    uint32_t async_dropped;
+    /** full queue policy */
+    uint8_t async_policy;
+    /** function called when a new record is queued */
+    void (*async_notify_f)(void);
+    /** function called by a tracing thread waiting for room in a full queue */
+    void (*async_wait_f)(void);
+    /** 1 while a thread owns the print functions to print out queued records */
+    uint32_t async_draining;
+    /** count of mbed_trace_async_drain() calls, tells the owner to look at the queue again */
+    uint32_t async_requests;
+    /** 1 when the owner should also flush the batch buffer */
+    uint32_t async_flush;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+    /** two batch buffers of batch_size bytes, NULL when batching is disabled */
+    char *batch_buffer;
+    /** size of one batch buffer */
+    size_t batch_size;
+    /** batch buffer being filled */
+    char *batch_active;
+    /** bytes in the active batch buffer */
+    size_t batch_fill;
+    /** lines in the active batch buffer */
+    uint16_t batch_lines;
+    /** time of the first line in the active batch buffer */
+    uint32_t batch_time;
+    /** flush when this many bytes are buffered */
+    size_t batch_flush_bytes;
+    /** flush when this many lines are buffered, 0 to disable */
+    uint16_t batch_flush_lines;
+    /** flush when the first buffered line is this old, in time function units, 0 to disable */
+    uint32_t batch_max_age;
+    /** trace levels which are flushed right away */
+    uint8_t batch_flush_levels;
+    /** function which writes out a batch */
+    void (*batch_write_f)(const char *, size_t);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+    /** flight recorder region, NULL when not set */
+    trace_recorder_header_t *recorder;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    /** history ring of unformatted records followed by the text buffer, NULL when disabled */
+    uint8_t *history;
+    /** number of records in the history ring */
+    uint16_t history_depth;
+    /** index of the oldest record */
+    uint16_t history_head;
+    /** number of stored records */
+    uint16_t history_count;
+    /** length of the text buffer used to format the records */
+    int history_text_length;
+    /** trace levels which are stored to the history instead of printed */
+    uint8_t history_levels;
+    /** trace levels which print out the history before the line itself */
+    uint8_t history_trigger_levels;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    /** clock function used to measure the time spent in the trace functions */
+    uint32_t (*clock_f)(void);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    /** latency histograms of the trace phases */
+    mbed_trace_latency_t latency[TRACE_LATENCY_PHASES];
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    /** statistics per trace level, the index is the bit number of the level */
+    mbed_trace_stats_t level_stats[TRACE_STATS_LEVELS];
+    /** mbed_trace_array() results cut to the helper buffer */
+    uint32_t array_overflows;
+#endif
 } trace_t;
 
+volatile uint8_t mbed_trace_active_levels = DEFAULT_TRACE_CONFIG & TRACE_MASK_LEVEL;
+
 static trace_t m_trace = {
     .trace_config = DEFAULT_TRACE_CONFIG,
     .filters_exclude = 0,
     .filters_include = 0,
-    .filters_length = DEFAULT_TRACE_FILTER_LENGTH,
+    .filter_readers = {0},
+    .filter_generation = 0,
+    .filters_retired = 0,
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    .sinks = {{0}},
+    .sinks_used = 0,
+    .sink_levels = 0,
+#endif
+    .groups = {{{0}}},
+    .group_index = {0},
+    .group_count = 0,
+    .sampling = false,
     .line = 0,
     .line_length = DEFAULT_TRACE_LINE_LENGTH,
     .tmp_data = 0,
@@ -154,59 +641,309 @@ static trace_t m_trace = {
     .tmp_data_ptr = 0,
     .prefix_f = 0,
     .suffix_f = 0,
-    .printf  = mbed_trace_default_print,
+    .printf  = 0,
     .cmd_printf = 0,
+    .printn = mbed_trace_default_printn,
+    .cmd_printn = 0,
+    .printv = 0,
     .mutex_wait_f = 0,
     .mutex_release_f = 0,
-    .mutex_lock_count = 0
+    .mutex_lock_count = 0,
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+    .initialized = false,
+#endif
+    .time_f = 0,
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    .timestamp = TRACE_TIMESTAMP_NONE,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+    .format = TRACE_FORMAT_TEXT,
+    .sequence = 0,
+#endif
+    .coalesce = false,
+    .coalesce_timeout = 0,
+    .coalesce_level = 0,
+    .coalesce_grp = {0},
+    .coalesce_hash = 0,
+    .coalesce_count = 0,
+    .coalesce_time = 0,
+    .ratelimit_burst = DEFAULT_TRACE_RATELIMIT_BURST,
+    .ratelimit_interval = DEFAULT_TRACE_RATELIMIT_INTERVAL,
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+    .token_f = 0,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    .async_queue = 0,
+    .async_mask = 0,
+    .async_record_length = DEFAULT_TRACE_ASYNC_RECORD_LEN,
+    .async_enqueue_pos = 0,
+    .async_dequeue_pos = 0,
+    .async_seq = 0,
+    .async_current_seq = 0,
+    .async_dropped = 0,
+    .async_policy = TRACE_ASYNC_POLICY_BLOCK,
+    .async_notify_f = 0,
+    .async_wait_f = 0,
+    .async_draining = 0,
+    .async_requests = 0,
+    .async_flush = 0,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+    .batch_buffer = 0,
+    .batch_size = 0,
+    .batch_active = 0,
+    .batch_fill = 0,
+    .batch_lines = 0,
+    .batch_time = 0,
+    .batch_flush_bytes = 0,
+    .batch_flush_lines = 0,
+    .batch_max_age = 0,
+    .batch_flush_levels = TRACE_LEVEL_ERROR,
+    .batch_write_f = 0,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+    .recorder = 0,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    .history = 0,
+    .history_depth = 0,
+    .history_head = 0,
+    .history_count = 0,
+    .history_text_length = 0,
+    .history_levels = TRACE_LEVEL_DEBUG,
+    .history_trigger_levels = TRACE_LEVEL_ERROR,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    .clock_f = 0,
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    .array_overflows = 0,
+#endif
 };
 
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+/* Per thread line and helper buffers. These are sized at compile time,
+ * mbed_trace_buffer_sizes() can only make them shorter. */
+static MBED_TRACE_THREAD_LOCAL char m_trace_tls_line[DEFAULT_TRACE_LINE_LENGTH + 1];
+static MBED_TRACE_THREAD_LOCAL char m_trace_tls_tmp_data[DEFAULT_TRACE_TMP_LINE_LEN];
+static MBED_TRACE_THREAD_LOCAL int m_trace_tls_tmp_data_pos;
+
+#define trace_line()                (m_trace_tls_line)
+#define trace_tmp_data()            (m_trace_tls_tmp_data)
+#define trace_tmp_data_ptr()        (m_trace_tls_tmp_data + m_trace_tls_tmp_data_pos)
+#define trace_tmp_data_ptr_set(ptr) (m_trace_tls_tmp_data_pos = (ptr) - m_trace_tls_tmp_data)
+#define trace_initialized()         (m_trace.initialized)
+// only the print functions are shared between threads
+#define trace_line_lock()
+#define trace_line_unlock()
+#define trace_output_lock()         mbed_trace_mutex_wait()
+#define trace_output_unlock()       mbed_trace_mutex_release()
+#else
+#define trace_line()                (m_trace.line)
+#define trace_tmp_data()            (m_trace.tmp_data)
+#define trace_tmp_data_ptr()        (m_trace.tmp_data_ptr)
+#define trace_tmp_data_ptr_set(ptr) (m_trace.tmp_data_ptr = (ptr))
+#define trace_initialized()         (m_trace.line != NULL)
+// line and helper buffers are shared, hold the mutex for the whole trace call
+#define trace_line_lock()           mbed_trace_mutex_wait()
+#define trace_line_unlock()         mbed_trace_mutex_release()
+#define trace_output_lock()
+#define trace_output_unlock()
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+/** seconds part of the latest timestamp, formatted once a second */
+typedef struct trace_timestamp_cache_s {
+    /** TRACE_TIMESTAMP_* of the text */
+    uint8_t mode;
+    /** text length, 0 when empty */
+    uint8_t length;
+    /** seconds of the text */
+    time_t sec;
+    /** "[sec" or "[YYYY-MM-DDTHH:MM:SS" */
+    char text[TRACE_TIMESTAMP_LEN];
+} trace_timestamp_cache_t;
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+static MBED_TRACE_THREAD_LOCAL trace_timestamp_cache_t m_trace_timestamp_cache;
+#else
+static trace_timestamp_cache_t m_trace_timestamp_cache;
+#endif
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+/* Static arenas instead of the heap. Each buffer has its own arena sized at compile
+ * time, a buffer which does not fit to its arena fails like a failed allocation.
+ * Filter tables come from a pool of three blocks for each filter (the exclude and include
+ * filters and the group filters of the sinks): the active table, a replaced table which
+ * other threads may still be matching, and the new table which is compiled meanwhile. */
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL != 1
+static char m_trace_static_line[DEFAULT_TRACE_LINE_LENGTH + 1];
+static char m_trace_static_tmp_data[DEFAULT_TRACE_TMP_LINE_LEN + 1];
+#endif
+typedef union trace_filter_block_u {
+    trace_filter_entry_t entry;
+    uint8_t data[sizeof(trace_filter_t) + DEFAULT_TRACE_FILTER_LIST_LEN * (sizeof(trace_filter_entry_t) + 2)];
+} trace_filter_block_t;
+/** active, replaced and new tables of the include and exclude filters and the group filters of the sinks */
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+#define TRACE_FILTER_BLOCKS (3 * (2 + DEFAULT_TRACE_SINK_COUNT))
+#else
+#define TRACE_FILTER_BLOCKS (3 * 2)
+#endif
+static trace_filter_block_t m_trace_static_filters[TRACE_FILTER_BLOCKS];
+static uint32_t m_trace_static_filters_used;
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+static uint32_t m_trace_static_async_queue[DEFAULT_TRACE_ASYNC_RECORD_COUNT *
+                                           ((sizeof(trace_async_slot_t) + DEFAULT_TRACE_ASYNC_RECORD_LEN + 1 + sizeof(uint32_t) - 1) / sizeof(uint32_t))];
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+static char m_trace_static_batch_buffer[2 * DEFAULT_TRACE_BATCH_SIZE];
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+static uint32_t m_trace_static_history[(DEFAULT_TRACE_HISTORY_DEPTH * DEFAULT_TRACE_HISTORY_RECORD_LEN + DEFAULT_TRACE_LINE_LENGTH + 1 +
+                                        sizeof(uint32_t) - 1) / sizeof(uint32_t)];
+#endif
+
+#define trace_mem_alloc(arena, size)    ((size_t)(size) <= sizeof(arena) ? (void *)(arena) : NULL)
+#define trace_mem_free(arena, ptr)      ((void)(ptr))
+
+static void *mbed_trace_filter_alloc(size_t size)
+{
+    void *table = NULL;
+    mbed_trace_mutex_wait();
+    for (int i = 0; i < TRACE_FILTER_BLOCKS && size <= sizeof(m_trace_static_filters[0]); i++) {
+        if (!(m_trace_static_filters_used & (1u << i))) {
+            m_trace_static_filters_used |= 1u << i;
+            table = &m_trace_static_filters[i];
+            break;
+        }
+    }
+    mbed_trace_mutex_release();
+    return table;
+}
+static void mbed_trace_filter_free(void *table)
+{
+    mbed_trace_mutex_wait();
+    for (int i = 0; i < TRACE_FILTER_BLOCKS; i++) {
+        if (table == &m_trace_static_filters[i]) {
+            m_trace_static_filters_used &= ~(1u << i);
+        }
+    }
+    mbed_trace_mutex_release();
+}
+#else
+#define trace_mem_alloc(arena, size)    MBED_TRACE_MEM_ALLOC(size)
+#define trace_mem_free(arena, ptr)      MBED_TRACE_MEM_FREE(ptr)
+#define mbed_trace_filter_alloc(size)   MBED_TRACE_MEM_ALLOC(size)
+#define mbed_trace_filter_free(table)   MBED_TRACE_MEM_FREE(table)
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1 || MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+/** Length of a buffer which is allocated at compile time */
+static int mbed_trace_length_limit(int length, int max_length)
+{
+    return length < max_length ? length : max_length;
+}
+#endif
+
 int mbed_trace_init(void)
 {
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+    m_trace.line_length = mbed_trace_length_limit(m_trace.line_length, sizeof(m_trace_tls_line) - 1);
+    m_trace.tmp_data_length = mbed_trace_length_limit(m_trace.tmp_data_length, sizeof(m_trace_tls_tmp_data));
+    m_trace.initialized = true;
+#else
+#if MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+    m_trace.line_length = mbed_trace_length_limit(m_trace.line_length, sizeof(m_trace_static_line) - 1);
+    m_trace.tmp_data_length = mbed_trace_length_limit(m_trace.tmp_data_length, sizeof(m_trace_static_tmp_data) - 1);
+#endif
     if (m_trace.line == NULL) {
-        m_trace.line = MBED_TRACE_MEM_ALLOC(m_trace.line_length);
+        // one extra byte for the line feed given to the printn functions
+        m_trace.line = trace_mem_alloc(m_trace_static_line, m_trace.line_length + 1);
     }
 
     if (m_trace.tmp_data == NULL) {
-        m_trace.tmp_data = MBED_TRACE_MEM_ALLOC(m_trace.tmp_data_length);
+        m_trace.tmp_data = trace_mem_alloc(m_trace_static_tmp_data, m_trace.tmp_data_length);
     }
     m_trace.tmp_data_ptr = m_trace.tmp_data;
 
-    if (m_trace.filters_exclude == NULL) {
-        m_trace.filters_exclude = MBED_TRACE_MEM_ALLOC(m_trace.filters_length);
-    }
-    if (m_trace.filters_include == NULL) {
-        m_trace.filters_include = MBED_TRACE_MEM_ALLOC(m_trace.filters_length);
-    }
-
     if (m_trace.line == NULL ||
-            m_trace.tmp_data == NULL ||
-            m_trace.filters_exclude == NULL  ||
-            m_trace.filters_include == NULL) {
+            m_trace.tmp_data == NULL) {
         //memory allocation fail
         mbed_trace_free();
         return -1;
     }
-    memset(m_trace.tmp_data, 0, m_trace.tmp_data_length);
-    memset(m_trace.filters_exclude, 0, m_trace.filters_length);
-    memset(m_trace.filters_include, 0, m_trace.filters_length);
-    memset(m_trace.line, 0, m_trace.line_length);
+#endif
+    memset(trace_tmp_data(), 0, m_trace.tmp_data_length);
+    memset(trace_line(), 0, m_trace.line_length);
 
     return 0;
 }
 void mbed_trace_free(void)
 {
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    // flush pending records and release the queue
+    mbed_trace_async_enable(0);
+    m_trace.async_seq = 0;
+    m_trace.async_current_seq = 0;
+    m_trace.async_dropped = 0;
+    m_trace.async_policy = TRACE_ASYNC_POLICY_BLOCK;
+    m_trace.async_notify_f = 0;
+    m_trace.async_wait_f = 0;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+    // write out buffered lines and release the buffers
+    mbed_trace_batch_enable(0, 0);
+    m_trace.batch_flush_bytes = 0;
+    m_trace.batch_flush_lines = 0;
+    m_trace.batch_max_age = 0;
+    m_trace.batch_flush_levels = TRACE_LEVEL_ERROR;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+    // the region belongs to the application and keeps its content
+    m_trace.recorder = 0;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    // stored records are dropped
+    mbed_trace_history_enable(0);
+    m_trace.history_levels = TRACE_LEVEL_DEBUG;
+    m_trace.history_trigger_levels = TRACE_LEVEL_ERROR;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    m_trace.clock_f = 0;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    memset(m_trace.latency, 0, sizeof(m_trace.latency));
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    // group statistics are cleared with the groups
+    memset(m_trace.level_stats, 0, sizeof(m_trace.level_stats));
+    m_trace.array_overflows = 0;
+#endif
     // release memory
-    MBED_TRACE_MEM_FREE(m_trace.line);
-    MBED_TRACE_MEM_FREE(m_trace.tmp_data);
-    MBED_TRACE_MEM_FREE(m_trace.filters_exclude);
-    MBED_TRACE_MEM_FREE(m_trace.filters_include);
+    trace_mem_free(m_trace_static_line, m_trace.line);
+    trace_mem_free(m_trace_static_tmp_data, m_trace.tmp_data);
+    mbed_trace_filter_free(m_trace.filters_exclude);
+    mbed_trace_filter_free(m_trace.filters_include);
+    mbed_trace_filter_free_list(m_trace.filters_retired);
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    for (int i = 0; i < DEFAULT_TRACE_SINK_COUNT; i++) {
+        mbed_trace_filter_free(m_trace.sinks[i].groups);
+    }
+    memset(m_trace.sinks, 0, sizeof(m_trace.sinks));
+    m_trace.sinks_used = 0;
+    m_trace.sink_levels = 0;
+#endif
 
     // reset to default values
     m_trace.trace_config = DEFAULT_TRACE_CONFIG;
     m_trace.filters_exclude = 0;
     m_trace.filters_include = 0;
-    m_trace.filters_length = DEFAULT_TRACE_FILTER_LENGTH;
+    m_trace.filters_retired = 0;
+    memset(m_trace.groups, 0, sizeof(m_trace.groups));
+    memset(m_trace.group_index, 0, sizeof(m_trace.group_index));
+    m_trace.group_count = 0;
+    m_trace.sampling = false;
+    mbed_trace_active_levels_update();
     m_trace.line = 0;
     m_trace.line_length = DEFAULT_TRACE_LINE_LENGTH;
     m_trace.tmp_data = 0;
@@ -214,16 +951,64 @@ void mbed_trace_free(void)
     m_trace.tmp_data_ptr = 0;
     m_trace.prefix_f = 0;
     m_trace.suffix_f = 0;
-    m_trace.printf  = mbed_trace_default_print;
+    m_trace.printf  = 0;
     m_trace.cmd_printf = 0;
+    m_trace.printn = mbed_trace_default_printn;
+    m_trace.cmd_printn = 0;
+    m_trace.printv = 0;
     m_trace.mutex_wait_f = 0;
     m_trace.mutex_release_f = 0;
     m_trace.mutex_lock_count = 0;
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+    m_trace.initialized = false;
+#endif
+    m_trace.time_f = 0;
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    m_trace.timestamp = TRACE_TIMESTAMP_NONE;
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+    m_trace.format = TRACE_FORMAT_TEXT;
+    m_trace.sequence = 0;
+#endif
+    m_trace.coalesce = false;
+    m_trace.coalesce_timeout = 0;
+    m_trace.coalesce_level = 0;
+    m_trace.coalesce_grp[0] = 0;
+    m_trace.coalesce_count = 0;
+    m_trace.ratelimit_burst = DEFAULT_TRACE_RATELIMIT_BURST;
+    m_trace.ratelimit_interval = DEFAULT_TRACE_RATELIMIT_INTERVAL;
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+    m_trace.token_f = 0;
+#endif
+}
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+void mbed_trace_buffer_sizes(int lineLength, int tmpLength)
+{
+    if (lineLength > 0) {
+        m_trace.line_length = mbed_trace_length_limit(lineLength, sizeof(m_trace_tls_line) - 1);
+    }
+    if (tmpLength > 0) {
+        m_trace.tmp_data_length = mbed_trace_length_limit(tmpLength, sizeof(m_trace_tls_tmp_data));
+        mbed_trace_reset_tmp();
+    }
+}
+#elif MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+void mbed_trace_buffer_sizes(int lineLength, int tmpLength)
+{
+    if (lineLength > 0) {
+        m_trace.line_length = mbed_trace_length_limit(lineLength, sizeof(m_trace_static_line) - 1);
+    }
+    if (tmpLength > 0) {
+        m_trace.tmp_data_length = mbed_trace_length_limit(tmpLength, sizeof(m_trace_static_tmp_data) - 1);
+        mbed_trace_reset_tmp();
+    }
 }
+#else
 static void mbed_trace_realloc(char **buffer, int *length_ptr, int new_length)
 {
     MBED_TRACE_MEM_FREE(*buffer);
-    *buffer  = MBED_TRACE_MEM_ALLOC(new_length);
+    // one extra byte, the line buffer needs it for the line feed
+    *buffer  = MBED_TRACE_MEM_ALLOC(new_length + 1);
     *length_ptr = new_length;
 }
 void mbed_trace_buffer_sizes(int lineLength, int tmpLength)
@@ -236,9 +1021,37 @@ void mbed_trace_buffer_sizes(int lineLength, int tmpLength)
         mbed_trace_reset_tmp();
     }
 }
+#endif
+/** Recalculate the union of active levels used by the usage macros */
+static void mbed_trace_active_levels_update(void)
+{
+    uint8_t levels = m_trace.trace_config & TRACE_MASK_LEVEL;
+    for (int i = 0; i < m_trace.group_count; i++) {
+        if (m_trace.groups[i].level != TRACE_GROUP_LEVEL_DEFAULT) {
+            levels |= m_trace.groups[i].level;
+        }
+    }
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    if (m_trace.history) {
+        levels |= m_trace.history_levels;
+    }
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    uint8_t sink_levels = 0;
+    for (int i = 0; i < DEFAULT_TRACE_SINK_COUNT; i++) {
+        if (m_trace.sinks[i].printn) {
+            sink_levels |= m_trace.sinks[i].config & TRACE_MASK_LEVEL;
+        }
+    }
+    m_trace.sink_levels = sink_levels;
+    levels |= sink_levels;
+#endif
+    trace_atomic_store(&mbed_trace_active_levels, levels);
+}
 void mbed_trace_config_set(uint8_t config)
 {
     m_trace.trace_config = config;
+    mbed_trace_active_levels_update();
 }
 uint8_t mbed_trace_config_get(void)
 {
@@ -255,10 +1068,26 @@ void mbed_trace_suffix_function_set(char *(*suffix_f)(void))
 void mbed_trace_print_function_set(void (*printf)(const char *))
 {
     m_trace.printf = printf;
+    m_trace.printn = 0;
 }
 void mbed_trace_cmdprint_function_set(void (*printf)(const char *))
 {
     m_trace.cmd_printf = printf;
+    m_trace.cmd_printn = 0;
+}
+void mbed_trace_printn_function_set(void (*printn)(const char *str, size_t len))
+{
+    m_trace.printn = printn;
+    m_trace.printf = 0;
+}
+void mbed_trace_cmdprintn_function_set(void (*printn)(const char *str, size_t len))
+{
+    m_trace.cmd_printn = printn;
+    m_trace.cmd_printf = 0;
+}
+void mbed_trace_printv_function_set(void (*printv)(const mbed_trace_iovec_t *iov, int count))
+{
+    m_trace.printv = printv;
 }
 void mbed_trace_mutex_wait_function_set(void (*mutex_wait_f)(void))
 {
@@ -268,225 +1097,3171 @@ void mbed_trace_mutex_release_function_set(void (*mutex_release_f)(void))
 {
     m_trace.mutex_release_f = mutex_release_f;
 }
-void mbed_trace_exclude_filters_set(char *filters)
+void mbed_trace_time_function_set(uint32_t (*time_f)(void))
 {
-    if (filters) {
-        (void)strncpy(m_trace.filters_exclude, filters, m_trace.filters_length);
-    } else {
-        m_trace.filters_exclude[0] = 0;
+    m_trace.time_f = time_f;
+}
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+int mbed_trace_timestamp_set(uint8_t mode)
+{
+    if (mode > TRACE_TIMESTAMP_REALTIME) {
+        return -1;
     }
+    m_trace.timestamp = mode;
+    return 0;
 }
-const char *mbed_trace_exclude_filters_get(void)
+/** Write the built-in timestamp, "[sec.mmm] " or "[YYYY-MM-DDTHH:MM:SS.mmmZ] " in UTC.
+ * @return length, 0 when the timestamp is off or does not fit */
+static int mbed_trace_timestamp(char *buf, size_t size)
 {
-    return m_trace.filters_exclude;
+    trace_timestamp_cache_t *cache = &m_trace_timestamp_cache;
+    uint8_t mode = m_trace.timestamp;
+    struct timespec ts;
+    char *ptr;
+
+    if (mode == TRACE_TIMESTAMP_NONE ||
+            clock_gettime(mode == TRACE_TIMESTAMP_REALTIME ? TRACE_CLOCK_REALTIME : TRACE_CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    if (cache->length == 0 || cache->mode != mode || cache->sec != ts.tv_sec) {
+        // the seconds part changes only once a second
+        int length = 0;
+        if (mode == TRACE_TIMESTAMP_REALTIME) {
+            struct tm tm;
+            if (gmtime_r(&ts.tv_sec, &tm)) {
+                length = strftime(cache->text, sizeof(cache->text), "[%Y-%m-%dT%H:%M:%S", &tm);
+            }
+        } else {
+            length = snprintf(cache->text, sizeof(cache->text), "[%lu", (unsigned long)ts.tv_sec);
+        }
+        if (length <= 0 || length >= (int)sizeof(cache->text) - 8) {
+            cache->length = 0;
+            return 0;
+        }
+        cache->mode = mode;
+        cache->sec = ts.tv_sec;
+        cache->length = length;
+    }
+    // ".mmm", "Z" for UTC, "] " and the null
+    if ((size_t)cache->length + 8 > size) {
+        return 0;
+    }
+    unsigned ms = (unsigned)(ts.tv_nsec / 1000000);
+    memcpy(buf, cache->text, cache->length);
+    ptr = buf + cache->length;
+    *ptr++ = '.';
+    *ptr++ = '0' + ms / 100;
+    *ptr++ = '0' + ms / 10 % 10;
+    *ptr++ = '0' + ms % 10;
+    if (mode == TRACE_TIMESTAMP_REALTIME) {
+        *ptr++ = 'Z';
+    }
+    *ptr++ = ']';
+    *ptr++ = ' ';
+    *ptr = 0;
+    return ptr - buf;
 }
-const char *mbed_trace_include_filters_get(void)
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+int mbed_trace_format_set(uint8_t format)
 {
-    return m_trace.filters_include;
+    if (format > TRACE_FORMAT_LOGFMT) {
+        return -1;
+    }
+    m_trace.format = format;
+    return 0;
 }
-void mbed_trace_include_filters_set(char *filters)
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+/** Hand the active batch buffer to the write function and continue in the other one */
+static void mbed_trace_batch_flush(void)
 {
-    if (filters) {
-        (void)strncpy(m_trace.filters_include, filters, m_trace.filters_length);
-    } else {
-        m_trace.filters_include[0] = 0;
+    char *full = m_trace.batch_active;
+    size_t len = m_trace.batch_fill;
+
+    if (len == 0) {
+        return;
     }
+    // the other buffer is free again: the write function has returned since it got it
+    m_trace.batch_active = (full == m_trace.batch_buffer) ? full + m_trace.batch_size : m_trace.batch_buffer;
+    m_trace.batch_fill = 0;
+    m_trace.batch_lines = 0;
+    m_trace.batch_write_f(full, len);
 }
-static int8_t mbed_trace_skip(int8_t dlevel, const char *grp)
+/** Append a line, including its line feed, to the batch buffer */
+static void mbed_trace_batch_write(uint8_t dlevel, const char *line, size_t len)
 {
-    if (dlevel >= 0 && grp != 0) {
-        // filter debug prints only when dlevel is >0 and grp is given
+    if (m_trace.batch_fill + len > m_trace.batch_size) {
+        mbed_trace_batch_flush();
+    }
+    if (m_trace.batch_fill == 0 && m_trace.time_f) {
+        m_trace.batch_time = m_trace.time_f();
+    }
+    // lines longer than a buffer are written out in pieces
+    while (m_trace.batch_fill + len > m_trace.batch_size) {
+        size_t part = m_trace.batch_size - m_trace.batch_fill;
+        memcpy(m_trace.batch_active + m_trace.batch_fill, line, part);
+        m_trace.batch_fill += part;
+        line += part;
+        len -= part;
+        mbed_trace_batch_flush();
+    }
+    memcpy(m_trace.batch_active + m_trace.batch_fill, line, len);
+    m_trace.batch_fill += len;
+    m_trace.batch_lines++;
 
-        /// @TODO this could be much better..
-        if (m_trace.filters_exclude[0] != '\0' &&
-                strstr(m_trace.filters_exclude, grp) != 0) {
-            //grp was in exclude list
-            return 1;
-        }
-        if (m_trace.filters_include[0] != '\0' &&
-                strstr(m_trace.filters_include, grp) == 0) {
-            //grp was in include list
-            return 1;
+    if ((m_trace.batch_flush_bytes && m_trace.batch_fill >= m_trace.batch_flush_bytes) ||
+            (dlevel & m_trace.batch_flush_levels) ||
+            (m_trace.batch_flush_lines && m_trace.batch_lines >= m_trace.batch_flush_lines) ||
+            (m_trace.batch_max_age && m_trace.time_f && m_trace.time_f() - m_trace.batch_time >= m_trace.batch_max_age)) {
+        mbed_trace_batch_flush();
+    }
+}
+int mbed_trace_batch_enable(void (*write_f)(const char *data, size_t len), size_t size)
+{
+    mbed_trace_mutex_wait();
+    if (m_trace.batch_buffer) {
+        mbed_trace_batch_flush();
+        trace_mem_free(m_trace_static_batch_buffer, m_trace.batch_buffer);
+        m_trace.batch_buffer = 0;
+        m_trace.batch_active = 0;
+        m_trace.batch_size = 0;
+    }
+    if (write_f && size) {
+        m_trace.batch_buffer = trace_mem_alloc(m_trace_static_batch_buffer, 2 * size);
+        if (m_trace.batch_buffer == NULL) {
+            mbed_trace_mutex_release();
+            return -1;
         }
+        m_trace.batch_size = size;
+        m_trace.batch_active = m_trace.batch_buffer;
+        m_trace.batch_fill = 0;
+        m_trace.batch_lines = 0;
+        m_trace.batch_write_f = write_f;
     }
+    mbed_trace_mutex_release();
     return 0;
 }
-static void mbed_trace_default_print(const char *str)
+void mbed_trace_batch_thresholds_set(size_t bytes, uint16_t lines, uint32_t max_age, uint8_t flush_levels)
 {
-    puts(str);
+    mbed_trace_mutex_wait();
+    m_trace.batch_flush_bytes = bytes;
+    m_trace.batch_flush_lines = lines;
+    m_trace.batch_max_age = max_age;
+    m_trace.batch_flush_levels = flush_levels;
+    mbed_trace_mutex_release();
 }
-void mbed_tracef(uint8_t dlevel, const char *grp, const char *fmt, ...)
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+int mbed_trace_recorder_init(void *region, size_t size)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    mbed_vtracef(dlevel, grp, fmt, ap);
-    va_end(ap);
+    trace_recorder_header_t *hdr = region;
+
+    if (region == NULL) {
+        m_trace.recorder = 0;
+        return 0;
+    }
+    if (((uintptr_t)region & (sizeof(uint32_t) - 1)) ||
+            size < sizeof(trace_recorder_header_t) + TRACE_RECORDER_MIN_SIZE ||
+            size - sizeof(trace_recorder_header_t) > UINT32_MAX) {
+        return -1;
+    }
+    size -= sizeof(trace_recorder_header_t);
+    if (hdr->magic != TRACE_RECORDER_MAGIC ||
+            hdr->version != TRACE_RECORDER_VERSION ||
+            hdr->header_size != sizeof(trace_recorder_header_t) ||
+            hdr->size != size ||
+            hdr->cursor >= size) {
+        // not a recorder of this size, start a new one
+        memset(hdr, 0, sizeof(trace_recorder_header_t));
+        hdr->version = TRACE_RECORDER_VERSION;
+        hdr->header_size = sizeof(trace_recorder_header_t);
+        hdr->size = size;
+        trace_atomic_store(&hdr->magic, TRACE_RECORDER_MAGIC);
+    }
+    m_trace.recorder = hdr;
+    return 0;
 }
-void mbed_vtracef(uint8_t dlevel, const char *grp, const char *fmt, va_list ap)
+void mbed_trace_recorder_printn(const char *str, size_t len)
 {
-    if (m_trace.mutex_wait_f) {
-        m_trace.mutex_wait_f();
-        m_trace.mutex_lock_count++;
+    trace_recorder_header_t *hdr = m_trace.recorder;
+    if (hdr == NULL) {
+        return;
     }
-
-    if (NULL == m_trace.line) {
-        goto end;
+    char *data = (char *)(hdr + 1);
+    uint32_t size = hdr->size;
+    uint32_t cursor = hdr->cursor;
+    if (len > size) {
+        // only the end fits
+        str += len - size;
+        len = size;
     }
-
-    m_trace.line[0] = 0; //by default trace is empty
-
-    if (mbed_trace_skip(dlevel, grp) || fmt == 0 || grp == 0 || !m_trace.printf) {
-        //return tmp data pointer back to the beginning
-        mbed_trace_reset_tmp();
-        goto end;
+    if (len < size - cursor) {
+        memcpy(data + cursor, str, len);
+        cursor += len;
+    } else {
+        uint32_t first = size - cursor;
+        memcpy(data + cursor, str, first);
+        memcpy(data, str + first, len - first);
+        cursor = len - first;
+        hdr->wraps++;
     }
-    if ((m_trace.trace_config & TRACE_MASK_LEVEL) &  dlevel) {
-        bool color = (m_trace.trace_config & TRACE_MODE_COLOR) != 0;
-        bool plain = (m_trace.trace_config & TRACE_MODE_PLAIN) != 0;
-        bool cr    = (m_trace.trace_config & TRACE_CARRIAGE_RETURN) != 0;
-
-        int retval = 0, bLeft = m_trace.line_length;
-        char *ptr = m_trace.line;
-        if (plain == true || dlevel == TRACE_LEVEL_CMD) {
-            //add trace data
-            retval = vsnprintf(ptr, bLeft, fmt, ap);
-            if (dlevel == TRACE_LEVEL_CMD && m_trace.cmd_printf) {
-                m_trace.cmd_printf(m_trace.line);
-                m_trace.cmd_printf("\n");
-            } else {
-                //print out whole data
-                m_trace.printf(m_trace.line);
-            }
-        } else {
-            if (color) {
-                if (cr) {
-                    retval = snprintf(ptr, bLeft, "\r\x1b[2K");
-                    if (retval >= bLeft) {
-                        retval = 0;
-                    }
-                    if (retval > 0) {
-                        ptr += retval;
-                        bLeft -= retval;
-                    }
-                }
-                if (bLeft > 0) {
-                    //include color in ANSI/VT100 escape code
-                    switch (dlevel) {
-                        case (TRACE_LEVEL_ERROR):
-                            retval = snprintf(ptr, bLeft, "%s", VT100_COLOR_ERROR);
-                            break;
-                        case (TRACE_LEVEL_WARN):
-                            retval = snprintf(ptr, bLeft, "%s", VT100_COLOR_WARN);
-                            break;
-                        case (TRACE_LEVEL_INFO):
-                            retval = snprintf(ptr, bLeft, "%s", VT100_COLOR_INFO);
-                            break;
-                        case (TRACE_LEVEL_DEBUG):
-                            retval = snprintf(ptr, bLeft, "%s", VT100_COLOR_DEBUG);
-                            break;
-                        default:
-                            color = 0; //avoid unneeded color-terminate code
-                            retval = 0;
-                            break;
-                    }
-                    if (retval >= bLeft) {
-                        retval = 0;
-                    }
-                    if (retval > 0 && color) {
-                        ptr += retval;
-                        bLeft -= retval;
-                    }
-                }
-
-            }
-            if (bLeft > 0 && m_trace.prefix_f) {
-                //find out length of body
-                size_t sz = 0;
-                va_list ap2;
-                va_copy(ap2, ap);
-                sz = vsnprintf(NULL, 0, fmt, ap2) + retval + (retval ? 4 : 0);
-                va_end(ap2);
-                //add prefix string
-                retval = snprintf(ptr, bLeft, "%s", m_trace.prefix_f(sz));
-                if (retval >= bLeft) {
-                    retval = 0;
-                }
+    // the data is in place before the cursor moves over it
+    trace_atomic_store(&hdr->cursor, cursor);
+}
+#endif
+void mbed_trace_flush(void)
+{
+    trace_line_lock();
+    if (m_trace.coalesce_count) {
+        trace_output_lock();
+        mbed_trace_coalesce_end();
+        trace_output_unlock();
+    }
+    trace_line_unlock();
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    if (m_trace.async_queue) {
+        // the batch buffer belongs to the thread printing out the queue
+        trace_atomic_store_sync(&m_trace.async_flush, 1);
+        mbed_trace_async_drain();
+        return;
+    }
+#endif
+    mbed_trace_mutex_wait();
+    if (m_trace.batch_buffer) {
+        mbed_trace_batch_flush();
+    }
+    mbed_trace_mutex_release();
+#endif
+}
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+static bool mbed_trace_async_print_one(void);
+/** Take the print functions for printing out queued records, without waiting
+ * @return false when another thread has them */
+static bool mbed_trace_async_own(void)
+{
+    uint32_t idle = 0;
+    while (!trace_atomic_cas(&m_trace.async_draining, &idle, 1)) {
+        if (idle != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+/** Flush the batch buffer if it was asked for, called by the owner of the print functions */
+static void mbed_trace_async_batch_flush(void)
+{
+    if (trace_atomic_load_sync(&m_trace.async_flush)) {
+        trace_atomic_store_sync(&m_trace.async_flush, 0);
+        if (m_trace.batch_buffer) {
+            mbed_trace_batch_flush();
+        }
+    }
+}
+#endif
+int mbed_trace_async_enable(uint16_t record_count)
+{
+    uint32_t slots = 1;
+    int retval = 0;
+
+    // keeps out the tracing threads unless the buffers are per thread
+    mbed_trace_mutex_wait();
+    // and the drain, which prints without the mutex
+    if (!mbed_trace_async_own()) {
+        mbed_trace_mutex_release();
+        return -1;
+    }
+    if (m_trace.async_queue) {
+        // print out whatever is still pending before releasing the queue
+        while (mbed_trace_async_print_one()) {
+        }
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+        mbed_trace_async_batch_flush();
+#endif
+        trace_mem_free(m_trace_static_async_queue, m_trace.async_queue);
+        m_trace.async_queue = 0;
+        m_trace.async_mask = 0;
+    }
+    if (record_count) {
+        // round up to power of two so that positions can be masked
+        while (slots < record_count) {
+            slots <<= 1;
+        }
+        m_trace.async_record_length = DEFAULT_TRACE_ASYNC_RECORD_LEN;
+        m_trace.async_mask = slots - 1;
+        m_trace.async_queue = trace_mem_alloc(m_trace_static_async_queue, slots * trace_async_slot_size());
+        if (m_trace.async_queue == NULL) {
+            m_trace.async_mask = 0;
+            retval = -1;
+        } else {
+            for (uint32_t i = 0; i < slots; i++) {
+                trace_async_slot(i)->turn = i;
+            }
+            m_trace.async_enqueue_pos = 0;
+            m_trace.async_dequeue_pos = 0;
+        }
+    }
+    trace_atomic_store_sync(&m_trace.async_draining, 0);
+    mbed_trace_mutex_release();
+    return retval;
+}
+void mbed_trace_async_policy_set(uint8_t policy)
+{
+    m_trace.async_policy = policy;
+}
+void mbed_trace_async_notify_function_set(void (*notify_f)(void))
+{
+    m_trace.async_notify_f = notify_f;
+}
+void mbed_trace_async_wait_function_set(void (*wait_f)(void))
+{
+    m_trace.async_wait_f = wait_f;
+}
+uint32_t mbed_trace_async_dropped_get(void)
+{
+    return trace_atomic_load(&m_trace.async_dropped);
+}
+uint32_t mbed_trace_async_sequence_get(void)
+{
+    return m_trace.async_current_seq;
+}
+/** Reserve the oldest queued record for reading.
+ * The slot must be handed back with mbed_trace_async_release(). */
+static trace_async_slot_t *mbed_trace_async_acquire(uint32_t *pos_ptr)
+{
+    uint32_t pos = trace_atomic_load(&m_trace.async_dequeue_pos);
+    for (;;) {
+        trace_async_slot_t *slot = trace_async_slot(pos);
+        int32_t diff = (int32_t)(trace_atomic_load(&slot->turn) - (pos + 1));
+        if (diff == 0) {
+            if (trace_atomic_cas(&m_trace.async_dequeue_pos, &pos, pos + 1)) {
+                *pos_ptr = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            // queue is empty
+            return NULL;
+        } else {
+            pos = trace_atomic_load(&m_trace.async_dequeue_pos);
+        }
+    }
+}
+static void mbed_trace_async_release(trace_async_slot_t *slot, uint32_t pos)
+{
+    trace_atomic_store(&slot->turn, pos + m_trace.async_mask + 1);
+}
+/** Print the oldest queued record, called by the owner of the print functions
+ * @return false when the queue is empty */
+static bool mbed_trace_async_print_one(void)
+{
+    uint32_t pos;
+    trace_async_slot_t *slot = mbed_trace_async_acquire(&pos);
+    if (slot == NULL) {
+        return false;
+    }
+    m_trace.async_current_seq = slot->seq;
+    mbed_trace_print_line(slot->dlevel, (char *)(slot + 1), slot->length);
+    mbed_trace_async_release(slot, pos);
+    return true;
+}
+/** Copy a formatted line into the queue. Lock-free, safe from multiple producers. */
+static void mbed_trace_async_push(uint8_t dlevel, const char *line, size_t len)
+{
+    trace_async_slot_t *slot;
+    uint32_t seq = trace_atomic_add(&m_trace.async_seq, 1);
+    uint32_t pos = trace_atomic_load(&m_trace.async_enqueue_pos);
+
+    for (;;) {
+        slot = trace_async_slot(pos);
+        int32_t diff = (int32_t)(trace_atomic_load(&slot->turn) - pos);
+        if (diff == 0) {
+            if (trace_atomic_cas(&m_trace.async_enqueue_pos, &pos, pos + 1)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // queue is full
+            if (m_trace.async_policy == TRACE_ASYNC_POLICY_DROP_OLDEST) {
+                uint32_t old_pos;
+                trace_async_slot_t *old = mbed_trace_async_acquire(&old_pos);
+                if (old) {
+                    mbed_trace_async_release(old, old_pos);
+                    trace_atomic_add(&m_trace.async_dropped, 1);
+                }
+            } else if (m_trace.async_policy == TRACE_ASYNC_POLICY_BLOCK && m_trace.async_wait_f) {
+                // wake up the drain thread and let it make room, the print
+                // functions are never called from the tracing thread
+                if (m_trace.async_notify_f) {
+                    m_trace.async_notify_f();
+                }
+                m_trace.async_wait_f();
+            } else {
+                // TRACE_ASYNC_POLICY_DROP_NEWEST, or nothing to wait with
+                trace_atomic_add(&m_trace.async_dropped, 1);
+                return;
+            }
+            pos = trace_atomic_load(&m_trace.async_enqueue_pos);
+        } else {
+            pos = trace_atomic_load(&m_trace.async_enqueue_pos);
+        }
+    }
+    slot->seq = seq;
+    slot->dlevel = dlevel;
+    char *data = (char *)(slot + 1);
+    if (len >= m_trace.async_record_length) {
+        len = m_trace.async_record_length - 1;
+    }
+    memcpy(data, line, len);
+    data[len] = 0;
+    slot->length = len;
+    trace_atomic_store(&slot->turn, pos + 1);
+
+    if (m_trace.async_notify_f) {
+        m_trace.async_notify_f();
+    }
+}
+int mbed_trace_async_drain(void)
+{
+    int count = 0;
+    // a drain already running in another thread prints the records of this call too
+    uint32_t request = trace_atomic_add_sync(&m_trace.async_requests, 1) + 1;
+
+    // the print functions are owned by one thread at a time, without the mutex,
+    // so the tracing threads never wait for them
+    while (mbed_trace_async_own()) {
+        if (m_trace.async_queue) {
+            while (mbed_trace_async_print_one()) {
+                count++;
+            }
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+            mbed_trace_async_batch_flush();
+#endif
+        }
+        trace_atomic_store_sync(&m_trace.async_draining, 0);
+        // look again if another call came in while the print functions were owned
+        uint32_t latest = trace_atomic_load_sync(&m_trace.async_requests);
+        if (latest == request) {
+            break;
+        }
+        request = latest;
+    }
+    return count;
+}
+#endif
+#define TRACE_FNV_OFFSET    2166136261u
+#define TRACE_FNV_PRIME     16777619u
+
+static bool mbed_trace_filter_find(const trace_filter_t *filter, uint32_t hash, const char *name, size_t length, bool prefix)
+{
+    uint32_t i = hash & filter->mask;
+    for (;; i = (i + 1) & filter->mask) {
+        const trace_filter_entry_t *entry = &filter->table[i];
+        if (entry->name == NULL) {
+            return false;
+        }
+        if (entry->hash == hash && entry->length == length && entry->prefix == prefix &&
+                memcmp(entry->name, name, length) == 0) {
+            return true;
+        }
+    }
+}
+/** Check if group matches any name or wildcard prefix of the filter.
+ * The group is hashed once; prefixes are looked up with the partial hash
+ * at each prefix length present in the filter. */
+static bool mbed_trace_filter_match(const trace_filter_t *filter, const char *grp)
+{
+    uint32_t hash = TRACE_FNV_OFFSET;
+    size_t length;
+
+    for (length = 0;; length++) {
+        if (length < 32 && (filter->prefix_lengths & (1u << length)) &&
+                mbed_trace_filter_find(filter, hash, grp, length, true)) {
+            return true;
+        }
+        if (grp[length] == 0) {
+            break;
+        }
+        hash = (hash ^ (uint8_t)grp[length]) * TRACE_FNV_PRIME;
+    }
+    return mbed_trace_filter_find(filter, hash, grp, length, false);
+}
+/** Start matching groups without the mutex
+ * @return epoch to give to mbed_trace_filter_read_end() */
+static uint32_t mbed_trace_filter_read_begin(void)
+{
+    uint32_t epoch = trace_atomic_load(&m_trace.filter_generation) & 1;
+    // sequentially consistent with the filter pointer loads: a writer either sees
+    // the count, or the reader sees the new filter
+    trace_atomic_add_sync(&m_trace.filter_readers[epoch], 1);
+    return epoch;
+}
+static void mbed_trace_filter_read_end(uint32_t epoch)
+{
+    trace_atomic_add_sync(&m_trace.filter_readers[epoch], (uint32_t) -1);
+}
+/** Unlink the replaced filters which no trace call can be matching any more.
+ * Called with the mutex held, never waits for the readers: the generation is advanced
+ * only when no reader is left in the previous one, and a filter is freed after two
+ * advances, as a reader may have read the generation just before it was advanced.
+ * @return list of filters to free, linked with retired_next */
+static trace_filter_t *mbed_trace_filter_reclaim(void)
+{
+    trace_filter_t *freed = NULL;
+    trace_filter_t **link = &m_trace.filters_retired;
+
+    for (int i = 0; i < 2 && *link; i++) {
+        uint32_t generation = m_trace.filter_generation;
+        if (trace_atomic_load_sync(&m_trace.filter_readers[(generation + 1) & 1]) != 0) {
+            break;
+        }
+        trace_atomic_store_sync(&m_trace.filter_generation, generation + 1);
+    }
+    while (*link) {
+        trace_filter_t *filter = *link;
+        if (m_trace.filter_generation - filter->retired_generation >= 2) {
+            *link = filter->retired_next;
+            filter->retired_next = freed;
+            freed = filter;
+        } else {
+            link = &filter->retired_next;
+        }
+    }
+    return freed;
+}
+static void mbed_trace_filter_free_list(trace_filter_t *list)
+{
+    while (list) {
+        trace_filter_t *next = list->retired_next;
+        mbed_trace_filter_free(list);
+        list = next;
+    }
+}
+/** Compile comma separated group list to hash table. Names ending with '*' match as prefixes. */
+static void mbed_trace_filter_set(trace_filter_t **filter, const char *list)
+{
+    trace_filter_t *compiled = NULL;
+    trace_filter_t *old;
+
+    // tables replaced earlier are usually free by now, which makes room in the static pool
+    mbed_trace_mutex_wait();
+    old = mbed_trace_filter_reclaim();
+    mbed_trace_mutex_release();
+    mbed_trace_filter_free_list(old);
+
+    if (list && list[0]) {
+        size_t list_length = strlen(list) + 1;
+        uint32_t slots = 2, count = 1;
+        for (const char *ptr = list; *ptr; ptr++) {
+            count += (*ptr == ',');
+        }
+        while (slots < count * 2) {
+            slots <<= 1;
+        }
+        // one block: hash table, names and the original list
+        compiled = mbed_trace_filter_alloc(sizeof(trace_filter_t) + slots * sizeof(trace_filter_entry_t) + 2 * list_length);
+        if (compiled) {
+            char *names = (char *)(compiled->table + slots);
+            memset(compiled, 0, sizeof(trace_filter_t) + slots * sizeof(trace_filter_entry_t));
+            compiled->list = names + list_length;
+            compiled->mask = slots - 1;
+            memcpy(names, list, list_length);
+            memcpy(names + list_length, list, list_length);
+
+            for (char *name = names, *next; name; name = next) {
+                size_t length;
+                bool prefix = false;
+                next = strchr(name, ',');
+                if (next) {
+                    *next++ = 0;
+                }
+                while (*name == ' ') {
+                    name++;
+                }
+                length = strlen(name);
+                while (length > 0 && name[length - 1] == ' ') {
+                    length--;
+                }
+                if (length > 0 && name[length - 1] == '*') {
+                    prefix = true;
+                    length--;
+                    if (length >= 32) {
+                        // too long prefix to be looked up
+                        continue;
+                    }
+                    compiled->prefix_lengths |= 1u << length;
+                } else if (length == 0 || length > UINT8_MAX) {
+                    continue;
+                }
+                uint32_t hash = TRACE_FNV_OFFSET;
+                for (size_t i = 0; i < length; i++) {
+                    hash = (hash ^ (uint8_t)name[i]) * TRACE_FNV_PRIME;
+                }
+                if (mbed_trace_filter_find(compiled, hash, name, length, prefix)) {
+                    continue;
+                }
+                uint32_t i = hash & compiled->mask;
+                while (compiled->table[i].name) {
+                    i = (i + 1) & compiled->mask;
+                }
+                compiled->table[i].name = name;
+                compiled->table[i].hash = hash;
+                compiled->table[i].length = length;
+                compiled->table[i].prefix = prefix;
+                compiled->count++;
+            }
+        }
+    }
+    // the complete filter is published with one pointer store. Filters are matched
+    // without the mutex (mbed_trace_enabled() and thread local mode), so the old one
+    // is freed only after the trace calls which may still be using it have finished,
+    // here or in a later filter change, or in mbed_trace_free()
+    mbed_trace_mutex_wait();
+    old = *filter;
+    trace_atomic_store_sync(filter, compiled);
+    if (old) {
+        old->retired_generation = m_trace.filter_generation;
+        old->retired_next = m_trace.filters_retired;
+        m_trace.filters_retired = old;
+    }
+    old = mbed_trace_filter_reclaim();
+    mbed_trace_mutex_release();
+    mbed_trace_filter_free_list(old);
+}
+void mbed_trace_exclude_filters_set(char *filters)
+{
+    mbed_trace_filter_set(&m_trace.filters_exclude, filters);
+}
+const char *mbed_trace_exclude_filters_get(void)
+{
+    return m_trace.filters_exclude ? m_trace.filters_exclude->list : "";
+}
+const char *mbed_trace_include_filters_get(void)
+{
+    return m_trace.filters_include ? m_trace.filters_include->list : "";
+}
+void mbed_trace_include_filters_set(char *filters)
+{
+    mbed_trace_filter_set(&m_trace.filters_include, filters);
+}
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+int mbed_trace_sink_remove(int sink)
+{
+    if (sink < 0 || sink >= DEFAULT_TRACE_SINK_COUNT || !(m_trace.sinks_used & (1u << sink))) {
+        return -1;
+    }
+    mbed_trace_mutex_wait();
+    m_trace.sinks[sink].printn = NULL;
+    mbed_trace_active_levels_update();
+    mbed_trace_mutex_release();
+    // freed after the trace calls which may still be matching the groups
+    mbed_trace_filter_set(&m_trace.sinks[sink].groups, NULL);
+    mbed_trace_mutex_wait();
+    m_trace.sinks_used &= ~(1u << sink);
+    mbed_trace_mutex_release();
+    return 0;
+}
+int mbed_trace_sink_add(void (*printn)(const char *str, size_t len), uint8_t config, const char *groups)
+{
+    trace_sink_t *entry;
+    int sink = -1;
+
+    if (printn == NULL) {
+        return -1;
+    }
+    mbed_trace_mutex_wait();
+    for (int i = 0; i < DEFAULT_TRACE_SINK_COUNT; i++) {
+        if (!(m_trace.sinks_used & (1u << i))) {
+            m_trace.sinks_used |= 1u << i;
+            sink = i;
+            break;
+        }
+    }
+    mbed_trace_mutex_release();
+    if (sink < 0) {
+        return -1;
+    }
+    // the slot is not printed to before the print function is set
+    entry = &m_trace.sinks[sink];
+    entry->config = config;
+    if (groups && groups[0]) {
+        mbed_trace_filter_set(&entry->groups, groups);
+        if (entry->groups == NULL) {
+            mbed_trace_sink_remove(sink);
+            return -1;
+        }
+    }
+    mbed_trace_mutex_wait();
+    entry->printn = printn;
+    mbed_trace_active_levels_update();
+    mbed_trace_mutex_release();
+    return sink;
+}
+#endif
+/** Find the id of an interned group.
+ * @return group id, or -1 if the group has no settings of its own */
+static int mbed_trace_group_find(const char *grp)
+{
+    uint32_t hash = TRACE_FNV_OFFSET;
+    for (const char *ptr = grp; *ptr; ptr++) {
+        hash = (hash ^ (uint8_t)*ptr) * TRACE_FNV_PRIME;
+    }
+    for (uint32_t i = hash % TRACE_GROUP_INDEX_SIZE;; i = (i + 1) % TRACE_GROUP_INDEX_SIZE) {
+        uint8_t slot = trace_atomic_load(&m_trace.group_index[i]);
+        if (slot == 0) {
+            return -1;
+        }
+        const trace_group_t *group = &m_trace.groups[slot - 1];
+        if (group->hash == hash && strncmp(group->name, grp, TRACE_GROUP_NAME_LEN) == 0) {
+            return slot - 1;
+        }
+    }
+}
+/** Intern a group, must be called with the mutex held.
+ * @return group id, or -1 if the group table is full or the name too long */
+static int mbed_trace_group_add(const char *grp)
+{
+    int id = mbed_trace_group_find(grp);
+    size_t length = strlen(grp);
+
+    if (id >= 0) {
+        return id;
+    }
+    if (m_trace.group_count >= DEFAULT_TRACE_GROUP_COUNT || length >= TRACE_GROUP_NAME_LEN) {
+        return -1;
+    }
+    id = m_trace.group_count;
+    trace_group_t *group = &m_trace.groups[id];
+    memcpy(group->name, grp, length + 1);
+    group->hash = TRACE_FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) {
+        group->hash = (group->hash ^ (uint8_t)grp[i]) * TRACE_FNV_PRIME;
+    }
+    group->level = TRACE_GROUP_LEVEL_DEFAULT;
+    m_trace.group_count++;
+
+    uint32_t i = group->hash % TRACE_GROUP_INDEX_SIZE;
+    while (m_trace.group_index[i]) {
+        i = (i + 1) % TRACE_GROUP_INDEX_SIZE;
+    }
+    // publish the group after it has been filled in, readers don't take the mutex
+    trace_atomic_store(&m_trace.group_index[i], id + 1);
+    return id;
+}
+int mbed_trace_group_level_set(const char *grp, uint8_t level)
+{
+    int id;
+    if (grp == NULL) {
+        return -1;
+    }
+    mbed_trace_mutex_wait();
+    id = mbed_trace_group_add(grp);
+    if (id >= 0) {
+        m_trace.groups[id].level = level;
+        mbed_trace_active_levels_update();
+    }
+    mbed_trace_mutex_release();
+    return id < 0 ? -1 : 0;
+}
+uint8_t mbed_trace_group_level_get(const char *grp)
+{
+    int id = grp ? mbed_trace_group_find(grp) : -1;
+    return id < 0 ? TRACE_GROUP_LEVEL_DEFAULT : m_trace.groups[id].level;
+}
+int mbed_trace_group_sample_set(const char *grp, uint8_t levels, uint16_t rate)
+{
+    int id;
+    if (grp == NULL) {
+        return -1;
+    }
+    mbed_trace_mutex_wait();
+    id = mbed_trace_group_add(grp);
+    if (id >= 0) {
+        trace_group_t *group = &m_trace.groups[id];
+        group->sample_levels = levels;
+        group->sample_rate = rate;
+        group->sample_seen = 0;
+        group->sample_printed = 0;
+        m_trace.sampling = false;
+        for (int i = 0; i < m_trace.group_count; i++) {
+            if (m_trace.groups[i].sample_rate > 1 && m_trace.groups[i].sample_levels) {
+                m_trace.sampling = true;
+            }
+        }
+    }
+    mbed_trace_mutex_release();
+    return id < 0 ? -1 : 0;
+}
+int mbed_trace_group_sample_stats_get(const char *grp, uint32_t *seen, uint32_t *printed)
+{
+    int id = grp ? mbed_trace_group_find(grp) : -1;
+    if (id < 0) {
+        return -1;
+    }
+    if (seen) {
+        *seen = trace_atomic_load(&m_trace.groups[id].sample_seen);
+    }
+    if (printed) {
+        *printed = trace_atomic_load(&m_trace.groups[id].sample_printed);
+    }
+    return 0;
+}
+/** Check if a trace of a sampled group is printed, every sample_rate:th trace is */
+static bool mbed_trace_sample(uint8_t dlevel, const char *grp)
+{
+    int id = mbed_trace_group_find(grp);
+    if (id < 0) {
+        return true;
+    }
+    trace_group_t *group = &m_trace.groups[id];
+    if (group->sample_rate <= 1 || !(group->sample_levels & dlevel)) {
+        return true;
+    }
+    if (trace_atomic_add(&group->sample_seen, 1) % group->sample_rate != 0) {
+        return false;
+    }
+    trace_atomic_add(&group->sample_printed, 1);
+    return true;
+}
+/** Active level bitmask for a group */
+static uint8_t mbed_trace_level_mask(const char *grp)
+{
+    if (m_trace.group_count) {
+        int id = mbed_trace_group_find(grp);
+        if (id >= 0 && m_trace.groups[id].level != TRACE_GROUP_LEVEL_DEFAULT) {
+            return m_trace.groups[id].level;
+        }
+    }
+    return m_trace.trace_config & TRACE_MASK_LEVEL;
+}
+/** Levels which mbed_tracef() would do something with for the group */
+static uint8_t mbed_trace_enabled_levels(const char *grp)
+{
+    uint8_t levels = mbed_trace_level_mask(grp);
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    if (m_trace.history) {
+        levels |= m_trace.history_levels;
+    }
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    // the sinks have their own levels, independent of the global and group levels
+    levels |= m_trace.sink_levels;
+#endif
+    return levels;
+}
+bool mbed_trace_enabled(uint8_t dlevel, const char *grp)
+{
+    if (!trace_initialized() || grp == NULL) {
+        return false;
+    }
+    return !mbed_trace_skip(dlevel, grp) && (mbed_trace_enabled_levels(grp) & dlevel) != 0;
+}
+bool mbed_trace_check(uint8_t dlevel, const char *grp)
+{
+    if (!trace_initialized() || grp == NULL) {
+        return false;
+    }
+    // counted in the same order as in mbed_vtracef()
+    if (mbed_trace_skip(dlevel, grp)) {
+        trace_stats_add(dlevel, grp, filtered);
+        return false;
+    }
+    if (!(mbed_trace_enabled_levels(grp) & dlevel)) {
+        trace_stats_add(dlevel, grp, masked);
+        return false;
+    }
+    return true;
+}
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+/** Find the statistics of a level and of a group
+ * @return number of statistics found, 0 to 2 */
+static int mbed_trace_stats_find(uint8_t dlevel, const char *grp, mbed_trace_stats_t *stats[2])
+{
+    int count = 0, id;
+    for (int i = 0; i < TRACE_STATS_LEVELS; i++) {
+        if (dlevel == (1u << i)) {
+            stats[count++] = &m_trace.level_stats[i];
+            break;
+        }
+    }
+    id = m_trace.group_count ? mbed_trace_group_find(grp) : -1;
+    if (id >= 0) {
+        stats[count++] = &m_trace.groups[id].stats;
+    }
+    return count;
+}
+/** Add to the counter at offset in the statistics of the level and of the group */
+static void mbed_trace_stats_add(uint8_t dlevel, const char *grp, size_t offset, uint32_t n)
+{
+    mbed_trace_stats_t *stats[2];
+    for (int i = mbed_trace_stats_find(dlevel, grp, stats); i-- > 0;) {
+        trace_atomic_add((uint32_t *)((char *)stats[i] + offset), n);
+    }
+}
+/** Add up the counters of src to dst */
+static void mbed_trace_stats_sum(mbed_trace_stats_t *dst, mbed_trace_stats_t *src)
+{
+    dst->emitted += trace_atomic_load(&src->emitted);
+    dst->filtered += trace_atomic_load(&src->filtered);
+    dst->masked += trace_atomic_load(&src->masked);
+    dst->truncated += trace_atomic_load(&src->truncated);
+    dst->bytes += trace_atomic_load(&src->bytes);
+    dst->output_time += trace_atomic_load(&src->output_time);
+}
+/** Zero the counters, which other threads may be updating without the mutex */
+static void mbed_trace_stats_clear(mbed_trace_stats_t *stats)
+{
+    trace_atomic_store(&stats->emitted, 0);
+    trace_atomic_store(&stats->filtered, 0);
+    trace_atomic_store(&stats->masked, 0);
+    trace_atomic_store(&stats->truncated, 0);
+    trace_atomic_store(&stats->array_overflows, 0);
+    trace_atomic_store(&stats->bytes, 0);
+    trace_atomic_store(&stats->output_time, 0);
+}
+void mbed_trace_stats_get(uint8_t levels, mbed_trace_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < TRACE_STATS_LEVELS; i++) {
+        if (levels & (1u << i)) {
+            mbed_trace_stats_sum(stats, &m_trace.level_stats[i]);
+        }
+    }
+    stats->array_overflows = trace_atomic_load(&m_trace.array_overflows);
+}
+int mbed_trace_group_stats_get(const char *grp, mbed_trace_stats_t *stats)
+{
+    int id = grp ? mbed_trace_group_find(grp) : -1;
+    if (id < 0) {
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    mbed_trace_stats_sum(stats, &m_trace.groups[id].stats);
+    return 0;
+}
+void mbed_trace_stats_reset(void)
+{
+    mbed_trace_mutex_wait();
+    for (int i = 0; i < TRACE_STATS_LEVELS; i++) {
+        mbed_trace_stats_clear(&m_trace.level_stats[i]);
+    }
+    for (int i = 0; i < m_trace.group_count; i++) {
+        mbed_trace_stats_clear(&m_trace.groups[i].stats);
+    }
+    trace_atomic_store(&m_trace.array_overflows, 0);
+    mbed_trace_mutex_release();
+}
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+/** Histogram bucket of a value, four buckets per power of two */
+static unsigned mbed_trace_latency_bucket(uint32_t value)
+{
+    unsigned msb = 0;
+    if (value < 4) {
+        return value;
+    }
+#if defined(__GNUC__)
+    msb = 31 - __builtin_clz(value);
+#else
+    for (uint32_t v = value; v > 1; v >>= 1) {
+        msb++;
+    }
+#endif
+    return (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+}
+/** Largest value of a histogram bucket */
+static uint32_t mbed_trace_latency_bucket_max(unsigned bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+    bucket++;
+    if (bucket == TRACE_LATENCY_BUCKETS) {
+        return UINT32_MAX;
+    }
+    return ((4u | (bucket & 3)) << (bucket / 4 - 1)) - 1;
+}
+static void mbed_trace_latency_record(uint8_t phase, uint32_t value)
+{
+    mbed_trace_latency_t *latency = &m_trace.latency[phase];
+
+    // the count is summed up from the buckets when read
+    trace_atomic_add(&latency->buckets[mbed_trace_latency_bucket(value)], 1);
+#if TRACE_HAVE_ATOMICS
+    uint32_t max = trace_atomic_load(&latency->max);
+    while (value > max && !trace_atomic_cas(&latency->max, &max, value)) {
+    }
+#else
+    if (value > latency->max) {
+        latency->max = value;
+    }
+#endif
+}
+static void mbed_trace_latency_add(uint8_t phase, uint32_t start)
+{
+    mbed_trace_latency_record(phase, trace_clock() - start);
+}
+void mbed_trace_latency_get(uint8_t phase, mbed_trace_latency_t *latency)
+{
+    memset(latency, 0, sizeof(*latency));
+    if (phase >= TRACE_LATENCY_PHASES) {
+        return;
+    }
+    for (unsigned i = 0; i < TRACE_LATENCY_BUCKETS; i++) {
+        latency->buckets[i] = trace_atomic_load(&m_trace.latency[phase].buckets[i]);
+        latency->count += latency->buckets[i];
+    }
+    latency->max = trace_atomic_load(&m_trace.latency[phase].max);
+}
+uint32_t mbed_trace_latency_quantile(const mbed_trace_latency_t *latency, uint16_t permille)
+{
+    // rank of the value, rounded up
+    uint64_t rank = ((uint64_t)latency->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < TRACE_LATENCY_BUCKETS && latency->count; i++) {
+        seen += latency->buckets[i];
+        if (seen >= rank && seen > 0) {
+            uint32_t value = mbed_trace_latency_bucket_max(i);
+            return value < latency->max ? value : latency->max;
+        }
+    }
+    return 0;
+}
+int mbed_trace_latency_dump(char *buf, size_t size)
+{
+    static const char *const names[TRACE_LATENCY_PHASES] = { "lock", "format", "prefix", "output" };
+    mbed_trace_latency_t latency;
+    size_t len = 0;
+
+    if (size) {
+        buf[0] = 0;
+    }
+    for (uint8_t phase = 0; phase < TRACE_LATENCY_PHASES; phase++) {
+        mbed_trace_latency_get(phase, &latency);
+        int retval = snprintf(buf + len, size - len,
+                              "%s: count %" PRIu32 " p50 %" PRIu32 " p90 %" PRIu32 " p99 %" PRIu32 " p999 %" PRIu32 " max %" PRIu32 "\n",
+                              names[phase], latency.count,
+                              mbed_trace_latency_quantile(&latency, 500), mbed_trace_latency_quantile(&latency, 900),
+                              mbed_trace_latency_quantile(&latency, 990), mbed_trace_latency_quantile(&latency, 999),
+                              latency.max);
+        if (retval < 0 || (size_t)retval >= size - len) {
+            // cut to the buffer
+            return size ? (int)(size - 1) : 0;
+        }
+        len += retval;
+    }
+    return (int)len;
+}
+void mbed_trace_latency_reset(void)
+{
+    mbed_trace_mutex_wait();
+    memset(m_trace.latency, 0, sizeof(m_trace.latency));
+    mbed_trace_mutex_release();
+}
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1 || MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+void mbed_trace_clock_function_set(uint32_t (*clock_f)(void))
+{
+    m_trace.clock_f = clock_f;
+}
+/** Measure a write to the output, start is the clock value before the write. The
+ * line is counted as emitted by mbed_vtracef(), once also when several sinks print it. */
+static void mbed_trace_output_measure(uint8_t dlevel, const char *grp, size_t bytes, uint32_t start)
+{
+    uint32_t time = trace_clock() - start;
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+    mbed_trace_latency_record(TRACE_LATENCY_OUTPUT, time);
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    mbed_trace_stats_t *stats[2];
+    for (int i = mbed_trace_stats_find(dlevel, grp, stats); i-- > 0;) {
+        trace_atomic_add(&stats[i]->bytes, (uint32_t)bytes);
+        trace_atomic_add(&stats[i]->output_time, time);
+    }
+#else
+    (void)dlevel;
+    (void)grp;
+    (void)bytes;
+    (void)time;
+#endif
+}
+#endif
+/** Call the prefix function */
+static const char *mbed_trace_prefix(size_t size)
+{
+    uint32_t start = trace_latency_clock();
+    const char *str = m_trace.prefix_f(size);
+    trace_latency_add(TRACE_LATENCY_PREFIX, start);
+    return str;
+}
+/** Call the suffix function */
+static const char *mbed_trace_suffix(void)
+{
+    uint32_t start = trace_latency_clock();
+    const char *str = m_trace.suffix_f();
+    trace_latency_add(TRACE_LATENCY_PREFIX, start);
+    return str;
+}
+void mbed_trace_ratelimit_set(uint16_t burst, uint32_t interval)
+{
+    mbed_trace_mutex_wait();
+    trace_atomic_store(&m_trace.ratelimit_interval, interval);
+    trace_atomic_store(&m_trace.ratelimit_burst, interval ? burst : 0);
+    mbed_trace_mutex_release();
+}
+bool mbed_trace_ratelimit(mbed_trace_ratelimit_t *rl, uint8_t dlevel, const char *grp)
+{
+    uint32_t suppressed = 0;
+    uint16_t burst = trace_atomic_load(&m_trace.ratelimit_burst);
+    uint32_t interval = trace_atomic_load(&m_trace.ratelimit_interval);
+    bool allow;
+
+    if (burst == 0 || interval == 0 || m_trace.time_f == NULL) {
+        return true;
+    }
+    uint32_t now = m_trace.time_f();
+    uint64_t limit = (uint64_t)burst * interval;
+#if !TRACE_HAVE_ATOMICS
+    mbed_trace_mutex_wait();
+#endif
+    // virtual scheduling: each allowed trace moves rl->next one interval ahead,
+    // a trace is allowed while rl->next is at most burst - 1 intervals ahead of now
+    uint32_t next = trace_atomic_load(&rl->next);
+    for (;;) {
+        uint32_t ahead = next - now;
+        if ((int32_t)ahead < 0 || ahead > limit) {
+            // bucket is full, or the state is stale after a long pause
+            ahead = 0;
+        }
+        allow = ahead + (uint64_t)interval <= limit;
+        if (!allow) {
+            break;
+        }
+#if TRACE_HAVE_ATOMICS
+        if (trace_atomic_cas(&rl->next, &next, now + ahead + interval)) {
+            break;
+        }
+#else
+        rl->next = now + ahead + interval;
+        break;
+#endif
+    }
+#if TRACE_HAVE_ATOMICS
+    if (allow) {
+        suppressed = trace_atomic_load(&rl->suppressed);
+        while (suppressed && !trace_atomic_cas(&rl->suppressed, &suppressed, 0)) {
+        }
+    } else {
+        trace_atomic_add(&rl->suppressed, 1);
+    }
+#else
+    if (allow) {
+        suppressed = rl->suppressed;
+        rl->suppressed = 0;
+    } else {
+        rl->suppressed++;
+    }
+    mbed_trace_mutex_release();
+#endif
+    if (suppressed) {
+        mbed_tracef(dlevel, grp, "%" PRIu32 " messages suppressed", suppressed);
+    }
+    return allow;
+}
+static int8_t mbed_trace_skip(int8_t dlevel, const char *grp)
+{
+    int8_t skip = 0;
+    // filter debug prints only when dlevel is >0 and grp is given
+    if (dlevel >= 0 && grp != 0 && (trace_atomic_load(&m_trace.filters_exclude) || trace_atomic_load(&m_trace.filters_include))) {
+        uint32_t epoch = mbed_trace_filter_read_begin();
+        const trace_filter_t *exclude = trace_atomic_load_sync(&m_trace.filters_exclude);
+        const trace_filter_t *include = trace_atomic_load_sync(&m_trace.filters_include);
+        if (exclude && exclude->count && mbed_trace_filter_match(exclude, grp)) {
+            //grp was in exclude list
+            skip = 1;
+        } else if (include && include->count && !mbed_trace_filter_match(include, grp)) {
+            //grp was not in include list
+            skip = 1;
+        }
+        mbed_trace_filter_read_end(epoch);
+    }
+    return skip;
+}
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1 || MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT == 1 || MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+/** format specifier length modifiers */
+#define TRACE_FMT_LEN_NONE  0
+#define TRACE_FMT_LEN_HH    1
+#define TRACE_FMT_LEN_H     2
+#define TRACE_FMT_LEN_L     3
+#define TRACE_FMT_LEN_LL    4
+#define TRACE_FMT_LEN_J     5
+#define TRACE_FMT_LEN_Z     6
+#define TRACE_FMT_LEN_T     7
+#define TRACE_FMT_LEN_BIG_L 8
+
+/** width or precision given as an argument ('*') */
+#define TRACE_FMT_STAR      -2
+
+/** parsed printf format specifier */
+typedef struct trace_fmt_spec_s {
+    /** flag characters, in the order they appear */
+    char flags[6];
+    /** field width, -1 if not given */
+    int width;
+    /** precision, -1 if not given */
+    int precision;
+    /** length modifier, TRACE_FMT_LEN_* */
+    uint8_t length;
+    /** conversion character */
+    char conv;
+    /** trace helper conversion following 'p': 'H', 'I' (IPv6) or 'P' (IPv6 prefix), 0 if none */
+    char ext;
+} trace_fmt_spec_t;
+
+/** Parse one format specifier, fmt points to the character after '%'.
+ * @return pointer to the character following the specifier */
+static const char *mbed_trace_fmt_parse(const char *fmt, trace_fmt_spec_t *spec)
+{
+    int n = 0;
+    while ((*fmt == '-' || *fmt == '+' || *fmt == ' ' || *fmt == '#' || *fmt == '0') && n < (int)sizeof(spec->flags) - 1) {
+        spec->flags[n++] = *fmt++;
+    }
+    spec->flags[n] = 0;
+    spec->width = -1;
+    if (*fmt == '*') {
+        spec->width = TRACE_FMT_STAR;
+        fmt++;
+    } else {
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++) {
+            spec->width = (spec->width < 0 ? 0 : spec->width * 10) + (*fmt - '0');
+        }
+    }
+    spec->precision = -1;
+    if (*fmt == '.') {
+        fmt++;
+        spec->precision = 0;
+        if (*fmt == '*') {
+            spec->precision = TRACE_FMT_STAR;
+            fmt++;
+        } else {
+            for (; *fmt >= '0' && *fmt <= '9'; fmt++) {
+                spec->precision = spec->precision * 10 + (*fmt - '0');
+            }
+        }
+    }
+    spec->length = TRACE_FMT_LEN_NONE;
+    switch (*fmt) {
+        case 'h':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_H;
+            if (*fmt == 'h') {
+                fmt++;
+                spec->length = TRACE_FMT_LEN_HH;
+            }
+            break;
+        case 'l':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_L;
+            if (*fmt == 'l') {
+                fmt++;
+                spec->length = TRACE_FMT_LEN_LL;
+            }
+            break;
+        case 'j':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_J;
+            break;
+        case 'z':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_Z;
+            break;
+        case 't':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_T;
+            break;
+        case 'L':
+            fmt++;
+            spec->length = TRACE_FMT_LEN_BIG_L;
+            break;
+        default:
+            break;
+    }
+    spec->conv = *fmt;
+    spec->ext = 0;
+    if (*fmt) {
+        fmt++;
+    }
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+    if (spec->conv == 'p') {
+        if (*fmt == 'H') {
+            spec->ext = 'H';
+            fmt++;
+#if MBED_CONF_MBED_TRACE_FEA_IPV6 == 1
+        } else if (fmt[0] == 'I' && fmt[1] == '6') {
+            spec->ext = 'I';
+            fmt += 2;
+        } else if (*fmt == 'P') {
+            spec->ext = 'P';
+            fmt++;
+#endif
+        }
+    }
+#endif
+    return fmt;
+}
+
+#endif
+static const char mbed_trace_hex_lower[] = "0123456789abcdef";
+#if MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT == 1
+/** format flags */
+#define TRACE_FMT_FLAG_MINUS  0x01
+#define TRACE_FMT_FLAG_PLUS   0x02
+#define TRACE_FMT_FLAG_SPACE  0x04
+#define TRACE_FMT_FLAG_ALT    0x08
+#define TRACE_FMT_FLAG_ZERO   0x10
+
+/** two digit decimal lookup table */
+static const char mbed_trace_dec_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+static const char mbed_trace_hex_upper[] = "0123456789ABCDEF";
+
+/** formatter output, counts the full length but writes at most size characters */
+typedef struct trace_fmt_out_s {
+    char *buf;
+    /** room for characters, the terminating nul is not included */
+    size_t size;
+    /** length of the formatted string so far */
+    size_t len;
+} trace_fmt_out_t;
+
+static void mbed_trace_fmt_put(trace_fmt_out_t *out, const char *str, size_t n)
+{
+    if (out->len < out->size) {
+        size_t room = out->size - out->len;
+        memcpy(out->buf + out->len, str, n < room ? n : room);
+    }
+    out->len += n;
+}
+static void mbed_trace_fmt_pad(trace_fmt_out_t *out, char c, int n)
+{
+    if (n <= 0) {
+        return;
+    }
+    if (out->len < out->size) {
+        size_t room = out->size - out->len;
+        memset(out->buf + out->len, c, (size_t)n < room ? (size_t)n : room);
+    }
+    out->len += n;
+}
+/** Write value backwards from end.
+ * @return pointer to the first digit */
+static char *mbed_trace_fmt_utoa(char *end, uintmax_t value, unsigned base, bool upper)
+{
+    char *p = end;
+    if (base == 10) {
+        // keep the common case in native word size, 64-bit division is a library call on small targets
+        while (value > UINT32_MAX) {
+            unsigned idx = (unsigned)(value % 100) * 2;
+            value /= 100;
+            *--p = mbed_trace_dec_pairs[idx + 1];
+            *--p = mbed_trace_dec_pairs[idx];
+        }
+        uint32_t v = (uint32_t)value;
+        while (v >= 100) {
+            unsigned idx = (v % 100) * 2;
+            v /= 100;
+            *--p = mbed_trace_dec_pairs[idx + 1];
+            *--p = mbed_trace_dec_pairs[idx];
+        }
+        if (v >= 10) {
+            *--p = mbed_trace_dec_pairs[v * 2 + 1];
+            *--p = mbed_trace_dec_pairs[v * 2];
+        } else {
+            *--p = (char)('0' + v);
+        }
+    } else {
+        const char *digits = upper ? mbed_trace_hex_upper : mbed_trace_hex_lower;
+        unsigned shift = base == 16 ? 4 : 3;
+        do {
+            *--p = digits[value & (base - 1)];
+            value >>= shift;
+        } while (value);
+    }
+    return p;
+}
+static void mbed_trace_fmt_int(trace_fmt_out_t *out, char conv, unsigned flags, int width, int precision, uintmax_t value, bool negative)
+{
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    char prefix[2];
+    int prefix_len = 0;
+    unsigned base = (conv == 'x' || conv == 'X') ? 16 : (conv == 'o' ? 8 : 10);
+
+    if (precision != 0 || value != 0) {
+        p = mbed_trace_fmt_utoa(end, value, base, conv == 'X');
+    }
+    int len = (int)(end - p);
+    if (conv == 'd' || conv == 'i') {
+        if (negative) {
+            prefix[prefix_len++] = '-';
+        } else if (flags & TRACE_FMT_FLAG_PLUS) {
+            prefix[prefix_len++] = '+';
+        } else if (flags & TRACE_FMT_FLAG_SPACE) {
+            prefix[prefix_len++] = ' ';
+        }
+    } else if (flags & TRACE_FMT_FLAG_ALT) {
+        if (base == 8 && (len == 0 || *p != '0') && precision <= len) {
+            // alternative form of octal starts always with zero
+            precision = len + 1;
+        } else if (base == 16 && value != 0) {
+            prefix[prefix_len++] = '0';
+            prefix[prefix_len++] = conv;
+        }
+    }
+    int zeros = precision > len ? precision - len : 0;
+    int total = prefix_len + zeros + len;
+    if ((flags & (TRACE_FMT_FLAG_ZERO | TRACE_FMT_FLAG_MINUS)) == TRACE_FMT_FLAG_ZERO && precision < 0 && width > total) {
+        zeros += width - total;
+        total = width;
+    }
+    if (!(flags & TRACE_FMT_FLAG_MINUS)) {
+        mbed_trace_fmt_pad(out, ' ', width - total);
+    }
+    mbed_trace_fmt_put(out, prefix, prefix_len);
+    mbed_trace_fmt_pad(out, '0', zeros);
+    mbed_trace_fmt_put(out, p, len);
+    if (flags & TRACE_FMT_FLAG_MINUS) {
+        mbed_trace_fmt_pad(out, ' ', width - total);
+    }
+}
+static void mbed_trace_fmt_str(trace_fmt_out_t *out, unsigned flags, int width, const char *str, size_t len)
+{
+    if (!(flags & TRACE_FMT_FLAG_MINUS)) {
+        mbed_trace_fmt_pad(out, ' ', width - (int)len);
+    }
+    mbed_trace_fmt_put(out, str, len);
+    if (flags & TRACE_FMT_FLAG_MINUS) {
+        mbed_trace_fmt_pad(out, ' ', width - (int)len);
+    }
+}
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+/** Format the data of a trace helper conversion: %*pH hex bytes, %pI6 IPv6 address
+ * or %*pP IPv6 prefix. len is the '*' argument. count bytes of the data are
+ * available; a hex dump of fewer bytes than len ends with '*' as with mbed_trace_array(). */
+static void mbed_trace_fmt_ext(trace_fmt_out_t *out, char ext, int len, const uint8_t *data, int count)
+{
+    switch (ext) {
+        case 'H': {
+            char chunk[3 * 16];
+            if (len <= 0) {
+                break;
+            }
+            if (data == NULL) {
+                mbed_trace_fmt_put(out, "<null>", 6);
+                break;
+            }
+            for (int i = 0; i < count; i += 16) {
+                if (out->len >= out->size) {
+                    // line is full, only count the length
+                    out->len += 3 * (count - i);
+                    break;
+                }
+                int n = count - i < 16 ? count - i : 16;
+                mbed_trace_fmt_put(out, chunk, mbed_trace_hex_encode(chunk, data + i, n) - chunk);
+            }
+            if (count > 0) {
+                // drop the last ':'
+                out->len--;
+            }
+            if (count < len) {
+                mbed_trace_fmt_put(out, "*", 1);
+            }
+            break;
+        }
+#if MBED_CONF_MBED_TRACE_FEA_IPV6 == 1
+        case 'I': {
+            char str[41];
+            if (data == NULL) {
+                mbed_trace_fmt_put(out, "<null>", 6);
+            } else {
+                mbed_trace_fmt_put(out, str, ip6tos(data, str));
+            }
+            break;
+        }
+        case 'P': {
+            char str[45];
+            if ((len != 0 && data == NULL) || len < 0 || len > 128) {
+                mbed_trace_fmt_put(out, "<err>", 5);
+            } else {
+                mbed_trace_fmt_put(out, str, ip6_prefix_tos(data, len, str));
+            }
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+}
+#endif
+/** Format floating point and pointer conversions with the C library, one specifier at a time */
+static int mbed_trace_fmt_libc(trace_fmt_out_t *out, const trace_fmt_spec_t *spec, int width, int precision, va_list *ap)
+{
+    char fmt[sizeof(spec->flags) + 28];
+    char num[12];
+    char *f = fmt;
+    *f++ = '%';
+    for (const char *flag = spec->flags; *flag; flag++) {
+        *f++ = *flag;
+    }
+    if (width >= 0) {
+        char *n = mbed_trace_fmt_utoa(num + sizeof(num), (unsigned)width, 10, false);
+        memcpy(f, n, num + sizeof(num) - n);
+        f += num + sizeof(num) - n;
+    }
+    if (precision >= 0) {
+        *f++ = '.';
+        char *n = mbed_trace_fmt_utoa(num + sizeof(num), (unsigned)precision, 10, false);
+        memcpy(f, n, num + sizeof(num) - n);
+        f += num + sizeof(num) - n;
+    }
+    if (spec->length == TRACE_FMT_LEN_BIG_L) {
+        *f++ = 'L';
+    }
+    *f++ = spec->conv;
+    *f = 0;
+
+    // snprintf writes the nul too, the buffer has room for it after size characters
+    char *dst = out->len < out->size ? out->buf + out->len : NULL;
+    size_t room = dst ? out->size - out->len + 1 : 0;
+    int retval;
+    if (spec->conv == 'p') {
+        retval = snprintf(dst, room, fmt, va_arg(*ap, void *));
+    } else if (spec->length == TRACE_FMT_LEN_BIG_L) {
+        retval = snprintf(dst, room, fmt, va_arg(*ap, long double));
+    } else {
+        retval = snprintf(dst, room, fmt, va_arg(*ap, double));
+    }
+    if (retval < 0) {
+        return -1;
+    }
+    out->len += retval;
+    return 0;
+}
+/** Format one conversion.
+ * @return 0 on success, -1 when the specifier is left to the C library */
+static int mbed_trace_fmt_spec(trace_fmt_out_t *out, const trace_fmt_spec_t *spec, va_list *ap)
+{
+    unsigned flags = 0;
+    for (const char *flag = spec->flags; *flag; flag++) {
+        switch (*flag) {
+            case '-':
+                flags |= TRACE_FMT_FLAG_MINUS;
+                break;
+            case '+':
+                flags |= TRACE_FMT_FLAG_PLUS;
+                break;
+            case ' ':
+                flags |= TRACE_FMT_FLAG_SPACE;
+                break;
+            case '#':
+                flags |= TRACE_FMT_FLAG_ALT;
+                break;
+            default:
+                flags |= TRACE_FMT_FLAG_ZERO;
+                break;
+        }
+    }
+    if (spec->conv == '%') {
+        mbed_trace_fmt_put(out, "%", 1);
+        return 0;
+    }
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+    if (spec->ext) {
+        // expanded here, only when the trace is printed
+        int len = spec->width == TRACE_FMT_STAR ? va_arg(*ap, int) : spec->width;
+        const uint8_t *data = va_arg(*ap, const uint8_t *);
+        mbed_trace_fmt_ext(out, spec->ext, len, data, len);
+        return 0;
+    }
+#endif
+    if (!spec->conv || !strchr("diouxXcsfFeEgGaAp", spec->conv) ||
+            (spec->length != TRACE_FMT_LEN_NONE && (spec->conv == 'c' || spec->conv == 's' || spec->conv == 'p')) ||
+            (spec->length == TRACE_FMT_LEN_BIG_L && strchr("diouxX", spec->conv))) {
+        // %n, wide characters, positional arguments and other rarities
+        return -1;
+    }
+    int width = spec->width;
+    if (width == TRACE_FMT_STAR) {
+        width = va_arg(*ap, int);
+        if (width < 0) {
+            flags |= TRACE_FMT_FLAG_MINUS;
+            width = -width;
+        }
+    }
+    int precision = spec->precision;
+    if (precision == TRACE_FMT_STAR) {
+        precision = va_arg(*ap, int);
+        if (precision < 0) {
+            precision = -1;
+        }
+    }
+    switch (spec->conv) {
+        case 'd':
+        case 'i': {
+            intmax_t value;
+            switch (spec->length) {
+                case TRACE_FMT_LEN_HH:
+                    value = (signed char)va_arg(*ap, int);
+                    break;
+                case TRACE_FMT_LEN_H:
+                    value = (short)va_arg(*ap, int);
+                    break;
+                case TRACE_FMT_LEN_L:
+                    value = va_arg(*ap, long);
+                    break;
+                case TRACE_FMT_LEN_LL:
+                    value = va_arg(*ap, long long);
+                    break;
+                case TRACE_FMT_LEN_J:
+                    value = va_arg(*ap, intmax_t);
+                    break;
+                case TRACE_FMT_LEN_Z:
+                case TRACE_FMT_LEN_T:
+                    value = va_arg(*ap, ptrdiff_t);
+                    break;
+                default:
+                    value = va_arg(*ap, int);
+                    break;
+            }
+            uintmax_t magnitude = value < 0 ? (uintmax_t)0 - (uintmax_t)value : (uintmax_t)value;
+            mbed_trace_fmt_int(out, spec->conv, flags, width, precision, magnitude, value < 0);
+            return 0;
+        }
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X': {
+            uintmax_t value;
+            switch (spec->length) {
+                case TRACE_FMT_LEN_HH:
+                    value = (unsigned char)va_arg(*ap, unsigned int);
+                    break;
+                case TRACE_FMT_LEN_H:
+                    value = (unsigned short)va_arg(*ap, unsigned int);
+                    break;
+                case TRACE_FMT_LEN_L:
+                    value = va_arg(*ap, unsigned long);
+                    break;
+                case TRACE_FMT_LEN_LL:
+                    value = va_arg(*ap, unsigned long long);
+                    break;
+                case TRACE_FMT_LEN_J:
+                    value = va_arg(*ap, uintmax_t);
+                    break;
+                case TRACE_FMT_LEN_Z:
+                case TRACE_FMT_LEN_T:
+                    value = va_arg(*ap, size_t);
+                    break;
+                default:
+                    value = va_arg(*ap, unsigned int);
+                    break;
+            }
+            mbed_trace_fmt_int(out, spec->conv, flags, width, precision, value, false);
+            return 0;
+        }
+        case 'c': {
+            char c = (char)va_arg(*ap, int);
+            mbed_trace_fmt_str(out, flags, width, &c, 1);
+            return 0;
+        }
+        case 's': {
+            const char *str = va_arg(*ap, const char *);
+            size_t len;
+            if (!str) {
+                // same as glibc, which prints nothing when the precision is too short for "(null)"
+                str = (precision < 0 || precision >= 6) ? "(null)" : "";
+            }
+            if (precision >= 0) {
+                const char *nul = memchr(str, 0, precision);
+                len = nul ? (size_t)(nul - str) : (size_t)precision;
+            } else {
+                len = strlen(str);
+            }
+            mbed_trace_fmt_str(out, flags, width, str, len);
+            return 0;
+        }
+        default:
+            return mbed_trace_fmt_libc(out, spec, width, precision, ap);
+    }
+}
+/** Format a whole string with the C library, for conversions the formatter leaves to it.
+ * The C library does not know the helper conversions and would print their arguments
+ * as plain pointers, so a format string with them is printed as such instead. */
+static int mbed_trace_fmt_fallback(char *buf, size_t size, const char *fmt, va_list ap)
+{
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+    trace_fmt_spec_t spec;
+    for (const char *p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+        p = mbed_trace_fmt_parse(p + 1, &spec);
+        if (spec.ext) {
+            return snprintf(buf, size, "%s", fmt);
+        }
+    }
+#endif
+    return vsnprintf(buf, size, fmt, ap);
+}
+/** vsnprintf() replacement for the trace path.
+ * Integers, characters and strings are formatted here in a single pass,
+ * floating point and %p per specifier with the C library and anything
+ * else by handing the whole format string to vsnprintf(). */
+static int mbed_trace_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap)
+{
+    trace_fmt_out_t out = {
+        .buf = buf,
+        .size = size ? size - 1 : 0,
+        .len = 0
+    };
+    trace_fmt_spec_t spec;
+    const char *p = fmt;
+    va_list args;
+    va_copy(args, ap);
+    for (;;) {
+        // literal runs between conversions are short, scan and copy them in one go
+        const char *pct = p;
+        while (*pct && *pct != '%') {
+            pct++;
+        }
+        if (pct != p) {
+            mbed_trace_fmt_put(&out, p, pct - p);
+        }
+        if (!*pct) {
+            break;
+        }
+        // fast path for the plain conversions most traces consist of
+        switch (pct[1]) {
+            case 's': {
+                const char *str = va_arg(args, const char *);
+                if (!str) {
+                    str = "(null)";
+                }
+                mbed_trace_fmt_put(&out, str, strlen(str));
+                p = pct + 2;
+                continue;
+            }
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X': {
+                char digits[12];
+                char *end = digits + sizeof(digits);
+                char *start;
+                if (pct[1] == 'x' || pct[1] == 'X') {
+                    start = mbed_trace_fmt_utoa(end, va_arg(args, unsigned int), 16, pct[1] == 'X');
+                } else if (pct[1] == 'u') {
+                    start = mbed_trace_fmt_utoa(end, va_arg(args, unsigned int), 10, false);
+                } else {
+                    int value = va_arg(args, int);
+                    start = mbed_trace_fmt_utoa(end, value < 0 ? 0u - (unsigned int)value : (unsigned int)value, 10, false);
+                    if (value < 0) {
+                        *--start = '-';
+                    }
+                }
+                mbed_trace_fmt_put(&out, start, end - start);
+                p = pct + 2;
+                continue;
+            }
+            default:
+                break;
+        }
+        p = mbed_trace_fmt_parse(pct + 1, &spec);
+        if (mbed_trace_fmt_spec(&out, &spec, &args) != 0) {
+            // ap itself is still untouched, let the C library do the whole string
+            va_end(args);
+            return mbed_trace_fmt_fallback(buf, size, fmt, ap);
+        }
+    }
+    va_end(args);
+    if (size) {
+        buf[out.len < out.size ? out.len : out.size] = 0;
+    }
+    return (int)out.len;
+}
+static int mbed_trace_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int retval = mbed_trace_vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return retval;
+}
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1 || MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+static bool mbed_trace_token_put(uint8_t **wptr, const uint8_t *end, const void *data, size_t len)
+{
+    if ((size_t)(end - *wptr) < len) {
+        return false;
+    }
+    memcpy(*wptr, data, len);
+    *wptr += len;
+    return true;
+}
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+/** Anchor string, its runtime address in the stream header lets the decoder
+ * relocate format string addresses of position independent executables. */
+static const char mbed_trace_token_anchor[] = "mbed-trace-token-anchor";
+
+static void mbed_trace_token_header(void)
+{
+    uint8_t record[TRACE_TOKEN_HEADER_LEN];
+    uint16_t length = TRACE_TOKEN_HEADER_LEN;
+    uintptr_t anchor = (uintptr_t)mbed_trace_token_anchor;
+    uint16_t endian = 1;
+
+    memcpy(&record[0], &length, sizeof(length));
+    record[2] = TRACE_TOKEN_TYPE_HEADER;
+    record[3] = TRACE_TOKEN_VERSION;
+    record[4] = *(uint8_t *)&endian; // 1 for little endian
+    record[5] = sizeof(long);
+    record[6] = sizeof(size_t);
+    record[7] = sizeof(void *);
+    record[8] = m_trace.trace_config;
+    memset(&record[9], 0, sizeof(record) - 9);
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+    record[9] = TRACE_TOKEN_FLAG_FORMAT_EXT;
+#endif
+    memcpy(&record[16], &anchor, sizeof(anchor));
+    m_trace.token_f(record, sizeof(record));
+}
+#endif
+/** Encode one trace as a binary record: format string and group addresses,
+ * timestamp and raw argument values. String arguments are copied. */
+static int mbed_trace_token_encode(uint8_t *buf, int length, uint8_t dlevel, const char *grp, const char *fmt, va_list ap)
+{
+    uint8_t *wptr = buf + 4;
+    const uint8_t *end = buf + length;
+    uint32_t timestamp = m_trace.time_f ? m_trace.time_f() : 0;
+    uintptr_t addr;
+    trace_fmt_spec_t spec;
+    bool ok = true;
+
+    if (length < 4) {
+        return 0;
+    }
+    buf[2] = TRACE_TOKEN_TYPE_TRACE;
+    buf[3] = dlevel;
+    ok = mbed_trace_token_put(&wptr, end, &timestamp, sizeof(timestamp));
+    addr = (uintptr_t)fmt;
+    ok = ok && mbed_trace_token_put(&wptr, end, &addr, sizeof(addr));
+    addr = (uintptr_t)grp;
+    ok = ok && mbed_trace_token_put(&wptr, end, &addr, sizeof(addr));
+
+    while (ok && (fmt = strchr(fmt, '%')) != NULL) {
+        fmt = mbed_trace_fmt_parse(fmt + 1, &spec);
+        int32_t width = spec.width;
+        if (spec.width == TRACE_FMT_STAR) {
+            width = va_arg(ap, int);
+            ok = mbed_trace_token_put(&wptr, end, &width, sizeof(width));
+        }
+        if (spec.precision == TRACE_FMT_STAR) {
+            int32_t val = va_arg(ap, int);
+            ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+        }
+        switch (spec.conv) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                if (spec.length == TRACE_FMT_LEN_L) {
+                    long val = va_arg(ap, long);
+                    ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+                } else if (spec.length == TRACE_FMT_LEN_LL || spec.length == TRACE_FMT_LEN_J) {
+                    int64_t val = va_arg(ap, long long);
+                    ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+                } else if (spec.length == TRACE_FMT_LEN_Z || spec.length == TRACE_FMT_LEN_T) {
+                    size_t val = va_arg(ap, size_t);
+                    ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+                } else {
+                    int32_t val = va_arg(ap, int);
+                    ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+                }
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double val;
+                if (spec.length == TRACE_FMT_LEN_BIG_L) {
+                    val = (double)va_arg(ap, long double);
+                } else {
+                    val = va_arg(ap, double);
+                }
+                ok = ok && mbed_trace_token_put(&wptr, end, &val, sizeof(val));
+                break;
+            }
+            case 'p': {
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+                if (spec.ext) {
+                    // the data is copied, as a byte count and the bytes
+                    const uint8_t *data = va_arg(ap, const uint8_t *);
+                    size_t count = 0;
+                    if (data && spec.ext == 'H' && width > 0) {
+                        count = (size_t)width < 255 ? (size_t)width : 255;
+                        if (count > (size_t)(end - wptr) - 1 && wptr < end) {
+                            // a part of the dump is better than none
+                            count = end - wptr - 1;
+                        }
+                        ok = ok && count > 0;
+                    } else if (data && spec.ext == 'I') {
+                        count = 16;
+                    } else if (data && spec.ext == 'P' && width > 0 && width <= 128) {
+                        count = (width + 7) / 8;
+                    }
+                    uint8_t count8 = count;
+                    ok = ok && mbed_trace_token_put(&wptr, end, &count8, 1);
+                    ok = ok && mbed_trace_token_put(&wptr, end, data, count);
+                    break;
+                }
+#endif
+                addr = (uintptr_t)va_arg(ap, void *);
+                ok = ok && mbed_trace_token_put(&wptr, end, &addr, sizeof(addr));
+                break;
+            }
+            case 's': {
+                const char *str = va_arg(ap, const char *);
+                size_t len;
+                if (str == NULL) {
+                    str = "(null)";
+                }
+                len = strlen(str);
+                if (spec.precision >= 0 && (size_t)spec.precision < len) {
+                    len = spec.precision;
+                }
+                if (len > 255) {
+                    len = 255;
+                }
+                uint8_t len8 = len;
+                ok = ok && mbed_trace_token_put(&wptr, end, &len8, 1);
+                ok = ok && mbed_trace_token_put(&wptr, end, str, len);
+                break;
+            }
+            case 'n':
+                (void)va_arg(ap, void *);
+                break;
+            default:
+                // "%%" or unknown conversion, no argument
+                break;
+        }
+    }
+    if (!ok) {
+        // arguments did not fit, decoder shows the rest as missing
+        buf[2] |= TRACE_TOKEN_TRUNCATED;
+    }
+    uint16_t len16 = wptr - buf;
+    memcpy(buf, &len16, sizeof(len16));
+    return len16;
+}
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+static bool mbed_trace_token_get(const uint8_t **rptr, const uint8_t *end, void *data, size_t len)
+{
+    if ((size_t)(end - *rptr) < len) {
+        return false;
+    }
+    memcpy(data, *rptr, len);
+    *rptr += len;
+    return true;
+}
+static void mbed_trace_history_put(char *buf, size_t size, size_t *pos, const char *str, size_t len)
+{
+    if (len > size - 1 - *pos) {
+        len = size - 1 - *pos;
+    }
+    memcpy(buf + *pos, str, len);
+    *pos += len;
+    buf[*pos] = 0;
+}
+/** Format the text of a stored record. Conversions whose arguments did not fit
+ * to the record are left out, as is the rest of the line after them. */
+static void mbed_trace_history_render(char *buf, size_t size, const uint8_t *record)
+{
+    const uint8_t *rptr = record + 8;
+    const uint8_t *end;
+    const char *fmt, *start;
+    trace_fmt_spec_t spec;
+    uint16_t length;
+    uintptr_t addr;
+    size_t pos = 0;
+    char conv[32];
+
+    buf[0] = 0;
+    memcpy(&length, record, sizeof(length));
+    end = record + length;
+    if (!mbed_trace_token_get(&rptr, end, &addr, sizeof(addr))) {
+        return;
+    }
+    fmt = (const char *)addr;
+    // group address, printed in the tag
+    rptr += sizeof(uintptr_t);
+
+    while ((start = strchr(fmt, '%')) != NULL && pos < size - 1) {
+        bool ok = true;
+        size_t n = 0;
+        int retval = 0;
+
+        mbed_trace_history_put(buf, size, &pos, fmt, start - fmt);
+        fmt = mbed_trace_fmt_parse(start + 1, &spec);
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+        int32_t width = spec.width;
+#endif
+        // single conversion format, '*' replaced with the stored width or precision
+        for (const char *c = start; c < fmt && ok; c++) {
+            if (n > sizeof(conv) - 12) {
+                ok = false;
+            } else if (*c == '*') {
+                int32_t val;
+                ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+                if (c[-1] != '.') {
+                    width = val;
+                }
+#endif
+                n += snprintf(conv + n, sizeof(conv) - n, "%d", (int)val);
+            } else {
+                conv[n++] = *c;
+            }
+        }
+        conv[n] = 0;
+        if (!ok) {
+            break;
+        }
+        switch (spec.conv) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                if (spec.length == TRACE_FMT_LEN_L) {
+                    long val;
+                    ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+                    retval = snprintf(buf + pos, size - pos, conv, val);
+                } else if (spec.length == TRACE_FMT_LEN_LL || spec.length == TRACE_FMT_LEN_J) {
+                    int64_t val;
+                    ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+                    if (spec.length == TRACE_FMT_LEN_J) {
+                        retval = snprintf(buf + pos, size - pos, conv, (intmax_t)val);
+                    } else {
+                        retval = snprintf(buf + pos, size - pos, conv, (long long)val);
+                    }
+                } else if (spec.length == TRACE_FMT_LEN_Z || spec.length == TRACE_FMT_LEN_T) {
+                    size_t val;
+                    ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+                    retval = snprintf(buf + pos, size - pos, conv, val);
+                } else {
+                    int32_t val;
+                    ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+                    retval = snprintf(buf + pos, size - pos, conv, (int)val);
+                }
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A': {
+                double val;
+                ok = mbed_trace_token_get(&rptr, end, &val, sizeof(val));
+                if (spec.length == TRACE_FMT_LEN_BIG_L) {
+                    retval = snprintf(buf + pos, size - pos, conv, (long double)val);
+                } else {
+                    retval = snprintf(buf + pos, size - pos, conv, val);
+                }
+                break;
+            }
+            case 'p':
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+                if (spec.ext) {
+                    uint8_t data[255];
+                    uint8_t count = 0;
+                    trace_fmt_out_t out = {
+                        .buf = buf + pos,
+                        .size = size - 1 - pos,
+                        .len = 0
+                    };
+                    ok = mbed_trace_token_get(&rptr, end, &count, 1);
+                    ok = ok && mbed_trace_token_get(&rptr, end, data, count);
+                    if (ok) {
+                        // a zero length prefix has no data bytes
+                        mbed_trace_fmt_ext(&out, spec.ext, width, count || (spec.ext == 'P' && width == 0) ? data : NULL, count);
+                        buf[pos + (out.len < out.size ? out.len : out.size)] = 0;
+                        retval = out.len;
+                    }
+                    break;
+                }
+#endif
+                ok = mbed_trace_token_get(&rptr, end, &addr, sizeof(addr));
+                retval = snprintf(buf + pos, size - pos, conv, (void *)addr);
+                break;
+            case 's': {
+                char str[256];
+                uint8_t len8 = 0;
+                ok = mbed_trace_token_get(&rptr, end, &len8, 1);
+                ok = ok && mbed_trace_token_get(&rptr, end, str, len8);
+                str[len8] = 0;
+                retval = snprintf(buf + pos, size - pos, conv, str);
+                break;
+            }
+            case 'n':
+                break;
+            case '%':
+                mbed_trace_history_put(buf, size, &pos, "%", 1);
+                break;
+            default:
+                mbed_trace_history_put(buf, size, &pos, start, fmt - start);
+                break;
+        }
+        if (!ok) {
+            // truncated record, drop what was formatted from the missing value
+            buf[pos] = 0;
+            return;
+        }
+        if (retval > 0) {
+            pos += (size_t)retval < size - pos ? (size_t)retval : size - 1 - pos;
+        }
+    }
+    mbed_trace_history_put(buf, size, &pos, fmt, strlen(fmt));
+}
+/** Store a trace as an unformatted record, the oldest record is overwritten when the ring is full */
+static void mbed_trace_history_push(uint8_t dlevel, const char *grp, const char *fmt, va_list ap)
+{
+    trace_output_lock();
+    uint32_t index = (uint32_t)m_trace.history_head + m_trace.history_count;
+    if (index >= m_trace.history_depth) {
+        index -= m_trace.history_depth;
+    }
+    if (m_trace.history_count < m_trace.history_depth) {
+        m_trace.history_count++;
+    } else if (++m_trace.history_head == m_trace.history_depth) {
+        m_trace.history_head = 0;
+    }
+    mbed_trace_token_encode(m_trace.history + index * DEFAULT_TRACE_HISTORY_RECORD_LEN,
+                            DEFAULT_TRACE_HISTORY_RECORD_LEN, dlevel, grp, fmt, ap);
+    trace_output_unlock();
+}
+/** Print out the stored records, oldest first, and empty the ring.
+ * Called with the line buffer held. */
+static void mbed_trace_history_replay(void)
+{
+    char *text = (char *)m_trace.history + (size_t)m_trace.history_depth * DEFAULT_TRACE_HISTORY_RECORD_LEN;
+
+    trace_output_lock();
+    mbed_trace_coalesce_end();
+    while (m_trace.history_count) {
+        const uint8_t *record = m_trace.history + (size_t)m_trace.history_head * DEFAULT_TRACE_HISTORY_RECORD_LEN;
+        uint8_t dlevel = record[3];
+        uintptr_t grp;
+
+        if (++m_trace.history_head == m_trace.history_depth) {
+            m_trace.history_head = 0;
+        }
+        m_trace.history_count--;
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+        if (m_trace.token_f) {
+            // records are in the tokenized format already
+            uint16_t length;
+            memcpy(&length, record, sizeof(length));
+            m_trace.token_f(record, length);
+            continue;
+        }
+#endif
+        memcpy(&grp, record + 8 + sizeof(uintptr_t), sizeof(grp));
+        mbed_trace_history_render(text, m_trace.history_text_length, record);
+        char *line = trace_line();
+        size_t len = mbed_trace_format(line, m_trace.line_length, dlevel, (const char *)grp, "%s", text);
+        mbed_trace_emit(dlevel, line, len);
+    }
+    trace_output_unlock();
+}
+int mbed_trace_history_enable(uint16_t depth)
+{
+    int text_length = m_trace.line_length + 1;
+    uint8_t *history = 0;
+
+    if (depth) {
+        // records followed by a buffer for formatting one record
+        history = trace_mem_alloc(m_trace_static_history, (size_t)depth * DEFAULT_TRACE_HISTORY_RECORD_LEN + text_length);
+        if (history == NULL) {
+            return -1;
+        }
+    }
+    mbed_trace_mutex_wait();
+    trace_mem_free(m_trace_static_history, m_trace.history);
+    m_trace.history = history;
+    m_trace.history_depth = depth;
+    m_trace.history_head = 0;
+    m_trace.history_count = 0;
+    m_trace.history_text_length = text_length;
+    mbed_trace_active_levels_update();
+    mbed_trace_mutex_release();
+    return 0;
+}
+void mbed_trace_history_levels_set(uint8_t history_levels, uint8_t trigger_levels)
+{
+    mbed_trace_mutex_wait();
+    m_trace.history_levels = history_levels & ~TRACE_LEVEL_CMD;
+    m_trace.history_trigger_levels = trigger_levels;
+    mbed_trace_active_levels_update();
+    mbed_trace_mutex_release();
+}
+void mbed_trace_history_dump(void)
+{
+    trace_line_lock();
+    if (trace_initialized() && m_trace.history) {
+        mbed_trace_history_replay();
+    }
+    trace_line_unlock();
+}
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+void mbed_trace_token_function_set(void (*token_f)(const uint8_t *, size_t))
+{
+    m_trace.token_f = token_f;
+    if (token_f) {
+        // let the decoder know the data layout before first record
+        mbed_trace_token_header();
+    }
+}
+#endif
+static void mbed_trace_default_printn(const char *str, size_t len)
+{
+    fwrite(str, 1, len, stdout);
+}
+/** Call the print functions for a formatted line of len characters.
+ * The buffer has room for a line feed after the line. */
+static void mbed_trace_print_line(uint8_t dlevel, char *line, size_t len)
+{
+    if (dlevel == TRACE_LEVEL_CMD && m_trace.cmd_printn) {
+        line[len] = '\n';
+        line[len + 1] = 0;
+        m_trace.cmd_printn(line, len + 1);
+    } else if (dlevel == TRACE_LEVEL_CMD && m_trace.cmd_printf) {
+        m_trace.cmd_printf(line);
+        m_trace.cmd_printf("\n");
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+    } else if (m_trace.batch_buffer) {
+        line[len] = '\n';
+        mbed_trace_batch_write(dlevel, line, len + 1);
+        line[len] = 0;
+#endif
+    } else if (m_trace.printv) {
+        mbed_trace_iovec_t iov[2] = {
+            { .iov_base = line, .iov_len = len },
+            { .iov_base = "\n", .iov_len = 1 }
+        };
+        m_trace.printv(iov, 2);
+    } else if (m_trace.printn) {
+        line[len] = '\n';
+        line[len + 1] = 0;
+        m_trace.printn(line, len + 1);
+    } else if (m_trace.printf) {
+        //print out whole data
+        m_trace.printf(line);
+    }
+}
+/** Check if there is somewhere to print to */
+static bool mbed_trace_has_output(void)
+{
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+    if (m_trace.batch_buffer) {
+        return true;
+    }
+#endif
+    return m_trace.printf || m_trace.printn || m_trace.printv;
+}
+/** Hand a formatted line over to the async queue or the print functions, called with the output lock held */
+static void mbed_trace_emit(uint8_t dlevel, char *line, size_t len)
+{
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    if (m_trace.async_queue) {
+        mbed_trace_async_push(dlevel, line, len);
+        return;
+    }
+#endif
+    mbed_trace_print_line(dlevel, line, len);
+}
+/** Hand a formatted line over to the print functions, or to the async queue */
+static void mbed_trace_output(uint8_t dlevel, char *line, size_t len)
+{
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    if (m_trace.async_queue) {
+        mbed_trace_async_push(dlevel, line, len);
+        return;
+    }
+#endif
+    trace_output_lock();
+    mbed_trace_print_line(dlevel, line, len);
+    trace_output_unlock();
+}
+void mbed_tracef(uint8_t dlevel, const char *grp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    mbed_vtracef(dlevel, grp, fmt, ap);
+    va_end(ap);
+}
+/** Write "[LEVL][grp ]: " tag, return value as with snprintf() */
+static int mbed_trace_tag(char *buf, size_t size, uint8_t dlevel, const char *grp)
+{
+    const char *level;
+    switch (dlevel) {
+        case (TRACE_LEVEL_ERROR):
+            level = "[ERR ][";
+            break;
+        case (TRACE_LEVEL_WARN):
+            level = "[WARN][";
+            break;
+        case (TRACE_LEVEL_INFO):
+            level = "[INFO][";
+            break;
+        case (TRACE_LEVEL_DEBUG):
+            level = "[DBG ][";
+            break;
+        default:
+            return mbed_trace_snprintf(buf, size, "              ");
+    }
+#if MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT == 1
+    trace_fmt_out_t out = {
+        .buf = buf,
+        .size = size ? size - 1 : 0,
+        .len = 0
+    };
+    size_t len = strlen(grp);
+    mbed_trace_fmt_put(&out, level, 7);
+    mbed_trace_fmt_put(&out, grp, len);
+    mbed_trace_fmt_pad(&out, ' ', 4 - (int)len);
+    mbed_trace_fmt_put(&out, "]: ", 3);
+    if (size) {
+        buf[out.len < out.size ? out.len : out.size] = 0;
+    }
+    return (int)out.len;
+#else
+    return snprintf(buf, size, "%s%-4s]: ", level, grp);
+#endif
+}
+/** Append a segment, consecutive pieces of the same buffer are merged */
+static int mbed_trace_iov_add(mbed_trace_iovec_t *iov, int n, const void *base, size_t len)
+{
+    if (len == 0) {
+        return n;
+    }
+    if (n > 0 && (const char *)iov[n - 1].iov_base + iov[n - 1].iov_len == (const char *)base) {
+        iov[n - 1].iov_len += len;
+        return n;
+    }
+    iov[n].iov_base = base;
+    iov[n].iov_len = len;
+    return n + 1;
+}
+/** Split a trace body to at most count segments. Literal parts of the format string
+ * and string arguments are referenced in place, other conversions are formatted
+ * to the scratch buffer.
+ * @return number of segments */
+static int mbed_trace_body_iov(mbed_trace_iovec_t *iov, int count, char *scratch, size_t scratch_len,
+                               const char *fmt, va_list ap, size_t *body_len)
+{
+    int n = 0;
+#if MBED_CONF_MBED_TRACE_FEA_FAST_FORMAT == 1
+    trace_fmt_out_t out = {
+        .buf = scratch,
+        .size = scratch_len - 1,
+        .len = 0
+    };
+    trace_fmt_spec_t spec;
+    const char *p = fmt;
+    va_list args;
+    va_copy(args, ap);
+    *body_len = 0;
+    while (*p) {
+        size_t start = out.len < out.size ? out.len : out.size;
+        if (n == count - 1) {
+            // out of segments, the rest goes to the scratch buffer in one piece
+            int retval = mbed_trace_vsnprintf(scratch + start, scratch_len - start, p, args);
+            if (retval > 0) {
+                *body_len += retval;
+                n = mbed_trace_iov_add(iov, n, scratch + start, strlen(scratch + start));
+            }
+            break;
+        }
+        const char *pct = p;
+        while (*pct && *pct != '%') {
+            pct++;
+        }
+        if (pct != p) {
+            n = mbed_trace_iov_add(iov, n, p, pct - p);
+            *body_len += pct - p;
+            p = pct;
+            continue;
+        }
+        p = mbed_trace_fmt_parse(pct + 1, &spec);
+        if (spec.conv == 's' && !spec.flags[0] && spec.width < 0 && spec.precision < 0 && spec.length == TRACE_FMT_LEN_NONE) {
+            const char *str = va_arg(args, const char *);
+            if (!str) {
+                str = "(null)";
+            }
+            size_t len = strlen(str);
+            n = mbed_trace_iov_add(iov, n, str, len);
+            *body_len += len;
+            continue;
+        }
+        if (mbed_trace_fmt_spec(&out, &spec, &args) != 0) {
+            // left to the C library, format the whole body to the scratch buffer instead
+            va_end(args);
+            int retval = mbed_trace_fmt_fallback(scratch, scratch_len, fmt, ap);
+            *body_len = retval > 0 ? retval : 0;
+            return mbed_trace_iov_add(iov, 0, scratch, strlen(scratch));
+        }
+        n = mbed_trace_iov_add(iov, n, scratch + start, (out.len < out.size ? out.len : out.size) - start);
+        *body_len += out.len - start;
+    }
+    va_end(args);
+#else
+    (void)count;
+    int retval = vsnprintf(scratch, scratch_len, fmt, ap);
+    *body_len = retval > 0 ? retval : 0;
+    n = mbed_trace_iov_add(iov, n, scratch, strlen(scratch));
+#endif
+    return n;
+}
+/** Put the segments together to the line buffer for mbed_trace_last(), after the print
+ * function is done with them. The formatted segments are in the line buffer in order,
+ * each one at or before its place in the line, so the line is built from the end. */
+static void mbed_trace_iov_assemble(const mbed_trace_iovec_t *iov, int count)
+{
+    char *line = trace_line();
+    size_t pos = 0, end;
+
+    for (int i = 0; i < count; i++) {
+        pos += iov[i].iov_len;
+    }
+    end = pos < (size_t)m_trace.line_length - 1 ? pos : (size_t)m_trace.line_length - 1;
+    for (int i = count - 1; i >= 0; i--) {
+        pos -= iov[i].iov_len;
+        if (pos < end) {
+            memmove(line + pos, iov[i].iov_base, pos + iov[i].iov_len < end ? iov[i].iov_len : end - pos);
+        }
+    }
+    line[end] = 0;
+}
+/** Give a trace line to the scatter-gather print function */
+static void mbed_trace_vprintv(uint8_t dlevel, const char *grp, const char *fmt, va_list ap)
+{
+    mbed_trace_iovec_t iov[DEFAULT_TRACE_IOV_COUNT];
+    int n = 0, prefix = -1;
+    const char *color = NULL;
+    size_t body_len;
+    bool decorate = (m_trace.trace_config & TRACE_MODE_PLAIN) == 0 && dlevel != TRACE_LEVEL_CMD;
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    char stamp[TRACE_TIMESTAMP_LEN];
+#endif
+
+    if (decorate) {
+        if (m_trace.trace_config & TRACE_MODE_COLOR) {
+            if (m_trace.trace_config & TRACE_CARRIAGE_RETURN) {
+                n = mbed_trace_iov_add(iov, n, "\r\x1b[2K", 5);
+            }
+            switch (dlevel) {
+                case (TRACE_LEVEL_ERROR):
+                    color = VT100_COLOR_ERROR;
+                    break;
+                case (TRACE_LEVEL_WARN):
+                    color = VT100_COLOR_WARN;
+                    break;
+                case (TRACE_LEVEL_INFO):
+                    color = VT100_COLOR_INFO;
+                    break;
+                case (TRACE_LEVEL_DEBUG):
+                    color = VT100_COLOR_DEBUG;
+                    break;
+                default:
+                    break;
+            }
+            if (color) {
+                n = mbed_trace_iov_add(iov, n, color, strlen(color));
+            }
+        }
+        if (m_trace.prefix_f) {
+            // filled in when the body length is known
+            prefix = n++;
+            iov[prefix].iov_base = NULL;
+            iov[prefix].iov_len = 0;
+        }
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+        if (m_trace.timestamp) {
+            n = mbed_trace_iov_add(iov, n, stamp, mbed_trace_timestamp(stamp, sizeof(stamp)));
+        }
+#endif
+        const char *level = NULL;
+        switch (dlevel) {
+            case (TRACE_LEVEL_ERROR):
+                level = "[ERR ][";
+                break;
+            case (TRACE_LEVEL_WARN):
+                level = "[WARN][";
+                break;
+            case (TRACE_LEVEL_INFO):
+                level = "[INFO][";
+                break;
+            case (TRACE_LEVEL_DEBUG):
+                level = "[DBG ][";
+                break;
+            default:
+                n = mbed_trace_iov_add(iov, n, "              ", 14);
+                break;
+        }
+        if (level) {
+            size_t len = strlen(grp);
+            n = mbed_trace_iov_add(iov, n, level, 7);
+            n = mbed_trace_iov_add(iov, n, grp, len);
+            if (len < 4) {
+                n = mbed_trace_iov_add(iov, n, "    ", 4 - len);
+            }
+            n = mbed_trace_iov_add(iov, n, "]: ", 3);
+        }
+    }
+    // leave room for the suffix, color reset and newline
+    n += mbed_trace_body_iov(iov + n, DEFAULT_TRACE_IOV_COUNT - n - 3, trace_line(), m_trace.line_length, fmt, ap, &body_len);
+    if (decorate) {
+        if (prefix >= 0) {
+            const char *str = mbed_trace_prefix(body_len + (color ? strlen(color) + 4 : 0));
+            iov[prefix].iov_base = str;
+            iov[prefix].iov_len = str ? strlen(str) : 0;
+        }
+        if (m_trace.suffix_f) {
+            const char *str = mbed_trace_suffix();
+            n = mbed_trace_iov_add(iov, n, str, str ? strlen(str) : 0);
+        }
+        if (color) {
+            n = mbed_trace_iov_add(iov, n, "\x1b[0m", 4);
+        }
+    }
+    n = mbed_trace_iov_add(iov, n, "\n", 1);
+    uint32_t start = trace_clock();
+    trace_output_lock();
+    m_trace.printv(iov, n);
+    trace_output_unlock();
+    mbed_trace_iov_assemble(iov, n - 1);
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        bytes += iov[i].iov_len;
+    }
+    trace_output_measure(dlevel, grp, bytes, start);
+#else
+    trace_output_measure(dlevel, grp, 0, start);
+#endif
+}
+/** FNV-1a hash of the group and the trace text, used to find repeated lines */
+static uint32_t mbed_trace_text_hash(const char *grp, const char *text, size_t len)
+{
+    uint32_t hash = TRACE_FNV_OFFSET;
+    for (; *grp; grp++) {
+        hash = (hash ^ (uint8_t)*grp) * TRACE_FNV_PRIME;
+    }
+    // the terminating null separates the group from the text
+    hash *= TRACE_FNV_PRIME;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * TRACE_FNV_PRIME;
+    }
+    return hash;
+}
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+/** Length of a message character in a quoted JSON or logfmt string */
+static inline size_t mbed_trace_escape_len(uint8_t c)
+{
+    if (c == '"' || c == '\\') {
+        return 2;
+    }
+    if (c < 0x20) {
+        return (c == '\n' || c == '\r' || c == '\t') ? 2 : 6;
+    }
+    return 1;
+}
+/** Escape text in place for a quoted string, the escaped text is cut to max characters
+ * at a character boundary. In the common case of nothing to escape, the text is only
+ * scanned once.
+ * @param len  text length in, number of the characters escaped out
+ * @return escaped length */
+static size_t mbed_trace_escape(char *text, size_t *len, size_t max)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i, end = 0;
+    for (i = 0; i < *len; i++) {
+        size_t n = mbed_trace_escape_len(text[i]);
+        if (end + n > max) {
+            break;
+        }
+        end += n;
+    }
+    *len = i;
+    size_t escaped = end;
+    // expand from the end, the escaped prefix is never shorter than the original
+    while (end > i) {
+        uint8_t c = text[--i];
+        switch (mbed_trace_escape_len(c)) {
+            case 1:
+                text[--end] = c;
+                break;
+            case 2:
+                text[--end] = c == '\n' ? 'n' : c == '\r' ? 'r' : c == '\t' ? 't' : c;
+                text[--end] = '\\';
+                break;
+            default:
+                end -= 6;
+                memcpy(text + end, "\\u00", 4);
+                text[end + 4] = hex[c >> 4];
+                text[end + 5] = hex[c & 0xf];
+                break;
+        }
+    }
+    return escaped;
+}
+/** Write the group name escaped as the message, in logfmt quoted only when it has
+ * characters which need it
+ * @return written length, or -1 if the group does not fit to size - 1 characters */
+static int mbed_trace_structured_group(char *buf, size_t size, const char *grp, bool json)
+{
+    size_t len = strlen(grp);
+    bool quote = !json && len == 0;
+    for (size_t i = 0; i < len && !json && !quote; i++) {
+        quote = grp[i] == ' ' || grp[i] == '=' || mbed_trace_escape_len(grp[i]) != 1;
+    }
+    size_t start = quote ? 1 : 0;
+    if (start + len + quote >= size) {
+        return -1;
+    }
+    memcpy(buf + start, grp, len);
+    size_t n = len;
+    size_t escaped = mbed_trace_escape(buf + start, &n, size - start - quote - 1);
+    if (n < len) {
+        return -1;
+    }
+    if (quote) {
+        buf[0] = '"';
+        buf[start + escaped] = '"';
+    }
+    return start + escaped + quote;
+}
+/** Format a JSON or logfmt line of max size - 1 characters, see mbed_trace_vformat() */
+static size_t mbed_trace_vformat_structured(char *line, int size, uint8_t dlevel, const char *grp, const char *fmt, va_list ap, uint32_t *hash, bool *cut)
+{
+    bool json = m_trace.format == TRACE_FORMAT_JSON;
+    const char *level, *quote = "";
+    char stamp[TRACE_TIMESTAMP_LEN];
+    int len, tail = json ? 2 : 1;
+
+    switch (dlevel) {
+        case (TRACE_LEVEL_ERROR):
+            level = "error";
+            break;
+        case (TRACE_LEVEL_WARN):
+            level = "warn";
+            break;
+        case (TRACE_LEVEL_INFO):
+            level = "info";
+            break;
+        case (TRACE_LEVEL_DEBUG):
+            level = "debug";
+            break;
+        default:
+            level = "cmd";
+            break;
+    }
+    stamp[0] = 0;
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    if (m_trace.timestamp) {
+        //built-in timestamp without the "[" and "] "
+        len = mbed_trace_timestamp(stamp, sizeof(stamp));
+        if (len > 3) {
+            memmove(stamp, stamp + 1, len - 3);
+            stamp[len - 3] = 0;
+        }
+        if (json && m_trace.timestamp == TRACE_TIMESTAMP_REALTIME) {
+            quote = "\"";
+        }
+    }
+#endif
+    if (stamp[0] == 0 && m_trace.time_f) {
+        mbed_trace_snprintf(stamp, sizeof(stamp), "%" PRIu32, m_trace.time_f());
+    }
+    uint32_t seq = trace_atomic_add(&m_trace.sequence, 1);
+    if (json) {
+        len = mbed_trace_snprintf(line, size, "{\"seq\":%" PRIu32 "%s%s%s%s,\"level\":\"%s\",\"group\":\"",
+                                  seq, stamp[0] ? ",\"time\":" : "", quote, stamp, quote, level);
+    } else {
+        len = mbed_trace_snprintf(line, size, "seq=%" PRIu32 "%s%s level=%s group=",
+                                  seq, stamp[0] ? " time=" : "", stamp, level);
+    }
+    if (len >= 0 && len < size) {
+        int group = mbed_trace_structured_group(line + len, size - len, grp, json);
+        if (group < 0) {
+            len = -1;
+        } else {
+            len += group;
+            len += mbed_trace_snprintf(line + len, size - len, json ? "\",\"msg\":\"" : " msg=\"");
+        }
+    }
+    if (len < 0 || len + tail >= size) {
+        *cut = true;
+        line[0] = 0;
+        return 0;
+    }
+    //the message is formatted in place and then escaped
+    char *ptr = line + len;
+    size_t max = size - len - tail - 1;
+    int retval = mbed_trace_vsnprintf(ptr, max + 1, fmt, ap);
+    size_t n = retval < 0 ? strlen(ptr) : (size_t)retval > max ? max : (size_t)retval;
+    size_t formatted = n;
+    if (hash) {
+        *hash = mbed_trace_text_hash(grp, ptr, n);
+    }
+    ptr += mbed_trace_escape(ptr, &n, max);
+    if ((retval >= 0 && (size_t)retval > max) || n < formatted) {
+        *cut = true;
+    }
+    *ptr++ = '"';
+    if (json) {
+        *ptr++ = '}';
+    }
+    *ptr = 0;
+    return ptr - line;
+}
+#endif
+/** Format a trace line of max size - 1 characters with the configured decorations,
+ * return the line length. When hash is given, it is set to the hash of the group and
+ * the trace text, without the decorations. cut is set when the line was cut. */
+static size_t mbed_trace_vformat(char *line, int size, uint8_t dlevel, const char *grp, const char *fmt, va_list ap, uint32_t *hash, bool *cut)
+{
+    return mbed_trace_vformat_config(line, size, m_trace.trace_config, dlevel, grp, fmt, ap, hash, cut);
+}
+/** Format a trace line in the line style of the TRACE_MODE_* bits of config, see mbed_trace_vformat() */
+static size_t mbed_trace_vformat_config(char *line, int size, uint8_t config, uint8_t dlevel, const char *grp, const char *fmt, va_list ap, uint32_t *hash, bool *cut)
+{
+    bool color = (config & TRACE_MODE_COLOR) != 0;
+    bool plain = (config & TRACE_MODE_PLAIN) != 0;
+    bool cr    = (config & TRACE_CARRIAGE_RETURN) != 0;
+
+    int retval = 0, bLeft = size;
+    char *ptr = line;
+    if (hash) {
+        *hash = mbed_trace_text_hash(grp, "", 0);
+    }
+    if (plain == true || dlevel == TRACE_LEVEL_CMD) {
+        //add trace data
+        retval = mbed_trace_vsnprintf(ptr, bLeft, fmt, ap);
+        if (retval < 0) {
+            retval = strlen(line);
+        } else if (retval >= bLeft) {
+            *cut = true;
+            retval = bLeft - 1;
+        }
+        if (hash) {
+            *hash = mbed_trace_text_hash(grp, line, retval);
+        }
+        return retval;
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+    } else if (m_trace.format != TRACE_FORMAT_TEXT) {
+        return mbed_trace_vformat_structured(line, size, dlevel, grp, fmt, ap, hash, cut);
+#endif
+    } else {
+        if (color) {
+            if (cr) {
+                retval = mbed_trace_snprintf(ptr, bLeft, "\r\x1b[2K");
+                if (retval >= bLeft) {
+                    retval = 0;
+                }
                 if (retval > 0) {
                     ptr += retval;
                     bLeft -= retval;
                 }
             }
             if (bLeft > 0) {
-                //add group tag
+                //include color in ANSI/VT100 escape code
                 switch (dlevel) {
                     case (TRACE_LEVEL_ERROR):
-                        retval = snprintf(ptr, bLeft, "[ERR ][%-4s]: ", grp);
+                        retval = mbed_trace_snprintf(ptr, bLeft, "%s", VT100_COLOR_ERROR);
                         break;
                     case (TRACE_LEVEL_WARN):
-                        retval = snprintf(ptr, bLeft, "[WARN][%-4s]: ", grp);
+                        retval = mbed_trace_snprintf(ptr, bLeft, "%s", VT100_COLOR_WARN);
                         break;
                     case (TRACE_LEVEL_INFO):
-                        retval = snprintf(ptr, bLeft, "[INFO][%-4s]: ", grp);
+                        retval = mbed_trace_snprintf(ptr, bLeft, "%s", VT100_COLOR_INFO);
                         break;
                     case (TRACE_LEVEL_DEBUG):
-                        retval = snprintf(ptr, bLeft, "[DBG ][%-4s]: ", grp);
+                        retval = mbed_trace_snprintf(ptr, bLeft, "%s", VT100_COLOR_DEBUG);
                         break;
                     default:
-                        retval = snprintf(ptr, bLeft, "              ");
+                        color = 0; //avoid unneeded color-terminate code
+                        retval = 0;
                         break;
                 }
                 if (retval >= bLeft) {
                     retval = 0;
                 }
-                if (retval > 0) {
+                if (retval > 0 && color) {
                     ptr += retval;
                     bLeft -= retval;
                 }
             }
-            if (retval > 0 && bLeft > 0) {
-                //add trace text
-                retval = vsnprintf(ptr, bLeft, fmt, ap);
-                if (retval >= bLeft) {
-                    retval = 0;
-                }
-                if (retval > 0) {
-                    ptr += retval;
-                    bLeft -= retval;
-                }
+
+        }
+        if (bLeft > 0 && m_trace.prefix_f) {
+            //find out length of body
+            size_t sz = 0;
+            va_list ap2;
+            va_copy(ap2, ap);
+            sz = mbed_trace_vsnprintf(NULL, 0, fmt, ap2) + retval + (retval ? 4 : 0);
+            va_end(ap2);
+            //add prefix string
+            retval = mbed_trace_snprintf(ptr, bLeft, "%s", mbed_trace_prefix(sz));
+            if (retval >= bLeft) {
+                retval = 0;
+            }
+            if (retval > 0) {
+                ptr += retval;
+                bLeft -= retval;
+            }
+        }
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+        if (bLeft > 0 && m_trace.timestamp) {
+            //add built-in timestamp
+            retval = mbed_trace_timestamp(ptr, bLeft);
+            ptr += retval;
+            bLeft -= retval;
+        }
+#endif
+        if (bLeft > 0) {
+            //add group tag
+            retval = mbed_trace_tag(ptr, bLeft, dlevel, grp);
+            if (retval >= bLeft) {
+                retval = 0;
             }
+            if (retval > 0) {
+                ptr += retval;
+                bLeft -= retval;
+            }
+        }
+        if (retval > 0 && bLeft > 0) {
+            //add trace text
+            retval = mbed_trace_vsnprintf(ptr, bLeft, fmt, ap);
+            if (retval >= bLeft) {
+                *cut = true;
+                retval = 0;
+            }
+            if (hash) {
+                *hash = mbed_trace_text_hash(grp, ptr, retval > 0 ? (size_t)retval : strlen(ptr));
+            }
+            if (retval > 0) {
+                ptr += retval;
+                bLeft -= retval;
+            }
+        }
 
-            if (retval > 0 && bLeft > 0  && m_trace.suffix_f) {
-                //add suffix string
-                retval = snprintf(ptr, bLeft, "%s", m_trace.suffix_f());
-                if (retval >= bLeft) {
-                    retval = 0;
-                }
-                if (retval > 0) {
-                    ptr += retval;
-                    bLeft -= retval;
-                }
+        if (retval > 0 && bLeft > 0  && m_trace.suffix_f) {
+            //add suffix string
+            retval = mbed_trace_snprintf(ptr, bLeft, "%s", mbed_trace_suffix());
+            if (retval >= bLeft) {
+                retval = 0;
+            }
+            if (retval > 0) {
+                ptr += retval;
+                bLeft -= retval;
             }
+        }
 
-            if (retval > 0 && bLeft > 0  && color) {
-                //add zero color VT100 when color mode
-                retval = snprintf(ptr, bLeft, "\x1b[0m");
-                if (retval >= bLeft) {
-                    retval = 0;
-                }
-                if (retval > 0) {
-                    // not used anymore
-                    //ptr += retval;
-                    //bLeft -= retval;
+        if (retval > 0 && bLeft > 0  && color) {
+            //add zero color VT100 when color mode
+            retval = mbed_trace_snprintf(ptr, bLeft, "\x1b[0m");
+            if (retval >= bLeft) {
+                retval = 0;
+            }
+            if (retval > 0) {
+                ptr += retval;
+                bLeft -= retval;
+            }
+        }
+        //whole data, a part cut by the line length may follow ptr
+        return (ptr - line) + strlen(ptr);
+    }
+}
+static size_t mbed_trace_format(char *line, int size, uint8_t dlevel, const char *grp, const char *fmt, ...)
+{
+    va_list ap;
+    bool cut = false;
+    va_start(ap, fmt);
+    size_t len = mbed_trace_vformat(line, size, dlevel, grp, fmt, ap, NULL, &cut);
+    va_end(ap);
+    return len;
+}
+/** Print "last message repeated N times" for a pending run of repeated lines,
+ * and forget the previous line. Called with the output lock held. */
+static void mbed_trace_coalesce_end(void)
+{
+    if (m_trace.coalesce_count) {
+        char line[TRACE_COALESCE_LINE_LEN];
+        size_t len = mbed_trace_format(line, sizeof(line) - 1, m_trace.coalesce_level, m_trace.coalesce_grp,
+                                       "last message repeated %" PRIu32 " times", m_trace.coalesce_count);
+        m_trace.coalesce_count = 0;
+        mbed_trace_emit(m_trace.coalesce_level, line, len);
+    }
+    m_trace.coalesce_level = 0;
+}
+/** Print a line unless it repeats the previous one
+ * @return true when the line was printed */
+static bool mbed_trace_coalesce_output(uint8_t dlevel, const char *grp, char *line, size_t len, uint32_t hash)
+{
+    uint32_t now = m_trace.time_f ? m_trace.time_f() : 0;
+    bool printed = false;
+
+    trace_output_lock();
+    if (dlevel == m_trace.coalesce_level && hash == m_trace.coalesce_hash) {
+        if (m_trace.coalesce_count == 0) {
+            m_trace.coalesce_time = now;
+        }
+        m_trace.coalesce_count++;
+        if (m_trace.coalesce_timeout && now - m_trace.coalesce_time >= m_trace.coalesce_timeout) {
+            // long run, report it and start counting again
+            mbed_trace_coalesce_end();
+            m_trace.coalesce_level = dlevel;
+        }
+    } else {
+        mbed_trace_coalesce_end();
+        m_trace.coalesce_level = dlevel;
+        m_trace.coalesce_hash = hash;
+        strncpy(m_trace.coalesce_grp, grp, sizeof(m_trace.coalesce_grp) - 1);
+        mbed_trace_emit(dlevel, line, len);
+        printed = true;
+    }
+    trace_output_unlock();
+    return printed;
+}
+void mbed_trace_coalesce_set(bool enable, uint32_t timeout)
+{
+    mbed_trace_mutex_wait();
+    if (!enable) {
+        mbed_trace_coalesce_end();
+    }
+    m_trace.coalesce = enable;
+    m_trace.coalesce_timeout = timeout;
+    mbed_trace_mutex_release();
+}
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+/** Print a trace line to the sinks which want it. The line is formatted once for
+ * each line style, and the same text is given to all sinks of the style.
+ * @return true when some sink printed the line, cut is set when it was cut */
+static bool mbed_trace_sinks_output(uint8_t dlevel, const char *grp, const char *fmt, va_list ap, bool *cut)
+{
+    char *line = trace_line();
+    uint8_t wanted = 0;
+    bool printed = false;
+    uint32_t epoch = mbed_trace_filter_read_begin();
+
+    for (int i = 0; i < DEFAULT_TRACE_SINK_COUNT; i++) {
+        const trace_sink_t *sink = &m_trace.sinks[i];
+        const trace_filter_t *groups = trace_atomic_load_sync(&sink->groups);
+        if (sink->printn && (sink->config & dlevel) &&
+                (groups == NULL || mbed_trace_filter_match(groups, grp))) {
+            wanted |= 1u << i;
+        }
+    }
+    mbed_trace_filter_read_end(epoch);
+    for (int first = 0; wanted; first++) {
+        if (!(wanted & (1u << first))) {
+            continue;
+        }
+        uint8_t style = m_trace.sinks[first].config & TRACE_MASK_CONFIG;
+        va_list ap2;
+        va_copy(ap2, ap);
+        uint32_t start = trace_latency_clock();
+        size_t len = mbed_trace_vformat_config(line, m_trace.line_length, style, dlevel, grp, fmt, ap2, NULL, cut);
+        trace_latency_add(TRACE_LATENCY_FORMAT, start);
+        va_end(ap2);
+        line[len] = '\n';
+        line[len + 1] = 0;
+        trace_output_lock();
+        for (int i = first; i < DEFAULT_TRACE_SINK_COUNT; i++) {
+            void (*printn)(const char *, size_t) = m_trace.sinks[i].printn;
+            if ((wanted & (1u << i)) && (m_trace.sinks[i].config & TRACE_MASK_CONFIG) == style) {
+                wanted &= ~(1u << i);
+                if (printn) {
+                    start = trace_clock();
+                    printn(line, len + 1);
+                    trace_output_measure(dlevel, grp, len + 1, start);
+                    printed = true;
                 }
             }
-            //print out whole data
-            m_trace.printf(m_trace.line);
         }
+        trace_output_unlock();
+        line[len] = 0;
+    }
+    return printed;
+}
+#endif
+void mbed_vtracef(uint8_t dlevel, const char *grp, const char *fmt, va_list ap)
+{
+    // counted once for the trace, whether it went to the print functions, the sinks or both
+    bool printed = false, cut = false;
+
+    trace_line_lock();
+
+    if (!trace_initialized()) {
+        goto end;
+    }
+
+    char *line = trace_line();
+    line[0] = 0; //by default trace is empty
+
+    if (fmt == 0 || grp == 0 || !(mbed_trace_has_output() || trace_has_sinks())) {
         //return tmp data pointer back to the beginning
         mbed_trace_reset_tmp();
+        goto end;
+    }
+    if (mbed_trace_skip(dlevel, grp)) {
+        trace_stats_add(dlevel, grp, filtered);
+        mbed_trace_reset_tmp();
+        goto end;
+    }
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    if (m_trace.history && (m_trace.history_levels & dlevel)) {
+        //store unformatted, printed out when a trigger level trace comes
+        mbed_trace_history_push(dlevel, grp, fmt, ap);
+        mbed_trace_reset_tmp();
+        goto end;
+    }
+#endif
+    bool primary = (mbed_trace_level_mask(grp) & dlevel) != 0;
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    // the sinks have their own levels, a level can go to a sink and not to the print functions
+    bool sinks = trace_has_sinks() && (m_trace.sink_levels & dlevel);
+#else
+    bool sinks = false;
+#endif
+    if (primary || sinks) {
+        if (m_trace.sampling && !mbed_trace_sample(dlevel, grp)) {
+            //left out by sampling, before any formatting
+            mbed_trace_reset_tmp();
+            goto end;
+        }
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+        if (primary && m_trace.history && (m_trace.history_trigger_levels & dlevel)) {
+            mbed_trace_history_replay();
+        }
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+        if (sinks) {
+            printed = mbed_trace_sinks_output(dlevel, grp, fmt, ap, &cut);
+        }
+        if (!primary || !mbed_trace_has_output()) {
+            mbed_trace_reset_tmp();
+            goto end;
+        }
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+        if (m_trace.token_f && dlevel != TRACE_LEVEL_CMD) {
+            //store binary record, formatting is done by the host side decoder
+            uint32_t start = trace_latency_clock();
+            int len = mbed_trace_token_encode((uint8_t *)line, m_trace.line_length, dlevel, grp, fmt, ap);
+            trace_latency_add(TRACE_LATENCY_FORMAT, start);
+            start = trace_clock();
+            trace_output_lock();
+            m_trace.token_f((const uint8_t *)line, len);
+            trace_output_unlock();
+            trace_output_measure(dlevel, grp, len, start);
+            printed = true;
+            line[0] = 0;
+            mbed_trace_reset_tmp();
+            goto end;
+        }
+#endif
+        if (m_trace.printv && !(dlevel == TRACE_LEVEL_CMD && (m_trace.cmd_printf || m_trace.cmd_printn)) && !m_trace.coalesce
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+                && m_trace.format == TRACE_FORMAT_TEXT
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+                && !m_trace.async_queue
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+                && !m_trace.batch_buffer
+#endif
+           ) {
+            mbed_trace_vprintv(dlevel, grp, fmt, ap);
+            printed = true;
+            mbed_trace_reset_tmp();
+            goto end;
+        }
+        if (m_trace.coalesce && dlevel != TRACE_LEVEL_CMD) {
+            uint32_t hash, start = trace_latency_clock();
+            size_t len = mbed_trace_vformat(line, m_trace.line_length, dlevel, grp, fmt, ap, &hash, &cut);
+            trace_latency_add(TRACE_LATENCY_FORMAT, start);
+            start = trace_clock();
+            if (mbed_trace_coalesce_output(dlevel, grp, line, len, hash)) {
+                trace_output_measure(dlevel, grp, len + 1, start);
+                printed = true;
+            }
+        } else {
+            uint32_t start = trace_latency_clock();
+            size_t len = mbed_trace_vformat(line, m_trace.line_length, dlevel, grp, fmt, ap, NULL, &cut);
+            trace_latency_add(TRACE_LATENCY_FORMAT, start);
+            start = trace_clock();
+            mbed_trace_output(dlevel, line, len);
+            trace_output_measure(dlevel, grp, len + 1, start);
+            printed = true;
+        }
+    } else {
+        trace_stats_add(dlevel, grp, masked);
     }
+    //return tmp data pointer back to the beginning, also when the level is masked out
+    mbed_trace_reset_tmp();
 
 end:
+    if (printed) {
+        trace_stats_add(dlevel, grp, emitted);
+    }
+    if (cut) {
+        trace_stats_add(dlevel, grp, truncated);
+    }
+    trace_line_unlock();
+}
+static void mbed_trace_mutex_wait(void)
+{
+    if (m_trace.mutex_wait_f) {
+        uint32_t start = trace_latency_clock();
+        m_trace.mutex_wait_f();
+        if (m_trace.mutex_lock_count == 0) {
+            // only the outermost lock can wait for another thread
+            trace_latency_add(TRACE_LATENCY_LOCK, start);
+        }
+        m_trace.mutex_lock_count++;
+    }
+}
+static void mbed_trace_mutex_release(void)
+{
     if (m_trace.mutex_release_f) {
         // Store the mutex lock count to temp variable so that it won't get
         // clobbered during last loop iteration when mutex gets released
@@ -506,23 +4281,20 @@ end:
 }
 static void mbed_trace_reset_tmp(void)
 {
-    m_trace.tmp_data_ptr = m_trace.tmp_data;
+    trace_tmp_data_ptr_set(trace_tmp_data());
 }
 const char *mbed_trace_last(void)
 {
-    return m_trace.line;
+    return trace_line();
 }
 /* Helping functions */
-#define tmp_data_left()  m_trace.tmp_data_length-(m_trace.tmp_data_ptr-m_trace.tmp_data)
+#define tmp_data_left()  m_trace.tmp_data_length-(trace_tmp_data_ptr()-trace_tmp_data())
 #if MBED_CONF_MBED_TRACE_FEA_IPV6 == 1
 char *mbed_trace_ipv6(const void *addr_ptr)
 {
     /** Acquire mutex. It is released before returning from mbed_vtracef. */
-    if (m_trace.mutex_wait_f) {
-        m_trace.mutex_wait_f();
-        m_trace.mutex_lock_count++;
-    }
-    char *str = m_trace.tmp_data_ptr;
+    trace_line_lock();
+    char *str = trace_tmp_data_ptr();
     if (str == NULL) {
         return "";
     }
@@ -533,17 +4305,14 @@ char *mbed_trace_ipv6(const void *addr_ptr)
         return "<null>";
     }
     str[0] = 0;
-    m_trace.tmp_data_ptr += ip6tos(addr_ptr, str) + 1;
+    trace_tmp_data_ptr_set(str + ip6tos(addr_ptr, str) + 1);
     return str;
 }
 char *mbed_trace_ipv6_prefix(const uint8_t *prefix, uint8_t prefix_len)
 {
     /** Acquire mutex. It is released before returning from mbed_vtracef. */
-    if (m_trace.mutex_wait_f) {
-        m_trace.mutex_wait_f();
-        m_trace.mutex_lock_count++;
-    }
-    char *str = m_trace.tmp_data_ptr;
+    trace_line_lock();
+    char *str = trace_tmp_data_ptr();
     if (str == NULL) {
         return "";
     }
@@ -555,20 +4324,46 @@ char *mbed_trace_ipv6_prefix(const uint8_t *prefix, uint8_t prefix_len)
         return "<err>";
     }
 
-    m_trace.tmp_data_ptr += ip6_prefix_tos(prefix, prefix_len, str) + 1;
+    trace_tmp_data_ptr_set(str + ip6_prefix_tos(prefix, prefix_len, str) + 1);
     return str;
 }
 #endif //MBED_CONF_MBED_TRACE_FEA_IPV6
+/** Write "xx:" for each byte.
+ * @return pointer after the last ':' */
+static char *mbed_trace_hex_encode(char *dst, const uint8_t *src, int count)
+{
+#if defined(__SSSE3__)
+    const __m128i digits = _mm_loadu_si128((const __m128i *)mbed_trace_hex_lower);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    // spread 16 hex characters of 8 bytes to 24 characters, 0x80 leaves room for the colon
+    const __m128i spread0 = _mm_setr_epi8(0, 1, -128, 2, 3, -128, 4, 5, -128, 6, 7, -128, 8, 9, -128, 10);
+    const __m128i spread1 = _mm_setr_epi8(11, -128, 12, 13, -128, 14, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+    const __m128i colon0 = _mm_setr_epi8(0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0, 0, ':', 0);
+    const __m128i colon1 = _mm_setr_epi8(0, ':', 0, 0, ':', 0, 0, ':', 0, 0, 0, 0, 0, 0, 0, 0);
+    for (; count >= 8; count -= 8, src += 8, dst += 24) {
+        __m128i bytes = _mm_loadl_epi64((const __m128i *)src);
+        __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, nibble));
+        __m128i hex = _mm_unpacklo_epi8(hi, lo);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_shuffle_epi8(hex, spread0), colon0));
+        _mm_storel_epi64((__m128i *)(dst + 16), _mm_or_si128(_mm_shuffle_epi8(hex, spread1), colon1));
+    }
+#endif
+    for (; count > 0; count--) {
+        uint8_t byte = *src++;
+        *dst++ = mbed_trace_hex_lower[byte >> 4];
+        *dst++ = mbed_trace_hex_lower[byte & 0x0f];
+        *dst++ = ':';
+    }
+    return dst;
+}
 char *mbed_trace_array(const uint8_t *buf, uint16_t len)
 {
     /** Acquire mutex. It is released before returning from mbed_vtracef. */
-    if (m_trace.mutex_wait_f) {
-        m_trace.mutex_wait_f();
-        m_trace.mutex_lock_count++;
-    }
+    trace_line_lock();
     int i, bLeft = tmp_data_left();
     char *str, *wptr;
-    str = m_trace.tmp_data_ptr;
+    str = trace_tmp_data_ptr();
     if (len == 0 || str == NULL || bLeft == 0) {
         return "";
     }
@@ -577,19 +4372,18 @@ char *mbed_trace_array(const uint8_t *buf, uint16_t len)
     }
     wptr = str;
     wptr[0] = 0;
-    const uint8_t *ptr = buf;
     char overflow = 0;
-    for (i = 0; i < len; i++) {
-        if (bLeft <= 3) {
-            overflow = 1;
-            break;
-        }
-        int retval = snprintf(wptr, bLeft, "%02x:", *ptr++);
-        if (retval <= 0 || retval > bLeft) {
-            break;
-        }
-        bLeft -= retval;
-        wptr += retval;
+    // each byte takes "xx:" and the last one needs room for the nul as well
+    i = bLeft > 3 ? (bLeft - 1) / 3 : 0;
+    if (i < len) {
+        overflow = 1;
+        trace_stats_array_overflow();
+    } else {
+        i = len;
+    }
+    if (i > 0) {
+        wptr = mbed_trace_hex_encode(wptr, buf, i);
+        *wptr = 0;
     }
     if (wptr > str) {
         if (overflow) {
@@ -601,6 +4395,6 @@ char *mbed_trace_array(const uint8_t *buf, uint16_t len)
             *(wptr - 1) = 0;
         }
     }
-    m_trace.tmp_data_ptr = wptr;
+    trace_tmp_data_ptr_set(wptr);
     return str;
 }
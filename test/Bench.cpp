@@ -0,0 +1,216 @@
+// ----------------------------------------------------------------------------
+// Copyright 2021 Pelion.
+//
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------
+// Microbenchmarks of the trace library.
+//
+// usage: trace_bench [--iterations N] [--out results.json]
+//
+// Every benchmark calls the trace function N times and reports ns per call
+// and calls (lines) per second as JSON, to stdout or to the given file.
+// Build with CMAKE_BUILD_TYPE=Release for meaningful numbers. The IPv6 helpers
+// use the conversion stub of the unit tests, so they measure the helper
+// buffer handling, not the address formatting.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef MBED_CONF_MBED_TRACE_ENABLE
+#undef MBED_CONF_MBED_TRACE_ENABLE
+#endif
+
+#define MBED_CONF_MBED_TRACE_ENABLE 1
+#define MBED_CONF_MBED_TRACE_FEA_IPV6 1
+
+#include "mbed-trace/mbed_trace.h"
+#include "ip6tos_stub.h"
+
+#define TRACE_GROUP "bnch"
+
+struct bench_result {
+    std::string name;
+    double ns_per_call;
+    double calls_per_second;
+};
+
+static volatile size_t null_sink_bytes;
+static void null_sink(const char *str, size_t len)
+{
+    (void)str;
+    null_sink_bytes += len;
+}
+
+static FILE *file_sink_fp;
+static void file_sink(const char *str, size_t len)
+{
+    fwrite(str, 1, len, file_sink_fp);
+}
+
+static char bench_prefix_buf[32];
+static char *bench_prefix(size_t)
+{
+    static uint32_t ticks;
+    snprintf(bench_prefix_buf, sizeof(bench_prefix_buf), "[%08u]", (unsigned)++ticks);
+    return bench_prefix_buf;
+}
+
+/** Set up the library for one benchmark, printing to the null sink */
+static void bench_setup(uint8_t config)
+{
+    mbed_trace_free();
+    mbed_trace_init();
+    mbed_trace_buffer_sizes(0, 1024);
+    mbed_trace_config_set(config);
+    mbed_trace_printn_function_set(null_sink);
+}
+
+static bench_result bench_run(const char *name, long iterations, const std::function<void(long)> &body)
+{
+    // warm up the caches and the branch predictors
+    for (long i = 0; i < iterations / 10; i++) {
+        body(i);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        body(i);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    bench_result result;
+    result.name = name;
+    result.ns_per_call = elapsed.count() / iterations;
+    result.calls_per_second = result.ns_per_call > 0 ? 1e9 / result.ns_per_call : 0;
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 200000;
+    const char *out = NULL;
+    std::vector<bench_result> results;
+    static uint8_t array[256];
+    static const uint8_t addr[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--iterations N] [--out results.json]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations <= 0) {
+        iterations = 1;
+    }
+    for (size_t i = 0; i < sizeof(array); i++) {
+        array[i] = (uint8_t)i;
+    }
+    ip6tos_stub.output_string = "2001:db8::1";
+
+    // traces skipped by the usage macros before any call
+    bench_setup(TRACE_ACTIVE_LEVEL_INFO | TRACE_MODE_PLAIN);
+    results.push_back(bench_run("disabled_level_macro", iterations, [](long i) {
+        tr_debug("value %ld", i);
+    }));
+    // level check done inside mbed_tracef()
+    results.push_back(bench_run("disabled_level_call", iterations, [](long i) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, TRACE_GROUP, "value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_trace_exclude_filters_set((char *)"abc,bnch,net*");
+    results.push_back(bench_run("filtered_group", iterations, [](long i) {
+        tr_info("value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    results.push_back(bench_run("plain_null_sink", iterations, [](long i) {
+        tr_info("value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL);
+    results.push_back(bench_run("decorated_null_sink", iterations, [](long i) {
+        tr_info("value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_COLOR);
+    results.push_back(bench_run("color_null_sink", iterations, [](long i) {
+        tr_info("value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_prefix_function_set(bench_prefix);
+    results.push_back(bench_run("prefixed_null_sink", iterations, [](long i) {
+        tr_info("value %ld", i);
+    }));
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL);
+    results.push_back(bench_run("format_mixed_null_sink", iterations, [](long i) {
+        tr_info("id %d name %s addr %p ratio %.2f", (int)i, "sensor", (void *)array, 0.5);
+    }));
+
+    static const int array_sizes[] = {8, 32, 128, 256};
+    for (int size : array_sizes) {
+        char name[32];
+        snprintf(name, sizeof(name), "array_%d", size);
+        bench_setup(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+        results.push_back(bench_run(name, iterations, [size](long) {
+            tr_info("%s", tr_array(array, size));
+        }));
+    }
+
+    bench_setup(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    results.push_back(bench_run("ipv6", iterations, [](long) {
+        tr_info("%s", tr_ipv6(addr));
+    }));
+    results.push_back(bench_run("ipv6_prefix", iterations, [](long) {
+        tr_info("%s", tr_ipv6_prefix(addr, 64));
+    }));
+
+    file_sink_fp = tmpfile();
+    if (file_sink_fp) {
+        bench_setup(TRACE_ACTIVE_LEVEL_ALL);
+        mbed_trace_printn_function_set(file_sink);
+        results.push_back(bench_run("decorated_file_sink", iterations, [](long i) {
+            tr_info("value %ld", i);
+        }));
+        fclose(file_sink_fp);
+    }
+    mbed_trace_free();
+
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    if (fp == NULL) {
+        perror(out);
+        return 1;
+    }
+    fprintf(fp, "{\n  \"library\": \"mbed-trace\",\n  \"iterations\": %ld,\n  \"benchmarks\": [\n", iterations);
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(fp, "    {\"name\": \"%s\", \"ns_per_call\": %.2f, \"calls_per_second\": %.0f}%s\n",
+                results[i].name.c_str(), results[i].ns_per_call, results[i].calls_per_second,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    if (out) {
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,330 @@
+// ----------------------------------------------------------------------------
+// Copyright 2021 Pelion.
+//
+// SPDX-License-Identifier: Apache-2.0
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// ----------------------------------------------------------------------------
+// Multithreaded stress test and scalability benchmark of the trace library.
+//
+// usage: trace_stress [--threads N] [--lines M] [--out results.json]
+//                     [--no-check] [--min-speedup X]
+//
+// Runs 1, 2, 4 ... N threads, each tracing M lines with tr_array() and
+// tr_ipv6() helpers through a recursive pthread mutex. Every printed line is
+// checked: it must be complete, match the arguments of its thread, and the
+// lines of one thread must come in order without gaps. Aggregate lines per
+// second for each thread count are reported as JSON. The exit code is non
+// zero if any line was torn, interleaved, lost or duplicated. One more thread
+// keeps replacing the group filters, with lists that never leave out the
+// traces, so the filters are freed while the tracing threads match groups.
+//
+// The build makes one binary per locking mode, reported as "mode":
+// trace_stress shares the buffers under the mutex ("mutex"), trace_stress_tls
+// uses MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL where the mutex only guards the
+// print function ("thread-local"), and trace_stress_async adds
+// MBED_CONF_MBED_TRACE_FEA_ASYNC where the tracing threads take no lock at all
+// and a drain thread prints the lines without the mutex ("async").
+//
+// Each run also reports its speedup over the single thread run. With
+// --min-speedup the exit code is non zero when no run of 2 or more threads,
+// up to the number of CPUs, reaches the given speedup; on a single CPU host
+// the exit code is 77, "skipped". --no-check only counts the lines, so that
+// the serialized print function does not hide the scaling of the formatting.
+#include <thread>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#ifdef MBED_CONF_MBED_TRACE_ENABLE
+#undef MBED_CONF_MBED_TRACE_ENABLE
+#endif
+
+#define MBED_CONF_MBED_TRACE_ENABLE 1
+#define MBED_CONF_MBED_TRACE_FEA_IPV6 1
+
+#include "mbed-trace/mbed_trace.h"
+#include "ip6tos_stub.h"
+
+#define TRACE_GROUP "strs"
+
+#define STRESS_ARRAY_LEN    8
+#define STRESS_MAX_THREADS  64
+#define STRESS_ASYNC_RECORDS 256
+
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+#define STRESS_MODE "async"
+#elif MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+#define STRESS_MODE "thread-local"
+#else
+#define STRESS_MODE "mutex"
+#endif
+
+static pthread_mutex_t stress_mutex;
+/** serializes the checks, the print function is not always called with the mutex */
+static pthread_mutex_t stress_check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long stress_lines;
+/** next expected line number of each thread */
+static long stress_next[STRESS_MAX_THREADS];
+static long stress_errors;
+static std::atomic<long> stress_printed;
+static bool stress_checking = true;
+static std::atomic<bool> stress_running;
+static std::atomic<bool> stress_draining;
+
+static void stress_mutex_wait(void)
+{
+    pthread_mutex_lock(&stress_mutex);
+}
+static void stress_mutex_release(void)
+{
+    pthread_mutex_unlock(&stress_mutex);
+}
+
+static void stress_payload(uint8_t *payload, int thread, long n)
+{
+    for (int i = 0; i < STRESS_ARRAY_LEN; i++) {
+        payload[i] = (uint8_t)(thread * 16 + n + i);
+    }
+}
+
+/** Check one line */
+static void stress_check(const char *str, size_t len)
+{
+    char expected[128];
+    uint8_t payload[STRESS_ARRAY_LEN];
+    int thread;
+    long n;
+    char *ptr = expected;
+
+    stress_printed++;
+    if (sscanf(str, "t%d n%ld ", &thread, &n) != 2 || thread < 0 || thread >= STRESS_MAX_THREADS) {
+        fprintf(stderr, "malformed line: %.*s", (int)len, str);
+        stress_errors++;
+        return;
+    }
+    stress_payload(payload, thread, n);
+    ptr += sprintf(ptr, "t%d n%ld ", thread, n);
+    for (int i = 0; i < STRESS_ARRAY_LEN; i++) {
+        ptr += sprintf(ptr, "%02x%s", payload[i], i + 1 < STRESS_ARRAY_LEN ? ":" : "");
+    }
+    sprintf(ptr, " 2001:db8::1\n");
+    if (len != strlen(expected) || memcmp(str, expected, len) != 0) {
+        fprintf(stderr, "torn line: %.*s", (int)len, str);
+        stress_errors++;
+    } else if (n != stress_next[thread]) {
+        fprintf(stderr, "thread %d: line %ld, expected %ld\n", thread, n, stress_next[thread]);
+        stress_errors++;
+        stress_next[thread] = n + 1;
+    } else {
+        stress_next[thread]++;
+    }
+}
+static void stress_sink(const char *str, size_t len)
+{
+    if (!stress_checking) {
+        stress_printed++;
+        return;
+    }
+    pthread_mutex_lock(&stress_check_mutex);
+    stress_check(str, len);
+    pthread_mutex_unlock(&stress_check_mutex);
+}
+
+static void *stress_thread(void *arg)
+{
+    int thread = (int)(intptr_t)arg;
+    static const uint8_t addr[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    uint8_t payload[STRESS_ARRAY_LEN];
+
+    for (long n = 0; n < stress_lines; n++) {
+        stress_payload(payload, thread, n);
+        tr_info("t%d n%ld %s %s", thread, n, tr_array(payload, STRESS_ARRAY_LEN), tr_ipv6(addr));
+    }
+    return NULL;
+}
+
+static void *stress_filter_thread(void *)
+{
+    static const char *lists[] = {"abc,def*", "net*,mac,rpl", "x,y,z,w*"};
+    for (long n = 0; stress_running; n++) {
+        mbed_trace_exclude_filters_set((char *)lists[n % 3]);
+        mbed_trace_include_filters_set(n & 1 ? (char *)"strs,abc*" : NULL);
+    }
+    return NULL;
+}
+
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+/** Print the queued lines until the tracing threads are done */
+static void *stress_drain_thread(void *)
+{
+    while (stress_draining) {
+        if (mbed_trace_async_drain() == 0) {
+            sched_yield();
+        }
+    }
+    mbed_trace_async_drain();
+    return NULL;
+}
+/** Called by a tracing thread while the queue is full */
+static void stress_async_wait(void)
+{
+    sched_yield();
+}
+#endif
+
+/** Run threads tracing concurrently, return lines per second */
+static double stress_run(int threads)
+{
+    std::vector<pthread_t> ids(threads);
+    pthread_t filter_id;
+
+    memset(stress_next, 0, sizeof(stress_next));
+    stress_printed = 0;
+    stress_running = true;
+    pthread_create(&filter_id, NULL, stress_filter_thread, NULL);
+    auto start = std::chrono::steady_clock::now();
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    pthread_t drain_id;
+    stress_draining = true;
+    pthread_create(&drain_id, NULL, stress_drain_thread, NULL);
+#endif
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, stress_thread, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    // the lines are counted when printed, not when queued
+    stress_draining = false;
+    pthread_join(drain_id, NULL);
+#endif
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    stress_running = false;
+    pthread_join(filter_id, NULL);
+
+    if (stress_printed != threads * stress_lines) {
+        fprintf(stderr, "%d threads: %ld lines printed, expected %ld\n", threads, stress_printed.load(), threads * stress_lines);
+        stress_errors++;
+    }
+    for (int i = 0; stress_checking && i < threads; i++) {
+        if (stress_next[i] != stress_lines) {
+            fprintf(stderr, "thread %d: last line %ld, expected %ld\n", i, stress_next[i] - 1, stress_lines - 1);
+            stress_errors++;
+        }
+    }
+    return elapsed.count() > 0 ? stress_printed / elapsed.count() : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = 8;
+    int cpus = (int)std::thread::hardware_concurrency();
+    double min_speedup = 0, best_speedup = 0;
+    const char *out = NULL;
+    pthread_mutexattr_t attr;
+    std::vector<int> counts;
+    std::vector<double> rates;
+
+    stress_lines = 20000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lines") == 0 && i + 1 < argc) {
+            stress_lines = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out = argv[++i];
+        } else if (strcmp(argv[i], "--no-check") == 0) {
+            stress_checking = false;
+        } else if (strcmp(argv[i], "--min-speedup") == 0 && i + 1 < argc) {
+            min_speedup = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--lines M] [--out results.json] [--no-check] [--min-speedup X]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads < 1 || max_threads > STRESS_MAX_THREADS || stress_lines < 1) {
+        fprintf(stderr, "threads must be 1...%d and lines at least 1\n", STRESS_MAX_THREADS);
+        return 2;
+    }
+
+    // helpers lock the mutex again inside the trace call, so it must be recursive
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&stress_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ip6tos_stub.output_string = "2001:db8::1";
+    mbed_trace_mutex_wait_function_set(stress_mutex_wait);
+    mbed_trace_mutex_release_function_set(stress_mutex_release);
+    mbed_trace_init();
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_trace_printn_function_set(stress_sink);
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    mbed_trace_async_wait_function_set(stress_async_wait);
+    if (mbed_trace_async_enable(STRESS_ASYNC_RECORDS) != 0) {
+        fprintf(stderr, "async queue allocation failed\n");
+        return 1;
+    }
+#endif
+
+    // warm up the caches and the allocator, so that the single thread run is not penalized
+    stress_run(1);
+    for (int threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2) {
+        counts.push_back(threads);
+        rates.push_back(stress_run(threads));
+    }
+    mbed_trace_free();
+
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    if (fp == NULL) {
+        perror(out);
+        return 1;
+    }
+    fprintf(fp, "{\n  \"library\": \"mbed-trace\",\n  \"mode\": \"%s\",\n  \"cpus\": %d,\n  \"checked\": %s,\n"
+            "  \"lines_per_thread\": %ld,\n  \"errors\": %ld,\n  \"runs\": [\n",
+            STRESS_MODE, cpus, stress_checking ? "true" : "false", stress_lines, stress_errors);
+    for (size_t i = 0; i < counts.size(); i++) {
+        double speedup = rates[0] > 0 ? rates[i] / rates[0] : 0;
+        if (counts[i] > 1 && counts[i] <= cpus && speedup > best_speedup) {
+            best_speedup = speedup;
+        }
+        fprintf(fp, "    {\"threads\": %d, \"lines_per_second\": %.0f, \"speedup\": %.2f}%s\n", counts[i], rates[i],
+                speedup, i + 1 < counts.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    if (out) {
+        fclose(fp);
+    }
+    if (stress_errors) {
+        return 1;
+    }
+    if (min_speedup > 0) {
+        if (cpus < 2) {
+            fprintf(stderr, "single CPU, scaling not measured\n");
+            return 77;
+        }
+        if (best_speedup < min_speedup) {
+            fprintf(stderr, "best speedup %.2f, expected at least %.2f\n", best_speedup, min_speedup);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -18,6 +18,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <wchar.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
 
@@ -507,3 +514,1516 @@ TEST_F(trace, uninitialized)
     ASSERT_STREQ("hello", buf);
 }
 
+
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+static uint32_t async_seqs[8];
+static int async_seq_count = 0;
+void myprint_async(const char *str)
+{
+    async_seqs[async_seq_count++ % 8] = mbed_trace_async_sequence_get();
+    strcpy(buf, str);
+}
+TEST_F(trace, async)
+{
+    ASSERT_EQ(0, mbed_trace_async_enable(3));
+    buf[0] = 0;
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "first");
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "second %d", 2);
+    ASSERT_STREQ("", buf); // nothing printed before drain
+
+    // the drain prints without the mutex
+    check_mutex_lock_status = false;
+    int waits = mutex_wait_count;
+    ASSERT_EQ(2, mbed_trace_async_drain());
+    ASSERT_EQ(waits, mutex_wait_count);
+    check_mutex_lock_status = true;
+    ASSERT_STREQ("second 2", buf);
+    ASSERT_EQ(0, mbed_trace_async_drain());
+
+    // disabling prints out what is still pending
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "pending");
+    ASSERT_EQ(0, mbed_trace_async_enable(0));
+    ASSERT_STREQ("pending", buf);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "sync again");
+    ASSERT_STREQ("sync again", buf);
+}
+static int async_notify_count;
+static void async_notify(void)
+{
+    async_notify_count++;
+}
+static int async_wait_count;
+static void async_wait(void)
+{
+    // stands for the drain thread getting to run while the tracing thread waits
+    async_wait_count++;
+    mbed_trace_async_drain();
+}
+TEST_F(trace, async_block)
+{
+    check_mutex_lock_status = false;
+    mbed_trace_print_function_set(myprint_async);
+    ASSERT_EQ(0, mbed_trace_async_enable(4));
+    // without a wait function a full queue drops the new line
+    for (int i = 0; i < 6; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "line %d", i);
+    }
+    ASSERT_EQ(2u, mbed_trace_async_dropped_get());
+    ASSERT_EQ(4, mbed_trace_async_drain());
+
+    // the tracing thread wakes up the drain and waits for room
+    async_notify_count = 0;
+    async_wait_count = 0;
+    mbed_trace_async_notify_function_set(async_notify);
+    mbed_trace_async_wait_function_set(async_wait);
+    async_seq_count = 0;
+    for (int i = 0; i < 6; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "line %d", i);
+    }
+    ASSERT_EQ(2u, mbed_trace_async_dropped_get());
+    ASSERT_EQ(1, async_wait_count);
+    ASSERT_EQ(7, async_notify_count);
+    ASSERT_EQ(4, async_seq_count);
+    ASSERT_STREQ("line 3", buf);
+    ASSERT_EQ(2, mbed_trace_async_drain());
+    ASSERT_STREQ("line 5", buf);
+    ASSERT_EQ(6u, async_seqs[0]);
+    ASSERT_EQ(11u, async_seqs[5]);
+    check_mutex_lock_status = true;
+}
+static std::recursive_mutex async_mutex;
+static void async_mutex_wait(void)
+{
+    async_mutex.lock();
+    mutex_wait_count++;
+}
+static void async_mutex_release(void)
+{
+    mutex_release_count++;
+    async_mutex.unlock();
+}
+static std::atomic<int> async_slow_state;
+static std::atomic<bool> async_slow_traced;
+static void async_slow_print(const char *str)
+{
+    // a slow output: the first line keeps the drain thread here until the
+    // tracing thread has queued more lines, or until a timeout
+    if (async_slow_state == 0) {
+        async_slow_state = 1;
+        for (int i = 0; i < 2000 && !async_slow_traced; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        async_slow_state = 2;
+    }
+    strcpy(buf, str);
+}
+TEST_F(trace, async_slow_output)
+{
+    mbed_trace_mutex_wait_function_set(async_mutex_wait);
+    mbed_trace_mutex_release_function_set(async_mutex_release);
+    mbed_trace_print_function_set(async_slow_print);
+    ASSERT_EQ(0, mbed_trace_async_enable(8));
+    async_slow_state = 0;
+    async_slow_traced = false;
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "slow");
+
+    int printed = 0;
+    std::thread drain([&printed] { printed = mbed_trace_async_drain(); });
+    while (async_slow_state == 0) {
+        std::this_thread::yield();
+    }
+    // the drain thread is in the print function, tracing must not wait for it
+    for (int i = 0; i < 3; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "queued %d", i);
+    }
+    bool printing = async_slow_state == 1;
+    async_slow_traced = true;
+    drain.join();
+    ASSERT_TRUE(printing);
+    // the lines queued meanwhile are printed by the same drain
+    ASSERT_EQ(4, printed);
+    ASSERT_STREQ("queued 2", buf);
+    ASSERT_EQ(0, mbed_trace_async_enable(0));
+    mbed_trace_mutex_wait_function_set(my_mutex_wait);
+    mbed_trace_mutex_release_function_set(my_mutex_release);
+}
+TEST_F(trace, async_drop_newest)
+{
+    check_mutex_lock_status = false;
+    mbed_trace_print_function_set(myprint_async);
+    ASSERT_EQ(0, mbed_trace_async_enable(4));
+    mbed_trace_async_policy_set(TRACE_ASYNC_POLICY_DROP_NEWEST);
+    for (int i = 0; i < 6; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "line %d", i);
+    }
+    ASSERT_EQ(2u, mbed_trace_async_dropped_get());
+    async_seq_count = 0;
+    ASSERT_EQ(4, mbed_trace_async_drain());
+    ASSERT_STREQ("line 3", buf);
+    ASSERT_EQ(0u, async_seqs[0]);
+    ASSERT_EQ(3u, async_seqs[3]);
+    check_mutex_lock_status = true;
+}
+TEST_F(trace, async_drop_oldest)
+{
+    check_mutex_lock_status = false;
+    mbed_trace_print_function_set(myprint_async);
+    ASSERT_EQ(0, mbed_trace_async_enable(4));
+    mbed_trace_async_policy_set(TRACE_ASYNC_POLICY_DROP_OLDEST);
+    for (int i = 0; i < 6; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "line %d", i);
+    }
+    ASSERT_EQ(2u, mbed_trace_async_dropped_get());
+    async_seq_count = 0;
+    ASSERT_EQ(4, mbed_trace_async_drain());
+    ASSERT_STREQ("line 5", buf);
+    // sequence numbers reveal the dropped records
+    ASSERT_EQ(2u, async_seqs[0]);
+    ASSERT_EQ(5u, async_seqs[3]);
+    check_mutex_lock_status = true;
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_TOKEN == 1
+static uint8_t token_buf[256];
+static size_t token_len;
+void mytoken(const uint8_t *data, size_t len)
+{
+    memcpy(token_buf, data, len);
+    token_len = len;
+}
+uint32_t mytime(void)
+{
+    return 1234;
+}
+TEST_F(trace, token)
+{
+    static const char fmt[] = "value %d %s %lld";
+    static const char grp[] = "mygr";
+    uint16_t len16;
+    uint32_t u32;
+    uintptr_t addr;
+    int64_t i64;
+
+    mbed_trace_time_function_set(mytime);
+    mbed_trace_token_function_set(mytoken);
+    // stream header is written first
+    ASSERT_EQ(0x01, token_buf[2]);
+    memcpy(&len16, token_buf, 2);
+    ASSERT_EQ(token_len, len16);
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+    // helper conversions take the data to the record
+    ASSERT_EQ(0x01, token_buf[9]);
+    static const uint8_t arr[] = {0xa0, 0xa1, 0xa2};
+    mbed_tracef(TRACE_LEVEL_INFO, grp, "%*pH", 3, arr);
+    ASSERT_EQ(4 + 4 + 2 * sizeof(uintptr_t) + 4 + 1 + 3, token_len);
+    ASSERT_EQ(3, token_buf[8 + 2 * sizeof(uintptr_t) + 4]);
+    ASSERT_TRUE(memcmp(&token_buf[8 + 2 * sizeof(uintptr_t) + 5], arr, 3) == 0);
+#endif
+
+    buf[0] = 0;
+    mbed_tracef(TRACE_LEVEL_INFO, grp, fmt, -5, "abc", (long long)1 << 40);
+    ASSERT_STREQ("", buf); // nothing formatted
+    memcpy(&len16, token_buf, 2);
+    ASSERT_EQ(token_len, len16);
+    ASSERT_EQ(4 + 4 + 2 * sizeof(uintptr_t) + 4 + 4 + 8, token_len);
+    ASSERT_EQ(0x02, token_buf[2]);
+    ASSERT_EQ(TRACE_LEVEL_INFO, token_buf[3]);
+    memcpy(&u32, &token_buf[4], 4);
+    ASSERT_EQ(1234u, u32);
+    memcpy(&addr, &token_buf[8], sizeof(addr));
+    ASSERT_EQ((uintptr_t)fmt, addr);
+    memcpy(&addr, &token_buf[8 + sizeof(addr)], sizeof(addr));
+    ASSERT_EQ((uintptr_t)grp, addr);
+    uint8_t *args = &token_buf[8 + 2 * sizeof(addr)];
+    memcpy(&u32, args, 4);
+    ASSERT_EQ(-5, (int32_t)u32);
+    ASSERT_EQ(3, args[4]);
+    ASSERT_TRUE(memcmp(&args[5], "abc", 3) == 0);
+    memcpy(&i64, &args[8], 8);
+    ASSERT_EQ((int64_t)1 << 40, i64);
+
+    // levels and filters still apply
+    token_len = 0;
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+    mbed_tracef(TRACE_LEVEL_DEBUG, grp, "not stored");
+    ASSERT_EQ(0u, token_len);
+
+    mbed_trace_token_function_set(NULL);
+    mbed_tracef(TRACE_LEVEL_INFO, grp, "text");
+    ASSERT_STREQ("[INFO][mygr]: text", buf);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_THREAD_LOCAL == 1
+TEST_F(trace, thread_local_buffers)
+{
+    static const uint8_t arr[] = {0x01, 0x02};
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "main line");
+    char *str = mbed_trace_array(arr, 2);
+
+    std::thread other([]() {
+        static const uint8_t other_arr[] = {0xaa, 0xbb, 0xcc};
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "other %s", mbed_trace_array(other_arr, 3));
+        ASSERT_STREQ("other aa:bb:cc", mbed_trace_last());
+    });
+    other.join();
+
+    // buffers of this thread were not touched by the other thread
+    ASSERT_STREQ("main line", mbed_trace_last());
+    ASSERT_STREQ("01:02", str);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "%s", str);
+    ASSERT_STREQ("01:02", buf);
+}
+#endif
+
+TEST_F(trace, filters_exact_match)
+{
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    // substrings of a filtered group are not filtered
+    mbed_trace_exclude_filters_set((char *)"mygroup, other");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "test");
+    ASSERT_STREQ("[INFO][mygr]: test", buf);
+    mbed_tracef(TRACE_LEVEL_INFO, "other", "test");
+    ASSERT_STREQ("", mbed_trace_last());
+    ASSERT_STREQ("mygroup, other", mbed_trace_exclude_filters_get());
+
+    mbed_trace_exclude_filters_set(NULL);
+    mbed_trace_include_filters_set((char *)"net*,mac");
+    mbed_tracef(TRACE_LEVEL_INFO, "netw", "in");
+    ASSERT_STREQ("[INFO][netw]: in", buf);
+    mbed_tracef(TRACE_LEVEL_INFO, "ma", "out");
+    ASSERT_STREQ("", mbed_trace_last());
+    mbed_tracef(TRACE_LEVEL_INFO, "mac", "in");
+    ASSERT_STREQ("[INFO][mac ]: in", buf);
+    mbed_tracef(TRACE_LEVEL_INFO, "ne", "out");
+    ASSERT_STREQ("", mbed_trace_last());
+}
+
+TEST_F(trace, filters_long_list)
+{
+    char list[1024] = "";
+    char grp[8];
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    for (int i = 0; i < 150; i++) {
+        sprintf(list + strlen(list), "g%d,", i);
+    }
+    mbed_trace_exclude_filters_set(list);
+    ASSERT_STREQ(list, mbed_trace_exclude_filters_get());
+    for (int i = 0; i < 150; i++) {
+        sprintf(grp, "g%d", i);
+        mbed_tracef(TRACE_LEVEL_INFO, grp, "excluded");
+        ASSERT_STREQ("", mbed_trace_last());
+    }
+    mbed_tracef(TRACE_LEVEL_INFO, "g150", "included");
+    ASSERT_STREQ("[INFO][g150]: included", buf);
+
+    // wildcard alone matches every group
+    mbed_trace_exclude_filters_set((char *)"*");
+    mbed_tracef(TRACE_LEVEL_INFO, "any", "excluded");
+    ASSERT_STREQ("", mbed_trace_last());
+}
+
+#if MBED_CONF_MBED_TRACE_FEA_STATIC_BUFFERS == 1
+TEST_F(trace, static_buffers)
+{
+    char list[MBED_TRACE_FILTER_LIST_LENGTH + 16] = "";
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+
+    // the filter pool is reused when the filters are changed over and over
+    for (int i = 0; i < 10; i++) {
+        mbed_trace_exclude_filters_set((char *)"mygr");
+        mbed_trace_include_filters_set((char *)"mygr,mac");
+        ASSERT_STREQ("mygr", mbed_trace_exclude_filters_get());
+        ASSERT_STREQ("mygr,mac", mbed_trace_include_filters_get());
+    }
+    mbed_tracef(TRACE_LEVEL_INFO, "mac", "included");
+    ASSERT_STREQ("[INFO][mac ]: included", buf);
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+    // every filter has room for a new table while all of them are in use
+    void (*null_sink)(const char *, size_t) = [](const char *, size_t) {};
+    int sinks[8];
+    int sink_count = 0;
+    while (sink_count < 8 && (sinks[sink_count] = mbed_trace_sink_add(null_sink, TRACE_ACTIVE_LEVEL_ALL, "mygr")) >= 0) {
+        sink_count++;
+    }
+    ASSERT_GT(sink_count, 0);
+    mbed_trace_exclude_filters_set((char *)"abc");
+    mbed_trace_include_filters_set((char *)"mygr,mac,abc");
+    ASSERT_STREQ("abc", mbed_trace_exclude_filters_get());
+    ASSERT_STREQ("mygr,mac,abc", mbed_trace_include_filters_get());
+    for (int i = 0; i < sink_count; i++) {
+        ASSERT_EQ(0, mbed_trace_sink_remove(sinks[i]));
+    }
+#endif
+
+    // too long list does not fit to the arena, so the filter is left off
+    while (strlen(list) < MBED_TRACE_FILTER_LIST_LENGTH) {
+        strcat(list, "grp,");
+    }
+    mbed_trace_include_filters_set(list);
+    ASSERT_STREQ("", mbed_trace_include_filters_get());
+    mbed_tracef(TRACE_LEVEL_INFO, "any", "not filtered");
+    ASSERT_STREQ("[INFO][any ]: not filtered", buf);
+
+#if MBED_CONF_MBED_TRACE_FEA_ASYNC == 1
+    ASSERT_EQ(-1, mbed_trace_async_enable(MBED_TRACE_ASYNC_RECORD_COUNT + 1));
+    ASSERT_EQ(0, mbed_trace_async_enable(MBED_TRACE_ASYNC_RECORD_COUNT));
+    ASSERT_EQ(0, mbed_trace_async_enable(0));
+#endif
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    ASSERT_EQ(-1, mbed_trace_history_enable(MBED_TRACE_HISTORY_DEPTH + 1));
+    ASSERT_EQ(0, mbed_trace_history_enable(MBED_TRACE_HISTORY_DEPTH));
+    ASSERT_EQ(0, mbed_trace_history_enable(0));
+#endif
+}
+#endif
+
+TEST_F(trace, group_level)
+{
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+    ASSERT_EQ(TRACE_GROUP_LEVEL_DEFAULT, mbed_trace_group_level_get("mac"));
+    ASSERT_EQ(0, mbed_trace_group_level_set("mac", TRACE_ACTIVE_LEVEL_DEBUG));
+    ASSERT_EQ(0, mbed_trace_group_level_set("mygr", TRACE_ACTIVE_LEVEL_ERROR));
+    ASSERT_EQ(TRACE_ACTIVE_LEVEL_DEBUG, mbed_trace_group_level_get("mac"));
+
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "debug");
+    ASSERT_STREQ("[DBG ][mac ]: debug", buf);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "oth", "debug");
+    ASSERT_STREQ("", mbed_trace_last());
+    mbed_tracef(TRACE_LEVEL_INFO, "oth", "info");
+    ASSERT_STREQ("[INFO][oth ]: info", buf);
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "warn");
+    ASSERT_STREQ("", mbed_trace_last());
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    ASSERT_STREQ("[ERR ][mygr]: error", buf);
+
+    ASSERT_EQ(0, mbed_trace_group_level_set("mac", TRACE_GROUP_LEVEL_DEFAULT));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "debug");
+    ASSERT_STREQ("", mbed_trace_last());
+
+    // group table is limited
+    char grp[8];
+    int i;
+    for (i = 0; i < 100; i++) {
+        sprintf(grp, "g%d", i);
+        if (mbed_trace_group_level_set(grp, TRACE_ACTIVE_LEVEL_ALL) != 0) {
+            break;
+        }
+    }
+    ASSERT_LT(i, 100);
+    ASSERT_EQ(-1, mbed_trace_group_level_set("toolonggroup", TRACE_ACTIVE_LEVEL_ALL));
+}
+
+TEST_F(trace, group_sampling)
+{
+    uint32_t seen = 0, printed = 0;
+    std::string last;
+    int count = 0;
+
+    ASSERT_EQ(-1, mbed_trace_group_sample_stats_get("mac", &seen, &printed));
+    ASSERT_EQ(0, mbed_trace_group_sample_set("mac", TRACE_LEVEL_DEBUG, 10));
+    for (int i = 0; i < 100; i++) {
+        buf[0] = 0;
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "dbg %d", i);
+        if (buf[0]) {
+            last = buf;
+            count++;
+        }
+    }
+    ASSERT_EQ(10, count);
+    ASSERT_EQ("dbg 90", last);
+    ASSERT_EQ(0, mbed_trace_group_sample_stats_get("mac", &seen, &printed));
+    ASSERT_EQ(100u, seen);
+    ASSERT_EQ(10u, printed);
+
+    // other levels and groups are not sampled
+    mbed_tracef(TRACE_LEVEL_INFO, "mac", "info");
+    ASSERT_STREQ("info", buf);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mesh", "mesh");
+    ASSERT_STREQ("mesh", buf);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "dbg");
+    ASSERT_STREQ("dbg", buf);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "dbg2");
+    ASSERT_STREQ("dbg", buf);
+
+    // rate 1 prints all and resets the statistics
+    ASSERT_EQ(0, mbed_trace_group_sample_set("mac", TRACE_LEVEL_DEBUG, 1));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "dbg3");
+    ASSERT_STREQ("dbg3", buf);
+    ASSERT_EQ(0, mbed_trace_group_sample_stats_get("mac", &seen, NULL));
+    ASSERT_EQ(0u, seen);
+    ASSERT_EQ(-1, mbed_trace_group_sample_set("toolonggroup", TRACE_LEVEL_DEBUG, 10));
+}
+
+static int arg_evaluations;
+static int count_evaluation(void)
+{
+    return ++arg_evaluations;
+}
+#define TRACE_GROUP "mac"
+TEST_F(trace, macro_early_out)
+{
+    arg_evaluations = 0;
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+    ASSERT_FALSE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_TRUE(mbed_trace_level_active(TRACE_LEVEL_INFO));
+
+    // arguments are not evaluated for disabled levels
+    tr_debug("%d %s", count_evaluation(), mbed_trace_array((const uint8_t *)"\x01", 1));
+    ASSERT_EQ(0, arg_evaluations);
+    ASSERT_STREQ("", mbed_trace_last());
+    tr_info("%d", count_evaluation());
+    ASSERT_EQ(1, arg_evaluations);
+    ASSERT_STREQ("[INFO][mac ]: 1", mbed_trace_last());
+
+    // filtered groups are skipped before evaluation too
+    mbed_trace_exclude_filters_set((char *)"mac");
+    ASSERT_FALSE(mbed_trace_enabled(TRACE_LEVEL_INFO, "mac"));
+    ASSERT_TRUE(mbed_trace_enabled(TRACE_LEVEL_INFO, "mesh"));
+    tr_info("%d", count_evaluation());
+    ASSERT_EQ(1, arg_evaluations);
+    mbed_trace_exclude_filters_set(NULL);
+
+    // group level raises the summary word
+    ASSERT_EQ(0, mbed_trace_group_level_set("mac", TRACE_ACTIVE_LEVEL_ALL));
+    ASSERT_TRUE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_FALSE(mbed_trace_enabled(TRACE_LEVEL_DEBUG, "mesh"));
+    tr_debug("%d", count_evaluation());
+    ASSERT_EQ(2, arg_evaluations);
+    ASSERT_STREQ("[DBG ][mac ]: 2", mbed_trace_last());
+    ASSERT_EQ(0, mbed_trace_group_level_set("mac", TRACE_GROUP_LEVEL_DEFAULT));
+    ASSERT_FALSE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+}
+
+static uint32_t ratelimit_clock;
+static uint32_t ratelimit_time(void)
+{
+    return ratelimit_clock;
+}
+static std::vector<std::string> ratelimit_lines;
+static void ratelimit_print(const char *str)
+{
+    ratelimit_lines.push_back(str);
+}
+static void ratelimit_site(int i)
+{
+    tr_warn_ratelimited("warn %d %d", i, count_evaluation());
+}
+TEST_F(trace, ratelimit)
+{
+    mbed_trace_print_function_set(ratelimit_print);
+    ratelimit_lines.clear();
+    arg_evaluations = 0;
+
+    // no time function, no limit
+    for (int i = 0; i < 5; i++) {
+        ratelimit_site(i);
+    }
+    ASSERT_EQ(5u, ratelimit_lines.size());
+
+    ratelimit_lines.clear();
+    arg_evaluations = 0;
+    ratelimit_clock = 1000;
+    mbed_trace_time_function_set(ratelimit_time);
+    mbed_trace_ratelimit_set(3, 10);
+    for (int i = 0; i < 10; i++) {
+        ratelimit_site(i);
+    }
+    // suppressed traces are not formatted
+    ASSERT_EQ(3, arg_evaluations);
+    ASSERT_EQ(3u, ratelimit_lines.size());
+    ASSERT_EQ("warn 2 3", ratelimit_lines[2]);
+
+    // one more trace per interval, with the count of suppressed ones
+    ratelimit_clock += 15;
+    ratelimit_site(10);
+    ratelimit_site(11);
+    ASSERT_EQ(5u, ratelimit_lines.size());
+    ASSERT_EQ("7 messages suppressed", ratelimit_lines[3]);
+    ASSERT_EQ("warn 10 4", ratelimit_lines[4]);
+
+    // call sites are limited separately
+    tr_warn_ratelimited("other");
+    ASSERT_EQ("other", ratelimit_lines.back());
+
+    // full burst again after a quiet period
+    ratelimit_lines.clear();
+    ratelimit_clock += 100;
+    for (int i = 0; i < 4; i++) {
+        ratelimit_site(i);
+    }
+    ASSERT_EQ(4u, ratelimit_lines.size());
+    ASSERT_EQ("1 messages suppressed", ratelimit_lines[0]);
+    ASSERT_EQ("warn 2 7", ratelimit_lines[3]);
+
+    // time function wrapping around
+    ratelimit_lines.clear();
+    ratelimit_clock = 0xfffffff8;
+    for (int i = 0; i < 4; i++) {
+        ratelimit_site(i);
+    }
+    ASSERT_EQ(4u, ratelimit_lines.size());
+    ratelimit_clock += 15;
+    ratelimit_site(4);
+    ratelimit_site(5);
+    ASSERT_EQ(6u, ratelimit_lines.size());
+    ASSERT_EQ("1 messages suppressed", ratelimit_lines[4]);
+    ASSERT_EQ("warn 4 11", ratelimit_lines[5]);
+
+    // disabled
+    mbed_trace_ratelimit_set(0, 10);
+    ratelimit_lines.clear();
+    for (int i = 0; i < 5; i++) {
+        ratelimit_site(i);
+    }
+    ASSERT_EQ(5u, ratelimit_lines.size());
+    mbed_trace_time_function_set(NULL);
+}
+#undef TRACE_GROUP
+
+static size_t check_format_size = sizeof(buf);
+static void check_format(const char *fmt, ...)
+{
+    char expected[sizeof(buf)];
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    vsnprintf(expected, check_format_size, fmt, ap);
+    mbed_vtracef(TRACE_LEVEL_DEBUG, "mygr", fmt, ap2);
+    va_end(ap2);
+    va_end(ap);
+    EXPECT_STREQ(expected, buf) << "format: " << fmt;
+}
+TEST_F(trace, fast_format)
+{
+    check_format("plain text");
+    check_format("%d %i %u %x %X %o %c %s %%", -12345, 0, 4000000000u, 0xbeefu, 0xbeefu, 8u, 'z', "str");
+    check_format("%d %d %d", INT32_MIN, INT32_MAX, -1);
+    check_format("%hhd %hhu %hd %hu", 300, 300, 70000, 70000);
+    check_format("%ld %lu %lx", -1234567890L, 4294967295UL, 0xdeadbeefUL);
+    check_format("%lld %llu %llx %llo", (long long)INT64_MIN, (unsigned long long)UINT64_MAX, 0x0123456789abcdefULL, 0777ULL);
+    check_format("%jd %ju %zu %zd %td", (intmax_t) -5, (uintmax_t)5, (size_t)99, (size_t)100, (ptrdiff_t) -7);
+    check_format("[%5d][%-5d][%05d][%+d][% d][%+05d]", 42, 42, 42, 42, 42, -42);
+    check_format("[%.3d][%.0d][%8.3d][%-8.3x][%08.3d][%.0x]", 7, 0, -7, 0xa, 7, 0);
+    check_format("[%#x][%#X][%#o][%#o][%#x][%#.3o][%#08x]", 0x1f, 0x1f, 8, 0, 0, 8, 0x1f);
+    check_format("[%*d][%-*d][%.*d][%*.*s]", 6, 1, 6, 1, 4, 1, 5, 2, "abcdef");
+    check_format("[%*d][%.*s]", -6, 1, -1, "abc");
+    check_format("[%-4s][%4s][%.2s][%10.3s][%c][%-3c][%3c]", "ab", "ab", "abc", "abcdef", 'q', 'q', 'q');
+    check_format("[%s][%.3s][%10s]", (const char *)NULL, (const char *)NULL, (const char *)NULL);
+    check_format("[%f][%.2f][%10.3e][%g][%-8.2G][%+.1f][%a]", 3.14159, 2.5, 12345.678, 0.0001, 1e10, -0.05, 1.0);
+    check_format("[%Lf][%p][%12p]", (long double)1.5, (void *)0x1234, (void *)0xabcd);
+    check_format("%d %f %s %lu %x %.1e", 1, 2.0, "three", 4UL, 5u, 6.0);
+    int written = 0;
+    check_format("abc%n", &written);
+    ASSERT_EQ(3, written);
+    check_format("trailing %");
+}
+TEST_F(trace, fast_format_truncate)
+{
+    mbed_trace_buffer_sizes(16, 128);
+    check_format_size = 16;
+    check_format("%s-%d-%08x", "abcdefgh", 123456, 0xabcu);
+    check_format("%d%d%d%d%d%d", 11111, 22222, 33333, 44444, 55555, 66666);
+    check_format("%20s", "x");
+    check_format("%-20s|", "x");
+    check_format("%.10f|%s", 1.0 / 3, "tail");
+    check_format_size = sizeof(buf);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%d", 123456789);
+    ASSERT_STREQ("[INFO][mygr]: 1", buf);
+}
+
+TEST_F(trace, array_hex_encoding)
+{
+    uint8_t data[100];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 37 + 0x0f);
+    }
+    const int tmp_sizes[] = { 2, 3, 4, 5, 6, 7, 8, 25, 26, 27, 48, 49, 50, 127, 128 };
+    for (size_t t = 0; t < sizeof(tmp_sizes) / sizeof(tmp_sizes[0]); t++) {
+        mbed_trace_buffer_sizes(0, tmp_sizes[t]);
+        for (int len = 1; len <= (int)sizeof(data); len++) {
+            // the output of the original snprintf("%02x:") loop
+            char expected[400] = "";
+            int left = tmp_sizes[t], pos = 0;
+            bool overflow = false;
+            for (int i = 0; i < len; i++) {
+                if (left <= 3) {
+                    overflow = true;
+                    break;
+                }
+                pos += snprintf(expected + pos, left, "%02x:", data[i]);
+                left -= 3;
+            }
+            if (pos > 0) {
+                expected[pos - 1] = overflow ? '*' : 0;
+            }
+            mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "%s", mbed_trace_array(data, len));
+            ASSERT_STREQ(expected, buf) << "tmp " << tmp_sizes[t] << " len " << len;
+        }
+    }
+}
+
+static std::string printv_line;
+static void myprintv(const mbed_trace_iovec_t *iov, int count)
+{
+    printv_line.clear();
+    for (int i = 0; i < count; i++) {
+        printv_line.append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+static void check_printv(uint8_t dlevel, const char *fmt, ...)
+{
+    va_list ap, ap2;
+    va_start(ap, fmt);
+    va_copy(ap2, ap);
+    mbed_trace_printv_function_set(NULL);
+    mbed_vtracef(dlevel, "mygr", fmt, ap);
+    std::string expected = std::string(buf) + "\n";
+    size_t expected_time_length = time_length;
+    mbed_trace_printv_function_set(myprintv);
+    mbed_vtracef(dlevel, "mygr", fmt, ap2);
+    mbed_trace_printv_function_set(NULL);
+    va_end(ap2);
+    va_end(ap);
+    EXPECT_EQ(expected, printv_line) << "format: " << fmt;
+    EXPECT_STREQ(buf, mbed_trace_last()) << "format: " << fmt;
+    EXPECT_EQ(expected_time_length, time_length) << "format: " << fmt;
+}
+TEST_F(trace, printv)
+{
+    const uint8_t configs[] = {
+        TRACE_MODE_PLAIN,
+        0,
+        TRACE_MODE_COLOR,
+        TRACE_MODE_COLOR | TRACE_CARRIAGE_RETURN
+    };
+    for (size_t i = 0; i < sizeof(configs); i++) {
+        mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | configs[i]);
+        mbed_trace_prefix_function_set(i & 1 ? &trace_prefix : NULL);
+        mbed_trace_suffix_function_set(i & 1 ? &trace_suffix : NULL);
+        check_printv(TRACE_LEVEL_DEBUG, "plain");
+        check_printv(TRACE_LEVEL_INFO, "rx len=%d from %s seq=%u crc=0x%08x", 12, "node", 7u, 0xabcu);
+        check_printv(TRACE_LEVEL_WARN, "%s%s%d%%%5.2f|%-6s|%c", "a", "b", -3, 2.5, "pad", 'x');
+        check_printv(TRACE_LEVEL_ERROR, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d",
+                     1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20);
+        check_printv(TRACE_LEVEL_CMD, "cmd %s", "line");
+        check_printv(TRACE_LEVEL_INFO, "%s", mbed_trace_array((const uint8_t *)"\x01\x02", 2));
+    }
+    mbed_trace_prefix_function_set(NULL);
+    mbed_trace_suffix_function_set(NULL);
+
+    // strings are not copied, so they are not limited by the line length
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_buffer_sizes(32, 32);
+    mbed_trace_printv_function_set(myprintv);
+    std::string big(100, 'x');
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "big %s %d", big.c_str(), 1);
+    ASSERT_EQ("[INFO][mygr]: big " + big + " 1\n", printv_line);
+    // the line buffer gets as much of the line as fits
+    ASSERT_EQ(("[INFO][mygr]: big " + big).substr(0, 31), mbed_trace_last());
+    mbed_trace_printv_function_set(NULL);
+}
+
+static std::string printn_line;
+static int printn_calls;
+static void myprintn(const char *str, size_t len)
+{
+    ASSERT_EQ(len, strlen(str));
+    printn_line.assign(str, len);
+    printn_calls++;
+}
+TEST_F(trace, printn)
+{
+    printn_calls = 0;
+    mbed_trace_printn_function_set(myprintn);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "hello %d", 1);
+    ASSERT_EQ("hello 1\n", printn_line);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_COLOR);
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "hello");
+    ASSERT_EQ("\x1b[31m[ERR ][mygr]: hello\x1b[0m\n", printn_line);
+
+    // cut by the line length
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_buffer_sizes(20, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "0123456789");
+    ASSERT_EQ("[INFO][mygr]: 01234\n", printn_line);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "0123456789012345678901234");
+    ASSERT_EQ("0123456789012345678\n", printn_line);
+
+    // command line output in one call
+    mbed_trace_cmdprintn_function_set(myprintn);
+    printn_calls = 0;
+    mbed_tracef(TRACE_LEVEL_CMD, "mygr", "cmd");
+    ASSERT_EQ("cmd\n", printn_line);
+    ASSERT_EQ(1, printn_calls);
+
+    // the old functions replace the new ones
+    mbed_trace_print_function_set(myprint);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "old");
+    ASSERT_STREQ("old", buf);
+    ASSERT_EQ(1, printn_calls);
+    mbed_trace_print_function_set(NULL);
+    mbed_tracef(TRACE_LEVEL_CMD, "mygr", "cmd2");
+    ASSERT_EQ(1, printn_calls);
+}
+
+static std::string coalesce_out;
+static void mycoalesceprint(const char *str, size_t len)
+{
+    coalesce_out.append(str, len);
+}
+static uint32_t coalesce_clock;
+static uint32_t coalesce_time(void)
+{
+    return coalesce_clock;
+}
+static char coalesce_prefix_buf[16];
+static char *coalesce_prefix(size_t)
+{
+    snprintf(coalesce_prefix_buf, sizeof(coalesce_prefix_buf), "%u ", (unsigned)++coalesce_clock);
+    return coalesce_prefix_buf;
+}
+TEST_F(trace, coalesce)
+{
+    coalesce_out.clear();
+    mbed_trace_printn_function_set(mycoalesceprint);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_coalesce_set(true, 0);
+    for (int i = 0; i < 4; i++) {
+        mbed_tracef(TRACE_LEVEL_INFO, "mygr", "retry %d", 1);
+    }
+    ASSERT_EQ("[INFO][mygr]: retry 1\n", coalesce_out);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "retry %d", 2);
+    ASSERT_EQ("[INFO][mygr]: retry 1\n"
+              "[INFO][mygr]: last message repeated 3 times\n"
+              "[INFO][mygr]: retry 2\n", coalesce_out);
+
+    // level and group are compared, the prefix is not
+    coalesce_out.clear();
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "retry 2");
+    mbed_tracef(TRACE_LEVEL_WARN, "gr2", "retry 2");
+    ASSERT_EQ("[WARN][mygr]: retry 2\n[WARN][gr2 ]: retry 2\n", coalesce_out);
+    coalesce_out.clear();
+    coalesce_clock = 0;
+    mbed_trace_prefix_function_set(coalesce_prefix);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "poll");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "poll");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "poll");
+    mbed_trace_prefix_function_set(NULL);
+    ASSERT_EQ("1 [INFO][mygr]: poll\n", coalesce_out);
+
+    // flush prints the pending count
+    mbed_trace_flush();
+    ASSERT_EQ("1 [INFO][mygr]: poll\n[INFO][mygr]: last message repeated 2 times\n", coalesce_out);
+    coalesce_out.clear();
+    mbed_trace_flush();
+    ASSERT_EQ("", coalesce_out);
+
+    // long runs are reported every timeout
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_trace_time_function_set(coalesce_time);
+    mbed_trace_coalesce_set(true, 10);
+    coalesce_clock = 0;
+    for (int i = 0; i < 25; i++) {
+        mbed_tracef(TRACE_LEVEL_INFO, "mygr", "tick");
+        coalesce_clock++;
+    }
+    ASSERT_EQ("tick\nlast message repeated 11 times\nlast message repeated 11 times\n", coalesce_out);
+    mbed_trace_time_function_set(NULL);
+
+    // disabling prints the pending count
+    coalesce_out.clear();
+    mbed_trace_coalesce_set(false, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "tick");
+    ASSERT_EQ("last message repeated 2 times\ntick\n", coalesce_out);
+
+    // the group is kept, the caller's buffer may be reused before the count is printed
+    char grp[8];
+    coalesce_out.clear();
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_coalesce_set(true, 0);
+    strcpy(grp, "radio");
+    mbed_tracef(TRACE_LEVEL_INFO, grp, "busy");
+    mbed_tracef(TRACE_LEVEL_INFO, grp, "busy");
+    strcpy(grp, "xxxxxxx");
+    mbed_trace_flush();
+    ASSERT_EQ("[INFO][radio]: busy\n[INFO][radio]: last message repeated 1 times\n", coalesce_out);
+}
+
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+static uint32_t stats_clock_value;
+static uint32_t stats_clock(void)
+{
+    return stats_clock_value;
+}
+static void stats_print(const char *str)
+{
+    myprint(str);
+    stats_clock_value += 5;
+}
+TEST_F(trace, stats)
+{
+    static const uint8_t arr[100] = {0};
+    mbed_trace_stats_t stats;
+    mbed_trace_clock_function_set(stats_clock);
+    mbed_trace_print_function_set(stats_print);
+    mbed_trace_group_level_set("mac", TRACE_ACTIVE_LEVEL_INFO);
+    mbed_trace_exclude_filters_set((char *)"flt");
+
+    mbed_tracef(TRACE_LEVEL_INFO, "mac", "hello");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "world");
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "masked");
+    mbed_tracef(TRACE_LEVEL_INFO, "flt", "filtered");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%s", mbed_trace_array(arr, sizeof(arr)));
+
+    mbed_trace_stats_get(TRACE_LEVEL_INFO, &stats);
+    ASSERT_EQ(3u, stats.emitted);
+    ASSERT_EQ(1u, stats.filtered);
+    ASSERT_EQ(0u, stats.masked);
+    ASSERT_EQ(0u, stats.truncated);
+    ASSERT_EQ(1u, stats.array_overflows);
+    ASSERT_EQ(12u + strlen(buf) + 1, stats.bytes);
+    ASSERT_EQ(15u, stats.output_time);
+
+    // group statistics are kept for groups with their own settings
+    ASSERT_EQ(0, mbed_trace_group_stats_get("mac", &stats));
+    ASSERT_EQ(1u, stats.emitted);
+    ASSERT_EQ(1u, stats.masked);
+    ASSERT_EQ(6u, stats.bytes);
+    ASSERT_EQ(-1, mbed_trace_group_stats_get("mygr", &stats));
+
+    mbed_trace_buffer_sizes(16, 0);
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "a line longer than the buffer");
+    mbed_trace_stats_get(TRACE_ACTIVE_LEVEL_ALL, &stats);
+    ASSERT_EQ(4u, stats.emitted);
+    ASSERT_EQ(1u, stats.masked);
+    ASSERT_EQ(1u, stats.truncated);
+
+    mbed_trace_stats_reset();
+    mbed_trace_stats_get(TRACE_ACTIVE_LEVEL_ALL, &stats);
+    ASSERT_EQ(0u, stats.emitted + stats.filtered + stats.masked + stats.truncated + stats.array_overflows);
+    ASSERT_EQ(0, mbed_trace_group_stats_get("mac", &stats));
+    ASSERT_EQ(0u, stats.emitted);
+}
+#define TRACE_GROUP "flt"
+TEST_F(trace, stats_macros)
+{
+    mbed_trace_stats_t stats;
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+
+    // the macros leave these out before mbed_tracef() is called
+    tr_debug("masked");
+    mbed_trace_exclude_filters_set((char *)"flt");
+    tr_info("filtered");
+    mbed_trace_stats_get(TRACE_ACTIVE_LEVEL_ALL, &stats);
+    ASSERT_EQ(0u, stats.emitted);
+    ASSERT_EQ(1u, stats.masked);
+    ASSERT_EQ(1u, stats.filtered);
+    mbed_trace_stats_get(TRACE_LEVEL_DEBUG, &stats);
+    ASSERT_EQ(1u, stats.masked);
+
+    mbed_trace_exclude_filters_set(NULL);
+    tr_info("hello");
+    ASSERT_STREQ("[INFO][flt ]: hello", buf);
+    mbed_trace_stats_get(TRACE_LEVEL_INFO, &stats);
+    ASSERT_EQ(1u, stats.emitted);
+    ASSERT_EQ(1u, stats.filtered);
+}
+#undef TRACE_GROUP
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_LATENCY == 1
+static uint32_t latency_clock_value;
+static uint32_t latency_clock(void)
+{
+    return latency_clock_value;
+}
+static void latency_slow_print(const char *str)
+{
+    myprint(str);
+    latency_clock_value += strstr(str, "long") ? 1000 : 10;
+}
+static char *latency_prefix(size_t)
+{
+    latency_clock_value += 3;
+    return (char *)"";
+}
+TEST_F(trace, latency)
+{
+    mbed_trace_latency_t latency;
+    char text[512];
+    mbed_trace_clock_function_set(latency_clock);
+    mbed_trace_print_function_set(latency_slow_print);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_prefix_function_set(latency_prefix);
+    mbed_trace_latency_reset();
+
+    for (int i = 0; i < 99; i++) {
+        mbed_tracef(TRACE_LEVEL_INFO, "mygr", "a");
+    }
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "long line");
+
+    mbed_trace_latency_get(TRACE_LATENCY_OUTPUT, &latency);
+    ASSERT_EQ(100u, latency.count);
+    ASSERT_EQ(1000u, latency.max);
+    // 10 is in the bucket of 10...11
+    ASSERT_EQ(11u, mbed_trace_latency_quantile(&latency, 500));
+    ASSERT_EQ(11u, mbed_trace_latency_quantile(&latency, 990));
+    // the bucket of 1000 is 896...1023, cut to the max
+    ASSERT_EQ(1000u, mbed_trace_latency_quantile(&latency, 1000));
+
+    mbed_trace_latency_get(TRACE_LATENCY_PREFIX, &latency);
+    ASSERT_EQ(100u, latency.count);
+    ASSERT_EQ(3u, latency.max);
+    mbed_trace_latency_get(TRACE_LATENCY_FORMAT, &latency);
+    ASSERT_EQ(100u, latency.count);
+    ASSERT_EQ(3u, mbed_trace_latency_quantile(&latency, 500));
+
+    ASSERT_GT(mbed_trace_latency_dump(text, sizeof(text)), 0);
+    ASSERT_TRUE(strstr(text, "output: count 100 p50 11 p90 11 p99 11 p999 1000 max 1000\n") != NULL);
+    ASSERT_EQ(9, mbed_trace_latency_dump(text, 10));
+    ASSERT_STREQ("lock: cou", text);
+
+    mbed_trace_latency_reset();
+    mbed_trace_latency_get(TRACE_LATENCY_OUTPUT, &latency);
+    ASSERT_EQ(0u, latency.count);
+    ASSERT_EQ(0u, mbed_trace_latency_quantile(&latency, 990));
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+TEST_F(trace, timestamp)
+{
+    unsigned sec, ms;
+    char text[32];
+    ASSERT_EQ(-1, mbed_trace_timestamp_set(3));
+    ASSERT_EQ(0, mbed_trace_timestamp_set(TRACE_TIMESTAMP_MONOTONIC));
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_EQ(3, sscanf(buf, "[%u.%3u] %31[^\n]", &sec, &ms, text));
+    ASSERT_STREQ("[INFO][mygr]: hello", text);
+
+    // after the prefix, also in the scatter output
+    mbed_trace_prefix_function_set(&trace_prefix);
+    mbed_trace_printv_function_set(myprintv);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_EQ(3, sscanf(printv_line.c_str(), "[<TIME>][%u.%3u] %31[^\n]", &sec, &ms, text));
+    ASSERT_STREQ("[INFO][mygr]: hello", text);
+    mbed_trace_printv_function_set(NULL);
+    mbed_trace_prefix_function_set(NULL);
+
+    ASSERT_EQ(0, mbed_trace_timestamp_set(TRACE_TIMESTAMP_REALTIME));
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_EQ('[', buf[0]);
+    ASSERT_EQ('T', buf[11]);
+    ASSERT_TRUE(strstr(buf, "Z] [INFO][mygr]: hello") == buf + 24);
+
+    // plain and cmd lines are not stamped
+    mbed_tracef(TRACE_LEVEL_CMD, "mygr", "cmd");
+    ASSERT_STREQ("cmd", buf);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_STREQ("hello", buf);
+
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    ASSERT_EQ(0, mbed_trace_timestamp_set(TRACE_TIMESTAMP_NONE));
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_STREQ("[INFO][mygr]: hello", buf);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_STRUCTURED == 1
+static uint32_t structured_time(void)
+{
+    return 1234;
+}
+TEST_F(trace, structured)
+{
+    ASSERT_EQ(-1, mbed_trace_format_set(3));
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_JSON));
+    // color and prefix are left out
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_COLOR);
+    mbed_trace_prefix_function_set(&trace_prefix);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello %d", 1);
+    ASSERT_STREQ("{\"seq\":0,\"level\":\"info\",\"group\":\"mygr\",\"msg\":\"hello 1\"}", buf);
+    mbed_trace_prefix_function_set(NULL);
+
+    mbed_trace_time_function_set(structured_time);
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "say \"hi\"\\\n\t%c", 1);
+    ASSERT_STREQ("{\"seq\":1,\"time\":1234,\"level\":\"error\",\"group\":\"mygr\",\"msg\":\"say \\\"hi\\\"\\\\\\n\\t\\u0001\"}", buf);
+
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_LOGFMT));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "a \"b\"");
+    ASSERT_STREQ("seq=2 time=1234 level=debug group=mygr msg=\"a \\\"b\\\"\"", buf);
+
+    // cut at a character boundary, not in the middle of an escape
+    mbed_trace_buffer_sizes(60, 0);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "a\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"\"");
+    ASSERT_STREQ("seq=3 time=1234 level=debug group=mygr msg=\"a\\\"\\\"\\\"\\\"\\\"\\\"\"", buf);
+    mbed_trace_buffer_sizes(1024, 0);
+
+    // the scatter output gets the same line
+    mbed_trace_printv_function_set(myprintv);
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "x");
+    ASSERT_EQ("seq=4 time=1234 level=warn group=mygr msg=\"x\"\n", printv_line);
+    mbed_trace_printv_function_set(NULL);
+
+#if MBED_CONF_MBED_TRACE_FEA_TIMESTAMP == 1
+    unsigned sec, ms;
+    mbed_trace_timestamp_set(TRACE_TIMESTAMP_MONOTONIC);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "x");
+    ASSERT_EQ(2, sscanf(buf, "seq=5 time=%u.%3u level=info", &sec, &ms));
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_JSON));
+    mbed_trace_timestamp_set(TRACE_TIMESTAMP_REALTIME);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "x");
+    ASSERT_TRUE(strncmp(buf, "{\"seq\":6,\"time\":\"", 17) == 0);
+    ASSERT_TRUE(strstr(buf, "Z\",\"level\":\"info\"") != NULL);
+    mbed_trace_timestamp_set(TRACE_TIMESTAMP_NONE);
+#endif
+
+    // plain and cmd lines are not affected
+    mbed_tracef(TRACE_LEVEL_CMD, "mygr", "cmd \"x\"");
+    ASSERT_STREQ("cmd \"x\"", buf);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello");
+    ASSERT_STREQ("hello", buf);
+
+    // group names are escaped as the message, and quoted in logfmt when needed
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_JSON));
+    mbed_tracef(TRACE_LEVEL_INFO, "a\"b\\c\n", "x");
+    ASSERT_TRUE(strstr(buf, ",\"group\":\"a\\\"b\\\\c\\n\",\"msg\":\"x\"}") != NULL);
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_LOGFMT));
+    mbed_tracef(TRACE_LEVEL_INFO, "my gr", "x");
+    ASSERT_TRUE(strstr(buf, " group=\"my gr\" msg=\"x\"") != NULL);
+    mbed_tracef(TRACE_LEVEL_INFO, "a=\"", "x");
+    ASSERT_TRUE(strstr(buf, " group=\"a=\\\"\" msg=\"x\"") != NULL);
+    ASSERT_EQ(0, mbed_trace_format_set(TRACE_FORMAT_TEXT));
+    mbed_trace_time_function_set(NULL);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_SINKS == 1
+static std::string sink_out[3];
+static void sink0(const char *str, size_t len)
+{
+    sink_out[0].append(str, len);
+}
+static void sink1(const char *str, size_t len)
+{
+    sink_out[1].append(str, len);
+}
+static void sink2(const char *str, size_t len)
+{
+    sink_out[2].append(str, len);
+}
+static int sink_formats;
+static char *sink_prefix(size_t)
+{
+    sink_formats++;
+    return (char *)"";
+}
+TEST_F(trace, sinks)
+{
+    for (int i = 0; i < 3; i++) {
+        sink_out[i].clear();
+    }
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_prefix_function_set(sink_prefix);
+    ASSERT_EQ(-1, mbed_trace_sink_add(NULL, TRACE_ACTIVE_LEVEL_ALL, NULL));
+    ASSERT_EQ(0, mbed_trace_sink_add(sink0, TRACE_ACTIVE_LEVEL_ALL, NULL));
+    ASSERT_EQ(1, mbed_trace_sink_add(sink1, TRACE_ACTIVE_LEVEL_INFO, NULL));
+    ASSERT_EQ(2, mbed_trace_sink_add(sink2, TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN, "mygr,net*"));
+
+    // sinks 0 and 1 share one decorated line, the print function formats its own
+    sink_formats = 0;
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "hello %d", 1);
+    ASSERT_EQ(2, sink_formats);
+    ASSERT_STREQ("[INFO][mygr]: hello 1", buf);
+    ASSERT_EQ("[INFO][mygr]: hello 1\n", sink_out[0]);
+    ASSERT_EQ("[INFO][mygr]: hello 1\n", sink_out[1]);
+    ASSERT_EQ("hello 1\n", sink_out[2]);
+
+    // per sink levels and groups
+    mbed_tracef(TRACE_LEVEL_DEBUG, "netw", "dbg");
+    mbed_tracef(TRACE_LEVEL_WARN, "abc", "warn");
+    ASSERT_EQ("[INFO][mygr]: hello 1\n[DBG ][netw]: dbg\n[WARN][abc ]: warn\n", sink_out[0]);
+    ASSERT_EQ("[INFO][mygr]: hello 1\n[WARN][abc ]: warn\n", sink_out[1]);
+    ASSERT_EQ("hello 1\ndbg\n", sink_out[2]);
+
+    // without the print function, nothing is formatted for a line no sink wants
+    mbed_trace_printn_function_set(NULL);
+    ASSERT_EQ(0, mbed_trace_sink_remove(0));
+    ASSERT_EQ(-1, mbed_trace_sink_remove(0));
+    sink_formats = 0;
+    mbed_tracef(TRACE_LEVEL_DEBUG, "abc", "skipped");
+    ASSERT_EQ(0, sink_formats);
+    mbed_tracef(TRACE_LEVEL_ERROR, "abc", "err");
+    ASSERT_EQ(1, sink_formats);
+    ASSERT_EQ("[INFO][mygr]: hello 1\n[WARN][abc ]: warn\n[ERR ][abc ]: err\n", sink_out[1]);
+    ASSERT_EQ("hello 1\ndbg\n", sink_out[2]);
+
+    // free slots are reused
+    ASSERT_EQ(0, mbed_trace_sink_add(sink0, TRACE_ACTIVE_LEVEL_ALL, NULL));
+    ASSERT_EQ(3, mbed_trace_sink_add(sink0, TRACE_ACTIVE_LEVEL_ALL, NULL));
+    ASSERT_EQ(-1, mbed_trace_sink_add(sink0, TRACE_ACTIVE_LEVEL_ALL, NULL));
+}
+TEST_F(trace, sinks_levels)
+{
+    for (int i = 0; i < 2; i++) {
+        sink_out[i].clear();
+    }
+    // a sink gets the levels it wants, also when they are not active globally
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_WARN | TRACE_MODE_PLAIN);
+    ASSERT_EQ(0, mbed_trace_sink_add(sink0, TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN, NULL));
+    ASSERT_EQ(1, mbed_trace_sink_add(sink1, TRACE_ACTIVE_LEVEL_WARN | TRACE_MODE_PLAIN, NULL));
+    ASSERT_TRUE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_TRUE(mbed_trace_enabled(TRACE_LEVEL_DEBUG, "mac"));
+    buf[0] = 0;
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "debug");
+    mbed_tracef(TRACE_LEVEL_WARN, "mac", "warn");
+    ASSERT_EQ("debug\nwarn\n", sink_out[0]);
+    ASSERT_EQ("warn\n", sink_out[1]);
+    ASSERT_STREQ("warn", buf);
+
+    // removing the sink makes the level inactive again
+    ASSERT_EQ(0, mbed_trace_sink_remove(0));
+    ASSERT_FALSE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_FALSE(mbed_trace_enabled(TRACE_LEVEL_DEBUG, "mac"));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mac", "not printed");
+    ASSERT_EQ("debug\nwarn\n", sink_out[0]);
+    ASSERT_EQ("warn\n", sink_out[1]);
+}
+#if MBED_CONF_MBED_TRACE_FEA_STATS == 1
+static uint32_t sink_clock_value;
+static uint32_t sink_clock(void)
+{
+    return sink_clock_value;
+}
+static void sink_slow(const char *str, size_t len)
+{
+    sink0(str, len);
+    sink_clock_value += 5;
+}
+TEST_F(trace, sinks_stats)
+{
+    mbed_trace_stats_t stats;
+    sink_out[0].clear();
+    sink_clock_value = 0;
+    mbed_trace_clock_function_set(sink_clock);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    ASSERT_EQ(0, mbed_trace_sink_add(sink_slow, TRACE_ACTIVE_LEVEL_ALL, NULL));
+    ASSERT_EQ(1, mbed_trace_sink_add(sink_slow, TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN, NULL));
+
+    // one trace printed and cut in all outputs is counted once, bytes and time per write
+    mbed_trace_buffer_sizes(16, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "a line longer than the buffer");
+    ASSERT_STREQ("a line longer t", buf);
+    mbed_trace_stats_get(TRACE_ACTIVE_LEVEL_ALL, &stats);
+    ASSERT_EQ(1u, stats.emitted);
+    ASSERT_EQ(1u, stats.truncated);
+    ASSERT_EQ(sink_out[0].size() + strlen(buf) + 1, stats.bytes);
+    ASSERT_EQ(10u, stats.output_time);
+
+    // a line only the sinks print is emitted too
+    mbed_trace_buffer_sizes(32, 0);
+    mbed_trace_print_function_set(NULL);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "short");
+    mbed_trace_stats_get(TRACE_ACTIVE_LEVEL_ALL, &stats);
+    ASSERT_EQ(2u, stats.emitted);
+    ASSERT_EQ(1u, stats.truncated);
+    ASSERT_EQ(20u, stats.output_time);
+    mbed_trace_clock_function_set(NULL);
+}
+#endif
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_BATCH == 1
+static std::string batch_out;
+static std::vector<const char *> batch_ptrs;
+static uint32_t batch_clock;
+static void mybatch(const char *data, size_t len)
+{
+    batch_out.append(data, len);
+    batch_ptrs.push_back(data);
+}
+static uint32_t mybatch_time(void)
+{
+    return batch_clock;
+}
+TEST_F(trace, batch)
+{
+    batch_out.clear();
+    batch_ptrs.clear();
+    ASSERT_EQ(0, mbed_trace_batch_enable(mybatch, 32));
+
+    // full buffers are written out
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "0123456789");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "abcdefghij");
+    ASSERT_EQ("", batch_out);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "ABCDEFGHIJ");
+    ASSERT_EQ("0123456789\nabcdefghij\n", batch_out);
+    mbed_trace_flush();
+    ASSERT_EQ("0123456789\nabcdefghij\nABCDEFGHIJ\n", batch_out);
+    // the two buffers take turns
+    ASSERT_EQ(2u, batch_ptrs.size());
+    ASSERT_NE(batch_ptrs[0], batch_ptrs[1]);
+
+    // errors are written right away
+    batch_out.clear();
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "info");
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    ASSERT_EQ("info\nerror\n", batch_out);
+
+    // line count, byte and age thresholds
+    batch_out.clear();
+    mbed_trace_batch_thresholds_set(0, 2, 0, 0);
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "1");
+    ASSERT_EQ("", batch_out);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "2");
+    ASSERT_EQ("1\n2\n", batch_out);
+    batch_out.clear();
+    mbed_trace_batch_thresholds_set(6, 0, 0, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "ab");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "cd");
+    ASSERT_EQ("ab\ncd\n", batch_out);
+    batch_out.clear();
+    batch_clock = 100;
+    mbed_trace_time_function_set(mybatch_time);
+    mbed_trace_batch_thresholds_set(0, 0, 10, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "t0");
+    batch_clock = 105;
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "t5");
+    ASSERT_EQ("", batch_out);
+    batch_clock = 110;
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "t10");
+    ASSERT_EQ("t0\nt5\nt10\n", batch_out);
+    mbed_trace_time_function_set(NULL);
+
+    // lines longer than the buffer are split
+    batch_out.clear();
+    std::string big(80, 'x');
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%s", big.c_str());
+    mbed_trace_flush();
+    ASSERT_EQ(big + "\n", batch_out);
+
+    // disabling writes out the rest
+    batch_out.clear();
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "last");
+    ASSERT_EQ(0, mbed_trace_batch_enable(NULL, 0));
+    ASSERT_EQ("last\n", batch_out);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "direct");
+    ASSERT_STREQ("direct", buf);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_RECORDER == 1
+// same as tools/mbed_trace_recorder.py
+static std::string recorder_read(const uint32_t *region)
+{
+    const char *data = (const char *)(region + 8);
+    uint32_t size = region[2], cursor = region[3], wraps = region[4];
+    if (!wraps) {
+        return std::string(data, cursor);
+    }
+    std::string all = std::string(data + cursor, size - cursor) + std::string(data, cursor);
+    return all.substr(all.find('\n') + 1);
+}
+// complete lines within the last size bytes
+static std::string recorder_tail(const std::string &lines, size_t size)
+{
+    std::string tail = lines.substr(lines.size() - size);
+    return tail.substr(tail.find('\n') + 1);
+}
+TEST_F(trace, recorder)
+{
+    static uint32_t region[(32 + 64) / 4];
+    memset(region, 0xff, sizeof(region));
+    ASSERT_EQ(-1, mbed_trace_recorder_init((char *)region + 1, sizeof(region) - 4));
+    ASSERT_EQ(-1, mbed_trace_recorder_init(region, sizeof(region) - 4));
+    ASSERT_EQ(0, mbed_trace_recorder_init(region, sizeof(region)));
+    mbed_trace_printn_function_set(mbed_trace_recorder_printn);
+
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "line 1");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "line 2");
+    ASSERT_EQ("line 1\nline 2\n", recorder_read(region));
+
+    // wrap around, the oldest lines are overwritten
+    std::string expected;
+    for (int i = 0; i < 20; i++) {
+        mbed_tracef(TRACE_LEVEL_INFO, "mygr", "line %d", 10 + i);
+        expected += "line " + std::to_string(10 + i) + "\n";
+    }
+    ASSERT_EQ(recorder_tail(expected, 64), recorder_read(region));
+    ASSERT_GT(region[4], 0u);
+
+    // the content survives, new lines are appended after it
+    mbed_trace_recorder_init(NULL, 0);
+    ASSERT_EQ(0, mbed_trace_recorder_init(region, sizeof(region)));
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "after");
+    expected += "after\n";
+    ASSERT_EQ(recorder_tail(expected, 64), recorder_read(region));
+
+    // a line longer than the region keeps its end, which is not a complete line
+    std::string big(100, 'x');
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%s", big.c_str());
+    ASSERT_EQ(0, memcmp((const char *)(region + 8) + region[3], (big.substr(37) + "\n").c_str(), 64 - region[3]));
+    ASSERT_EQ("", recorder_read(region));
+    mbed_trace_recorder_init(NULL, 0);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+static std::string history_out;
+static void myhistoryprint(const char *str, size_t len)
+{
+    history_out.append(str, len);
+}
+TEST_F(trace, history)
+{
+    history_out.clear();
+    mbed_trace_printn_function_set(myhistoryprint);
+    mbed_trace_config_set(TRACE_MODE_PLAIN | TRACE_ACTIVE_LEVEL_INFO);
+    ASSERT_FALSE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_EQ(0, mbed_trace_history_enable(3));
+
+    // debug traces are stored also when not active, and printed before errors
+    ASSERT_TRUE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    ASSERT_TRUE(mbed_trace_enabled(TRACE_LEVEL_DEBUG, "mac"));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "dbg %d %s", 1, "one");
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "info");
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "warn");
+    ASSERT_EQ("info\nwarn\n", history_out);
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    ASSERT_EQ("info\nwarn\ndbg 1 one\nerror\n", history_out);
+
+    // the latest records are kept, and printed only once
+    history_out.clear();
+    for (int i = 0; i < 5; i++) {
+        mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "dbg %d", i);
+    }
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    ASSERT_EQ("dbg 2\ndbg 3\ndbg 4\nerror\nerror\n", history_out);
+
+    // stored arguments give the same text as direct formatting
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO);
+    history_out.clear();
+    mbed_tracef(TRACE_LEVEL_DEBUG, "grp", "%5d|%-*s|%.*s|%lu|%lld|%zu|%.2f|%c|%x|100%%",
+                42, 4, "ab", 2, "xyz", 7ul, -8ll, (size_t)9, 1.5, 'z', 255);
+    mbed_trace_history_dump();
+    ASSERT_EQ("[DBG ][grp ]:    42|ab  |xy|7|-8|9|1.50|z|ff|100%\n", history_out);
+
+    // arguments not fitting to a record are left out
+    history_out.clear();
+    std::string long_str(200, 'a');
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "x=%d s=%s end", 5, long_str.c_str());
+    mbed_trace_history_dump();
+    ASSERT_EQ("[DBG ][mygr]: x=5 s=\n", history_out);
+
+    // configurable levels
+    mbed_trace_config_set(TRACE_MODE_PLAIN | TRACE_ACTIVE_LEVEL_ALL);
+    mbed_trace_history_levels_set(TRACE_LEVEL_DEBUG | TRACE_LEVEL_INFO, TRACE_LEVEL_WARN);
+    history_out.clear();
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "info");
+    mbed_tracef(TRACE_LEVEL_CMD, "mygr", "cmd");
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    mbed_tracef(TRACE_LEVEL_WARN, "mygr", "warn");
+    ASSERT_EQ("cmd\nerror\ninfo\nwarn\n", history_out);
+
+    // disabled history drops the records
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "dropped");
+    ASSERT_EQ(0, mbed_trace_history_enable(0));
+    mbed_trace_config_set(TRACE_MODE_PLAIN | TRACE_ACTIVE_LEVEL_INFO);
+    ASSERT_FALSE(mbed_trace_level_active(TRACE_LEVEL_DEBUG));
+    history_out.clear();
+    mbed_tracef(TRACE_LEVEL_ERROR, "mygr", "error");
+    ASSERT_EQ("error\n", history_out);
+}
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_FORMAT_EXT == 1
+TEST_F(trace, format_ext)
+{
+    uint8_t arr[20];
+    for (int i = 0; i < 20; i++) {
+        arr[i] = 0xa0 + i;
+    }
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL | TRACE_MODE_PLAIN);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "arr %*pH end", 3, arr);
+    ASSERT_STREQ("arr a0:a1:a2 end", buf);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "[%*pH|%*pH]", 0, arr, 2, nullptr);
+    ASSERT_STREQ("[|<null>]", buf);
+
+    // %p followed by other letters is a plain pointer
+    char expected_ptr[64];
+    snprintf(expected_ptr, sizeof(expected_ptr), "ptr=%pXY %pI4 %p", (void *)arr, (void *)arr, (void *)arr);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "ptr=%pXY %pI4 %p", (void *)arr, (void *)arr, (void *)arr);
+    ASSERT_STREQ(expected_ptr, buf);
+
+    // same text as the helper function, also in the scatter output
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%s", mbed_trace_array(arr, 20));
+    std::string expected = buf;
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%*pH", 20, arr);
+    ASSERT_EQ(expected, buf);
+    mbed_trace_printv_function_set(myprintv);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%*pH", 20, arr);
+    ASSERT_EQ(expected + "\n", printv_line);
+    mbed_trace_printv_function_set(NULL);
+
+    // the C library does not know the helper conversions, a format which needs it is printed as such
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%lc %*pH", (wint_t)'a', 3, arr);
+    ASSERT_STREQ("%lc %*pH", buf);
+    mbed_trace_printv_function_set(myprintv);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%lc %*pH", (wint_t)'a', 3, arr);
+    ASSERT_EQ("%lc %*pH\n", printv_line);
+    mbed_trace_printv_function_set(NULL);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%lc %d", (wint_t)'a', 3);
+    ASSERT_STREQ("a 3", buf);
+
+    // cut by the line length
+    mbed_trace_buffer_sizes(10, 0);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%*pH", 20, arr);
+    ASSERT_EQ(expected.substr(0, 9), buf);
+    mbed_trace_buffer_sizes(1024, 0);
+
+#if MBED_CONF_MBED_TRACE_FEA_IPV6 == 1
+    static const uint8_t addr[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    ip6tos_stub.output_string = "2001:db8::1";
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "addr %pI6", addr);
+    ASSERT_STREQ("addr 2001:db8::1", buf);
+    ASSERT_TRUE(memcmp(ip6tos_stub.input_array, addr, 16) == 0);
+    ip6tos_stub.output_string = "2001:db8::/32";
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "prefix %*pP", 32, addr);
+    ASSERT_STREQ("prefix 2001:db8::/32", buf);
+    mbed_tracef(TRACE_LEVEL_INFO, "mygr", "%pI6 %*pP %*pP", nullptr, 1, nullptr, 200, addr);
+    ASSERT_STREQ("<null> <err> <err>", buf);
+
+    // nothing is done for a trace which is not printed
+    memset(ip6tos_stub.input_array, 0, sizeof(ip6tos_stub.input_array));
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO | TRACE_MODE_PLAIN);
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "addr %pI6", addr);
+    ASSERT_EQ(0, ip6tos_stub.input_array[0]);
+#endif
+
+#if MBED_CONF_MBED_TRACE_FEA_HISTORY == 1
+    // the data is copied to the history records
+    history_out.clear();
+    mbed_trace_printn_function_set(myhistoryprint);
+    mbed_trace_config_set(TRACE_ACTIVE_LEVEL_INFO | TRACE_MODE_PLAIN);
+    ASSERT_EQ(0, mbed_trace_history_enable(2));
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "arr %*pH", 3, arr);
+    uint8_t big[200] = {0};
+    mbed_tracef(TRACE_LEVEL_DEBUG, "mygr", "%*pH", 200, big);
+    memset(arr, 0, sizeof(arr));
+    mbed_trace_history_dump();
+    // a dump which did not fit to the record ends with '*'
+    ASSERT_EQ(0u, history_out.find("arr a0:a1:a2\n00:00:"));
+    ASSERT_EQ("*\n", history_out.substr(history_out.size() - 2));
+    ASSERT_EQ(0, mbed_trace_history_enable(0));
+#endif
+}
+#endif
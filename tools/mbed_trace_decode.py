@@ -0,0 +1,314 @@
+#!/usr/bin/env python3
+# ----------------------------------------------------------------------------
+# Copyright 2021 Pelion.
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------------------------------------------------------
+"""
+Decoder for tokenized mbed-trace records.
+
+Records are produced by mbed_trace_token_function_set() output function. The
+format strings and trace groups are read from the ELF file of the application,
+and the trace lines are printed as mbed_vtracef() would have printed them.
+
+usage: mbed_trace_decode.py application.elf records.bin
+"""
+import argparse
+import ipaddress
+import struct
+import sys
+
+TOKEN_VERSION = 1
+TYPE_HEADER = 0x01
+TYPE_TRACE = 0x02
+TRUNCATED = 0x80
+FLAG_FORMAT_EXT = 0x01
+ANCHOR = b"mbed-trace-token-anchor\0"
+
+TRACE_MODE_PLAIN = 0x80
+TRACE_MODE_COLOR = 0x40
+TRACE_CARRIAGE_RETURN = 0x20
+
+LEVELS = {
+    0x10: ("[DBG ]", ("\x1b[94m", "\x1b[90m")),
+    0x08: ("[INFO]", ("\x1b[39m", "\x1b[39m")),
+    0x04: ("[WARN]", ("\x1b[33m", "\x1b[33m")),
+    0x02: ("[ERR ]", ("\x1b[31m", "\x1b[31m")),
+}
+
+
+class ElfStrings(object):
+    """Read NUL terminated strings from the allocated sections of an ELF file"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF":
+            raise ValueError("%s is not an ELF file" % path)
+        is64 = data[4] == 2
+        endian = "<" if data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x3A)
+            shdr = endian + "IIQQQQIIQQ"
+        else:
+            shoff, = struct.unpack_from(endian + "I", data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", data, 0x2E)
+            shdr = endian + "IIIIIIIIII"
+        self.sections = []
+        for i in range(shnum):
+            fields = struct.unpack_from(shdr, data, shoff + i * shentsize)
+            sh_type, sh_addr, sh_offset, sh_size = fields[1], fields[3], fields[4], fields[5]
+            if sh_addr == 0 or sh_type == 8:  # not loaded or SHT_NOBITS
+                continue
+            self.sections.append((sh_addr, data[sh_offset:sh_offset + sh_size]))
+        self.bias = 0
+
+    def find(self, needle):
+        for addr, content in self.sections:
+            index = content.find(needle)
+            if index >= 0:
+                return addr + index
+        return None
+
+    def string(self, address):
+        address -= self.bias
+        for addr, content in self.sections:
+            if addr <= address < addr + len(content):
+                start = address - addr
+                end = content.find(b"\0", start)
+                return content[start:end].decode("utf-8", "replace")
+        return "<0x%x?>" % (address + self.bias)
+
+
+class Decoder(object):
+    def __init__(self, elf, color_theme=0, timestamps=False):
+        self.elf = elf
+        self.color_theme = color_theme
+        self.timestamps = timestamps
+        self.header = None
+
+    def handle_header(self, record):
+        (version, little, long_size, size_size, ptr_size, config) = struct.unpack_from("<BBBBBB", record, 3)
+        if version != TOKEN_VERSION:
+            raise ValueError("unsupported record version %d" % version)
+        self.endian = "<" if little == 1 else ">"
+        self.sizes = {"long": long_size, "size_t": size_size, "ptr": ptr_size}
+        self.config = config
+        self.format_ext = bool(record[9] & FLAG_FORMAT_EXT) if len(record) > 9 else False
+        anchor, = struct.unpack_from(self.endian + self._int_fmt(ptr_size, False), record, 16)
+        link = self.elf.find(ANCHOR)
+        if link is None:
+            raise ValueError("ELF file does not contain mbed-trace token anchor")
+        self.elf.bias = anchor - link
+        self.header = True
+
+    @staticmethod
+    def _int_fmt(size, signed):
+        fmt = {1: "b", 2: "h", 4: "i", 8: "q"}[size]
+        return fmt if signed else fmt.upper()
+
+    def _read(self, record, pos, size, signed):
+        if pos + size > len(record):
+            raise IndexError
+        value, = struct.unpack_from(self.endian + self._int_fmt(size, signed), record, pos)
+        return value, pos + size
+
+    @staticmethod
+    def _format_ext(ext, length, data):
+        """Render %*pH, %pI6 and %*pP as the trace library does"""
+        if ext == "H":
+            if length <= 0:
+                return ""
+            if not data:
+                return "<null>"
+            return ":".join("%02x" % b for b in data) + ("*" if len(data) < length else "")
+        if ext == "I":
+            return str(ipaddress.IPv6Address(bytes(data))) if len(data) == 16 else "<null>"
+        if length < 0 or length > 128 or (length and not data):
+            return "<err>"
+        value = int.from_bytes(bytes(data) + bytes(16 - len(data)), "big")
+        address = value & ~((1 << (128 - length)) - 1)
+        return "%s/%d" % (ipaddress.IPv6Address(address), length)
+
+    def format_body(self, fmt, record, pos):
+        out = []
+        i = 0
+        while i < len(fmt):
+            c = fmt[i]
+            i += 1
+            if c != "%":
+                out.append(c)
+                continue
+            # flags, width, precision, length, conversion
+            start = i
+            while i < len(fmt) and fmt[i] in "-+ #0":
+                i += 1
+            flags = fmt[start:i]
+            width = ""
+            precision = ""
+            try:
+                if i < len(fmt) and fmt[i] == "*":
+                    value, pos = self._read(record, pos, 4, True)
+                    width = str(value)
+                    i += 1
+                else:
+                    while i < len(fmt) and fmt[i].isdigit():
+                        width += fmt[i]
+                        i += 1
+                if i < len(fmt) and fmt[i] == ".":
+                    i += 1
+                    precision = "."
+                    if i < len(fmt) and fmt[i] == "*":
+                        value, pos = self._read(record, pos, 4, True)
+                        precision += str(value)
+                        i += 1
+                    else:
+                        while i < len(fmt) and fmt[i].isdigit():
+                            precision += fmt[i]
+                            i += 1
+                length = ""
+                while i < len(fmt) and fmt[i] in "hljztL":
+                    length += fmt[i]
+                    i += 1
+                conv = fmt[i] if i < len(fmt) else ""
+                i += 1
+                spec = "%" + flags + width + precision
+                if conv == "%":
+                    out.append("%")
+                elif conv in "diuxXoc":
+                    signed = conv in "di"
+                    if length == "l":
+                        size = self.sizes["long"]
+                    elif length in ("ll", "j"):
+                        size = 8
+                    elif length in ("z", "t"):
+                        size = self.sizes["size_t"]
+                    else:
+                        size = 4
+                    value, pos = self._read(record, pos, size, signed)
+                    if length == "hh":
+                        value &= 0xFF
+                        if signed and value > 0x7F:
+                            value -= 0x100
+                    elif length == "h":
+                        value &= 0xFFFF
+                        if signed and value > 0x7FFF:
+                            value -= 0x10000
+                    if conv == "c":
+                        out.append((spec + "c") % chr(value & 0xFF))
+                    else:
+                        out.append((spec + {"i": "d", "u": "d"}.get(conv, conv)) % value)
+                elif conv in "fFeEgGaA":
+                    if pos + 8 > len(record):
+                        raise IndexError
+                    value, = struct.unpack_from(self.endian + "d", record, pos)
+                    pos += 8
+                    if conv in "aA":
+                        text = float.hex(value)
+                        out.append(text.upper() if conv == "A" else text)
+                    else:
+                        out.append((spec + conv) % value)
+                elif conv == "p" and self.format_ext and fmt.startswith(("H", "I6", "P"), i):
+                    ext = fmt[i]
+                    i += 2 if ext == "I" else 1
+                    if pos >= len(record):
+                        raise IndexError
+                    size = record[pos]
+                    data = record[pos + 1:pos + 1 + size]
+                    if len(data) < size:
+                        raise IndexError
+                    pos += 1 + size
+                    out.append(self._format_ext(ext, int(width or 0), data))
+                elif conv == "p":
+                    value, pos = self._read(record, pos, self.sizes["ptr"], False)
+                    out.append((spec.replace("#", "") + "s") % ("0x%x" % value if value else "(nil)"))
+                elif conv == "s":
+                    if pos >= len(record):
+                        raise IndexError
+                    size = record[pos]
+                    text = record[pos + 1:pos + 1 + size].decode("utf-8", "replace")
+                    pos += 1 + size
+                    out.append((spec + "s") % text)
+                else:
+                    out.append(spec + length + conv)
+            except IndexError:
+                # argument missing from a truncated record
+                out.append("?")
+        return "".join(out)
+
+    def handle_trace(self, record, dlevel):
+        pos = 4
+        ptr = self._int_fmt(self.sizes["ptr"], False)
+        timestamp, fmt_addr, grp_addr = struct.unpack_from(self.endian + "I" + ptr + ptr, record, pos)
+        pos += 4 + 2 * self.sizes["ptr"]
+        body = self.format_body(self.elf.string(fmt_addr), record, pos)
+        if self.config & TRACE_MODE_PLAIN:
+            line = body
+        else:
+            color = (self.config & TRACE_MODE_COLOR) and dlevel in LEVELS
+            line = ""
+            if self.config & TRACE_MODE_COLOR:
+                if self.config & TRACE_CARRIAGE_RETURN:
+                    line += "\r\x1b[2K"
+                if color:
+                    line += LEVELS[dlevel][1][self.color_theme]
+            if self.timestamps:
+                line += "[%u]" % timestamp
+            if dlevel in LEVELS:
+                line += "%s[%-4s]: " % (LEVELS[dlevel][0], self.elf.string(grp_addr))
+            else:
+                line += " " * 14
+            line += body
+            if color:
+                line += "\x1b[0m"
+        return line
+
+    def decode(self, stream):
+        pos = 0
+        while pos + 4 <= len(stream):
+            length, = struct.unpack_from("<H" if self.header is None else self.endian + "H", stream, pos)
+            if length < 4 or pos + length > len(stream):
+                break
+            record = stream[pos:pos + length]
+            pos += length
+            rtype = record[2] & ~TRUNCATED
+            if rtype == TYPE_HEADER:
+                self.handle_header(record)
+            elif rtype == TYPE_TRACE and self.header:
+                yield self.handle_trace(record, record[3])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode tokenized mbed-trace records")
+    parser.add_argument("elf", help="ELF file of the application")
+    parser.add_argument("records", help="file containing the binary records, '-' for stdin")
+    parser.add_argument("--color-theme", type=int, choices=[0, 1], default=0,
+                        help="MBED_TRACE_COLOR_THEME used in the application")
+    parser.add_argument("--timestamps", action="store_true", help="print record timestamps before trace tags")
+    args = parser.parse_args()
+
+    if args.records == "-":
+        stream = sys.stdin.buffer.read()
+    else:
+        with open(args.records, "rb") as f:
+            stream = f.read()
+    decoder = Decoder(ElfStrings(args.elf), args.color_theme, args.timestamps)
+    for line in decoder.decode(stream):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
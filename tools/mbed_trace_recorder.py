@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+# ----------------------------------------------------------------------------
+# Copyright 2021 Pelion.
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# ----------------------------------------------------------------------------
+"""
+Reader for mbed-trace flight recorder regions.
+
+The region is written by mbed_trace_recorder_printn(), for example into a
+file mapped with mmap() or into retained RAM which is dumped after a crash.
+It starts with a 32 byte header, followed by the circular data area:
+
+    uint32 magic        "MTFR", also tells the byte order
+    uint16 version
+    uint16 header_size
+    uint32 size         size of the data area
+    uint32 cursor       offset where the next line is written
+    uint32 wraps        number of times the cursor has wrapped
+    uint32 reserved[3]
+
+The lines are printed from the oldest to the newest. After a wrap the line
+at the cursor is partly overwritten, so it is left out.
+
+usage: mbed_trace_recorder.py region.bin [--offset N]
+"""
+import argparse
+import struct
+import sys
+
+MAGIC = 0x5246544d
+VERSION = 1
+HEADER = "IHHIIII12x"
+
+
+def read_region(data):
+    """Return the recorded text of a region, oldest line first"""
+    for endian in "<>":
+        magic, version, header_size, size, cursor, wraps, _ = \
+            struct.unpack_from(endian + HEADER, data)
+        if magic == MAGIC:
+            break
+    else:
+        raise ValueError("no flight recorder header found")
+    if version != VERSION:
+        raise ValueError("unsupported recorder version %d" % version)
+    if len(data) < header_size + size or cursor >= size:
+        raise ValueError("recorder region is truncated or corrupted")
+    area = data[header_size:header_size + size]
+    if wraps == 0:
+        return area[:cursor]
+    text = area[cursor:] + area[:cursor]
+    return text[text.find(b"\n") + 1:]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Print the lines of an mbed-trace flight recorder region")
+    parser.add_argument("region", help="file containing the region, e.g. the mapped file or a memory dump")
+    parser.add_argument("--offset", type=lambda x: int(x, 0), default=0,
+                        help="offset of the region in the file")
+    args = parser.parse_args()
+
+    with open(args.region, "rb") as f:
+        data = f.read()[args.offset:]
+    try:
+        text = read_region(data)
+    except (ValueError, struct.error) as e:
+        sys.stderr.write("%s: %s\n" % (args.region, e))
+        return 1
+    sys.stdout.write(text.decode("utf-8", "replace"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())